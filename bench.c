@@ -0,0 +1,468 @@
+/* Throughput and latency benchmark of mtmq.
+ *
+ * Every run prints one CSV line (header first), so output can be collected
+ * and compared between builds. See usage() for options.
+ */
+
+
+#ifndef _GNU_SOURCE
+#   define _GNU_SOURCE
+#endif
+
+#include "mtmq.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define MAX_THREADS 64
+#define MAX_LIST 16
+
+
+// Queue engines.
+static const struct {
+    const char *name;
+    int flags;
+} engines[] = {
+    {"mutex", 0},
+    {"spsc", MTMQ_F_SPSC},
+    {"mpmc", MTMQ_F_MPMC},
+};
+#define NUM_ENGINES ((int)(sizeof(engines) / sizeof(engines[0])))
+
+
+// Parameters of single run.
+typedef struct run {
+    const char *test;  // "thr" or "lat"
+    int engine;  // index in engines[]
+    int np;  // number of producers (latency: clients)
+    int nc;  // number of consumers (latency: servers)
+    int size;  // queue size
+    int timed;  // use timed operations instead of blocking ones
+    int pin;  // pin threads to CPUs
+    long msgs;  // messages (latency: round trips) in total
+} run_t;
+
+
+// Thread context.
+typedef struct worker {
+    const run_t *run;
+    int id;
+    long count;  // messages to push (or round trips to make)
+    mtmq_t *reply;  // latency: reply queue of client
+    int64_t *lat;  // latency: round trip times
+} worker_t;
+
+
+static mtmq_t *queue;
+static mtmq_t *replies[MAX_THREADS];
+static pthread_barrier_t start_barrier;
+static int ncpus = 1;
+static int cpus[1024];
+
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void pin_thread(int n)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[n % ncpus], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)n;
+#endif
+}
+
+
+static void init_cpus(void)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        ncpus = 0;
+        for (int i=0; i<CPU_SETSIZE && ncpus<(int)(sizeof(cpus)/sizeof(cpus[0])); i++) {
+            if (CPU_ISSET(i, &set))
+                cpus[ncpus++] = i;
+        }
+    }
+    if (!ncpus) {
+        cpus[0] = 0;
+        ncpus = 1;
+    }
+#endif
+}
+
+
+static int timeout_of(const run_t *r)
+{
+    return r->timed ? 1000 : -1;
+}
+
+
+// Push retrying on timeout, returns MTMQ_RC_OK or final error.
+static int push(mtmq_t *q, int code, void *data, int timeout)
+{
+    int rc;
+    while ((rc = mtmq_push(q, code, data, timeout)) == MTMQ_RC_TIMEDOUT)
+        ;
+    return rc;
+}
+
+
+// Pop retrying on timeout, returns MTMQ_RC_OK or final error.
+static int pop(mtmq_t *q, int *code, void **data, int timeout)
+{
+    int rc;
+    while ((rc = mtmq_pop(q, code, data, timeout)) == MTMQ_RC_TIMEDOUT)
+        ;
+    return rc;
+}
+
+
+static void *thr_producer(void *arg)
+{
+    worker_t *w = arg;
+    int timeout = timeout_of(w->run);
+
+    if (w->run->pin)
+        pin_thread(w->id);
+    pthread_barrier_wait(&start_barrier);
+
+    for (long i=0; i<w->count; i++) {
+        if (push(queue, (int)i, NULL, timeout) != MTMQ_RC_OK) {
+            fprintf(stderr, "push failed\n");
+            exit(1);
+        }
+    }
+
+    return NULL;
+}
+
+
+static void *thr_consumer(void *arg)
+{
+    worker_t *w = arg;
+    int timeout = timeout_of(w->run);
+    int code;
+    void *data;
+    int rc;
+
+    if (w->run->pin)
+        pin_thread(w->run->np + w->id);
+    pthread_barrier_wait(&start_barrier);
+
+    while ((rc = pop(queue, &code, &data, timeout)) == MTMQ_RC_OK)
+        w->count++;
+    if (rc != MTMQ_RC_FINALIZED) {
+        fprintf(stderr, "pop failed\n");
+        exit(1);
+    }
+
+    return NULL;
+}
+
+
+/* Latency client: sends request carrying its id and waits for reply
+ * in its own queue.
+ */
+static void *lat_client(void *arg)
+{
+    worker_t *w = arg;
+    int timeout = timeout_of(w->run);
+    int code;
+    void *data;
+
+    if (w->run->pin)
+        pin_thread(w->id);
+    pthread_barrier_wait(&start_barrier);
+
+    for (long i=0; i<w->count; i++) {
+        int64_t t0 = now_ns();
+        if (push(queue, w->id, NULL, timeout) != MTMQ_RC_OK ||
+                pop(w->reply, &code, &data, timeout) != MTMQ_RC_OK) {
+            fprintf(stderr, "round trip failed\n");
+            exit(1);
+        }
+        w->lat[i] = now_ns() - t0;
+    }
+
+    return NULL;
+}
+
+
+// Latency server: echoes requests to reply queues of clients.
+static void *lat_server(void *arg)
+{
+    worker_t *w = arg;
+    int timeout = timeout_of(w->run);
+    int code;
+    void *data;
+    int rc;
+
+    if (w->run->pin)
+        pin_thread(w->run->np + w->id);
+    pthread_barrier_wait(&start_barrier);
+
+    while ((rc = pop(queue, &code, &data, timeout)) == MTMQ_RC_OK) {
+        if (push(replies[code], code, data, timeout) != MTMQ_RC_OK) {
+            fprintf(stderr, "reply failed\n");
+            exit(1);
+        }
+    }
+    if (rc != MTMQ_RC_FINALIZED) {
+        fprintf(stderr, "pop failed\n");
+        exit(1);
+    }
+
+    return NULL;
+}
+
+
+static int cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+static int64_t percentile(const int64_t *v, long n, double p)
+{
+    if (!n)
+        return 0;
+    long i = (long)(p * (double)(n-1) + 0.5);
+    return v[i];
+}
+
+
+static mtmq_t *make_queue(const run_t *r)
+{
+    mtmq_attr_t attr;
+    mtmq_attr_init(&attr);
+    attr.flags = engines[r->engine].flags;
+    return mtmq_create_ex(r->size, &attr);
+}
+
+
+static void print_header(void)
+{
+    printf("test,engine,producers,consumers,size,mode,pin,msgs,seconds,msgs_per_sec,"
+           "p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+}
+
+
+static void print_result(const run_t *r, double sec, const int64_t *lat, long nlat)
+{
+    printf("%s,%s,%d,%d,%d,%s,%d,%ld,%.6f,%.0f,%lld,%lld,%lld,%lld,%lld\n",
+           r->test, engines[r->engine].name, r->np, r->nc, r->size,
+           r->timed ? "timed" : "block", r->pin, r->msgs, sec,
+           (sec > 0) ? (double)r->msgs / sec : 0.0,
+           (long long)percentile(lat, nlat, 0.50),
+           (long long)percentile(lat, nlat, 0.90),
+           (long long)percentile(lat, nlat, 0.99),
+           (long long)percentile(lat, nlat, 0.999),
+           (long long)(nlat ? lat[nlat-1] : 0));
+    fflush(stdout);
+}
+
+
+static int run_one(const run_t *r)
+{
+    pthread_t tp[MAX_THREADS], tc[MAX_THREADS];
+    worker_t wp[MAX_THREADS], wc[MAX_THREADS];
+    int lat = !strcmp(r->test, "lat");
+    int64_t *samples = NULL;
+    long nsamples = 0;
+
+    queue = make_queue(r);
+    if (!queue)
+        return -1;
+
+    if (lat) {
+        samples = malloc(sizeof(*samples) * (r->msgs ? r->msgs : 1));
+        if (!samples)
+            return -1;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, r->np + r->nc + 1);
+
+    long off = 0;
+    for (int i=0; i<r->np; i++) {
+        memset(&wp[i], 0, sizeof(wp[i]));
+        wp[i].run = r;
+        wp[i].id = i;
+        wp[i].count = r->msgs / r->np + (i < r->msgs % r->np);
+        if (lat) {
+            replies[i] = make_queue(r);
+            if (!replies[i])
+                return -1;
+            wp[i].reply = replies[i];
+            wp[i].lat = samples + off;
+        }
+        off += wp[i].count;
+        pthread_create(&tp[i], NULL, lat ? lat_client : thr_producer, &wp[i]);
+    }
+    for (int i=0; i<r->nc; i++) {
+        memset(&wc[i], 0, sizeof(wc[i]));
+        wc[i].run = r;
+        wc[i].id = i;
+        pthread_create(&tc[i], NULL, lat ? lat_server : thr_consumer, &wc[i]);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    int64_t t0 = now_ns();
+
+    for (int i=0; i<r->np; i++)
+        pthread_join(tp[i], NULL);
+    mtmq_finalize(queue);
+    for (int i=0; i<r->nc; i++)
+        pthread_join(tc[i], NULL);
+
+    double sec = (double)(now_ns() - t0) / 1e9;
+
+    if (lat) {
+        nsamples = r->msgs;
+        qsort(samples, nsamples, sizeof(*samples), cmp_i64);
+        for (int i=0; i<r->np; i++)
+            mtmq_destroy(replies[i]);
+    } else {
+        long got = 0;
+        for (int i=0; i<r->nc; i++)
+            got += wc[i].count;
+        if (got != r->msgs) {
+            fprintf(stderr, "lost messages: %ld of %ld\n", r->msgs - got, r->msgs);
+            return -1;
+        }
+    }
+
+    print_result(r, sec, samples, nsamples);
+
+    pthread_barrier_destroy(&start_barrier);
+    mtmq_destroy(queue);
+    free(samples);
+    return 0;
+}
+
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -T tests    comma separated list of thr (throughput), lat (round trip latency)\n"
+        "  -e engines  comma separated list of mutex, spsc, mpmc\n"
+        "  -t configs  comma separated list of PxC thread configurations, e.g. 1x1,4x1,1x4,4x4\n"
+        "  -s sizes    comma separated list of queue sizes\n"
+        "  -m modes    comma separated list of block, timed\n"
+        "  -n msgs     number of messages (throughput)\n"
+        "  -l trips    number of round trips (latency)\n"
+        "  -P          pin threads to CPUs\n"
+        "Runs not supported by engine (spsc with several threads on one side) are skipped.\n",
+        prog);
+}
+
+
+// Split comma separated list in place.
+static int split(char *s, char **items)
+{
+    int n = 0;
+    for (char *tok = strtok(s, ","); tok && n < MAX_LIST; tok = strtok(NULL, ","))
+        items[n++] = tok;
+    return n;
+}
+
+
+int main(int argc, char **argv)
+{
+    char tests_def[] = "thr,lat";
+    char engines_def[] = "mutex,spsc,mpmc";
+    char configs_def[] = "1x1,4x1,1x4,4x4";
+    char sizes_def[] = "16,1024";
+    char modes_def[] = "block,timed";
+    char *tests_arg = tests_def, *engines_arg = engines_def, *configs_arg = configs_def;
+    char *sizes_arg = sizes_def, *modes_arg = modes_def;
+    long msgs = 1000000, trips = 100000;
+    int pin = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "T:e:t:s:m:n:l:Ph")) != -1) {
+        switch (opt) {
+        case 'T': tests_arg = optarg; break;
+        case 'e': engines_arg = optarg; break;
+        case 't': configs_arg = optarg; break;
+        case 's': sizes_arg = optarg; break;
+        case 'm': modes_arg = optarg; break;
+        case 'n': msgs = atol(optarg); break;
+        case 'l': trips = atol(optarg); break;
+        case 'P': pin = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    char *tests[MAX_LIST], *engs[MAX_LIST], *configs[MAX_LIST], *sizes[MAX_LIST], *modes[MAX_LIST];
+    int ntests = split(tests_arg, tests);
+    int nengs = split(engines_arg, engs);
+    int nconfigs = split(configs_arg, configs);
+    int nsizes = split(sizes_arg, sizes);
+    int nmodes = split(modes_arg, modes);
+
+    init_cpus();
+    print_header();
+
+    for (int it=0; it<ntests; it++)
+    for (int ie=0; ie<nengs; ie++)
+    for (int ic=0; ic<nconfigs; ic++)
+    for (int is=0; is<nsizes; is++)
+    for (int im=0; im<nmodes; im++) {
+        run_t r;
+        memset(&r, 0, sizeof(r));
+
+        if (!strcmp(tests[it], "thr") || !strcmp(tests[it], "lat"))
+            r.test = tests[it];
+        r.engine = -1;
+        for (int i=0; i<NUM_ENGINES; i++) {
+            if (!strcmp(engs[ie], engines[i].name))
+                r.engine = i;
+        }
+        if (sscanf(configs[ic], "%dx%d", &r.np, &r.nc) != 2)
+            r.np = 0;
+        r.size = atoi(sizes[is]);
+        r.timed = !strcmp(modes[im], "timed");
+        r.pin = pin;
+        r.msgs = !strcmp(tests[it], "lat") ? trips : msgs;
+
+        if (!r.test || r.engine < 0 || r.np <= 0 || r.nc <= 0 || r.size <= 0 ||
+                r.np > MAX_THREADS || r.nc > MAX_THREADS || r.msgs <= 0 ||
+                (!r.timed && strcmp(modes[im], "block"))) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        // SPSC queue supports single thread on each side (latency server also pushes replies)
+        if ((engines[r.engine].flags & MTMQ_F_SPSC) && (r.np > 1 || r.nc > 1))
+            continue;
+
+        if (run_one(&r) != 0) {
+            fprintf(stderr, "run failed: %s %s %dx%d size %d\n",
+                    r.test, engines[r.engine].name, r.np, r.nc, r.size);
+            return 1;
+        }
+    }
+
+    return 0;
+}
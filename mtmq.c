@@ -4,25 +4,117 @@
 
 
 #include "mtmq.h"
+#include "mtmq_clock.h"
+#include "mtmq_trace.h"
 
 #include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 
+#ifndef _WIN32
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#endif
+#ifdef __linux__
+#   include <sys/eventfd.h>
+#   include <sys/syscall.h>
+#endif
 
-/* Clock type to use when waiting on condition variable.
+
+/* Futex based waiting of mutex engine.
  *
- * Use of CLOCK_MONOTONIC ensures waiting does not hang if
- * host time is set back in time. But it isn't supported on MinGW.
+ * On Linux mutex engine parks waiters on futex words instead of condition
+ * variables, so wake-ups are issued after mutex is released and only for
+ * waiters not woken yet. Define MTMQ_NO_FUTEX to use condition variables.
  */
-#ifdef _WIN32
-#   define MTMQ_CLOCK_TYPE CLOCK_REALTIME
+#if defined(__linux__) && !defined(MTMQ_NO_FUTEX)
+#   define MTMQ_WITH_FUTEX 1
+#   include <linux/futex.h>
+#   include <sys/syscall.h>
+#else
+#   define MTMQ_WITH_FUTEX 0
+#endif
+
+
+/* Processor hint for busy-wait loops.
+ *
+ * Lets sibling hyperthread run and saves power while spinning.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#   define MTMQ_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#   define MTMQ_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#   define MTMQ_CPU_RELAX() ((void)0)
+#endif
+
+
+/* NUMA placement of queue memory.
+ *
+ * On Linux queue memory is bound to node by mbind() system call, so libnuma
+ * is not needed. Elsewhere MTMQ_F_NUMA flag is accepted, but has no effect.
+ */
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)
+#   define MTMQ_WITH_NUMA 1
+#else
+#   define MTMQ_WITH_NUMA 0
+#endif
+
+// Max number of NUMA nodes.
+#define MTMQ_NUMA_NODES 1024
+
+
+/* Huge page size used to round up length of huge page mapping.
+ *
+ * 2 MB is default huge page size on x86 and most of ARM systems.
+ */
+#ifndef MTMQ_HUGE_PAGE
+#   define MTMQ_HUGE_PAGE (2u << 20)
+#endif
+
+
+/* Cache line size used to separate data written by different threads.
+ *
+ * 128 covers adjacent line prefetch on x86 and actual line size of some ARM cores.
+ */
+#ifndef MTMQ_CACHE_LINE
+#   define MTMQ_CACHE_LINE 128
+#endif
+
+
+/* Queue statistics.
+ *
+ * Define MTMQ_NO_STATS to compile statistics out, mtmq_get_stats() then
+ * returns MTMQ_RC_ERROR.
+ */
+#ifndef MTMQ_NO_STATS
+#   define MTMQ_WITH_STATS 1
 #else
-#   define MTMQ_CLOCK_TYPE CLOCK_MONOTONIC
+#   define MTMQ_WITH_STATS 0
 #endif
 
 
+// Number of spin iterations with exponential pause backoff before yielding.
+#define MTMQ_SPIN_PAUSES 7
+
+
+/* Finalized bit of lock-free engines tail counter.
+ *
+ * Lock-free producers publish elements by CAS on tail, so setting this bit
+ * makes finalization and push linearizable without taking mutex.
+ */
+#define MTMQ_FIN_BIT ((uint64_t)1 << 63)
+
+
 // Queue element.
 typedef struct mtmq_elt {
     int code;
@@ -30,245 +122,3641 @@ typedef struct mtmq_elt {
 } mtmq_elt_t;
 
 
-// Queue.
+/* Segment of elastic queue (mutex engine).
+ *
+ * Segments are chained from the one consumer reads (seg_head) to the one
+ * producer writes (seg_tail) and each is filled and drained linearly, so
+ * growing queue never moves existing elements.
+ */
+typedef struct mtmq_seg {
+    struct mtmq_seg *next;  // next (newer) segment
+    int size;  // number of elements in segment
+    int first;  // index of first element to read
+    int last;  // index of next element to write
+    mtmq_elt_t arr[];
+} mtmq_seg_t;
+
+
+// Priority lane of mutex engine, elements of lane i are arr[i*size ... (i+1)*size-1].
+typedef struct mtmq_lane {
+    int first;  // index of first element of lane
+    int num;  // number of elements in lane
+} mtmq_lane_t;
+
+
+/* Watcher of queue, its callback is called (with queue mutex locked) whenever
+ * readers (or writers) of queue are woken up. Registered watcher counts as
+ * waiting reader (writer), so lock-free engines take the wake up path while
+ * it is registered. One-shot watcher of mtmq_notify() is unregistered when
+ * woken up, and its callback is called once queue mutex is released.
+ */
+typedef struct mtmq_notify mtmq_watch_t;
+
+
+/* Queue element of MPMC engine.
+ *
+ * Sequence counter tells which lap of the ring the slot belongs to:
+ *   seq == 2*pos - slot is free for producer that claimed position pos
+ *   seq == 2*pos + 1 - slot holds element pushed at position pos
+ * Consumer releases slot by setting seq = 2*(pos + size). Doubling keeps
+ * both states distinct even for queue of size 1.
+ */
+typedef struct mtmq_cell {
+    _Atomic uint64_t seq;
+    mtmq_elt_t elt;
+} mtmq_cell_t;
+
+
+// Waiting statistics of one side of queue, updated under mutex.
+typedef struct mtmq_wstat {
+    uint64_t waits;
+    uint64_t timeouts;
+    uint64_t wait_ns;
+    uint64_t hist[MTMQ_STATS_HIST];
+} mtmq_wstat_t;
+
+
+/* Queue.
+ *
+ * Fields are grouped by who writes them, each group on its own cache line(s):
+ * read-mostly configuration, mutex and condition variables, producer side
+ * and consumer side. Waiting counter of each side lives on the other side's
+ * line, because it is read on every operation of the other side and written
+ * only when this side goes to sleep.
+ */
 struct mtmq {
+    int flags;  // creation flags
+    int size;  // queue max size
+    int mask;  // size - 1 if size is power of two, 0 otherwise
+    int levels;  // number of priority levels, 1 - single FIFO ring
+    int starve_limit;  // pops from higher lanes in a row while lower lanes wait, 0 - no limit
+    int spin_max;  // max spin duration in nanoseconds, 0 - don't spin
+    int rd_batch;  // blocked readers are woken up once queue holds rd_batch elements, 0 - at once
+    int wr_batch;  // blocked writers are woken up once queue has room for wr_batch elements, 0 - at once
+    int batch_ms;  // max time blocked side waits for its batch after first element (or slot), 0 - no limit
+    atomic_int fin;  // finalized flag
+    struct mtmq_lane *lanes;  // priority lanes (or NULL if levels == 1)
+    struct mtmq_seg *seg_base;  // elastic queue: segment of min size allocated with queue (or NULL)
+    struct mtmq **shards;  // sharded queue: its shards (or NULL)
+    int nshards;  // sharded queue: number of shards
+    uint32_t cfl_mask;  // conflating queue: mask of key index (0 if queue is not conflating)
+    mtmq_evict_fn evict;  // overwriting queue: callback for dropped messages (or NULL)
+    void *evict_arg;  // argument of evict callback
+    size_t payload_off;  // offset of inline payload slots, one per element (or 0)
+    size_t payload_stride;  // distance between payload slots
+    size_t stamp_off;  // offset of enqueue time stamps, one per element (or 0)
+    atomic_int efd;  // readable end of signalling descriptor, -1 until mtmq_get_fd()
+    size_t shm_len;  // length of shared memory mapping, 0 if queue is on heap
+    size_t map_len;  // length of private mapping (MTMQ_F_NUMA, MTMQ_F_HUGE), 0 if queue is on heap
+    atomic_uint shm_magic;  // MTMQ_SHM_MAGIC once shared queue is initialized
+#if MTMQ_WITH_FUTEX
+    int fx_priv;  // FUTEX_PRIVATE_FLAG, or 0 if queue is shared between processes
+#endif
+    int efd_wr;  // writable end (same as efd for eventfd)
+
+    alignas(MTMQ_CACHE_LINE)
     pthread_mutex_t mtx;  // mutex
     pthread_cond_t cond_rd;  // condition variable for readers
     pthread_cond_t cond_wr;  // condition variable for writers
-    int num_rd;  // number of currently waiting readers
-    int num_wr;  // number of currently waiting writers
+    int wr_busy;  // mutex engine: producer holds reservation of slot at last
+    int rd_busy;  // mutex engine: consumer holds element at first peeked
+    atomic_int fd_sig;  // signalling descriptor was made readable
+    mtmq_watch_t *watch[2];  // lists of watchers of readers and writers
+    mtmq_watch_t *fired;  // one-shot watchers to call once mutex is released
+    uint32_t lane_bits;  // bit i is set if lane i is not empty
+    int streak;  // pops from top lane in a row while lower lanes wait
+    struct mtmq_seg *seg_head;  // elastic queue: oldest segment
+    struct mtmq_seg *seg_tail;  // elastic queue: newest segment
+    int seg_cap;  // elastic queue: total size of chained segments
+    struct mtmq_seg *seg_free;  // unbounded queue: emptied segments for reuse
+#if MTMQ_WITH_FUTEX
+    atomic_uint fx_seq[2];  // futex words of readers [0] and writers [1], bumped by wake-up
+    int fx_park[2];  // number of waiters parked on futex word
+    int fx_sig[2];  // parked waiters woken up, but not returned yet
+    int fx_pend[2];  // wake-ups to issue once mutex is released
+#endif
+#if MTMQ_WITH_STATS
+    mtmq_wstat_t wstat[2];  // waiting statistics of readers [0] and writers [1]
+    uint64_t backs;  // elements taken by mtmq_pop_back(), which moves tail back
+    uint64_t dropped;  // elements dropped by overwriting pushes
+#endif
 
-    int fin;  // finalized flag
+    /* Ring state.
+     *
+     * Counters are free-running, so number of elements is tail - head and
+     * neither side writes a shared element counter. Mutex engine updates
+     * head/first and tail/last under mutex, lock-free engines without it.
+     * SPSC producer owns tail/last/head_cache, consumer owns head/first/tail_cache.
+     * With stats producers of other engines keep head_cache for stat_hwm().
+     * Cached copies of the other side's counter let each side skip reading
+     * shared cache line while it knows there is room (or data) left.
+     * MPMC producers and consumers claim positions by CAS on tail and head.
+     *
+     * Spin budgets are current spin durations of writers and readers, adapted
+     * towards twice the recently observed waiting time and capped by spin_max.
+     */
 
-    int num;  // number of elements in queue
-    int first;  // index of first element in queue
+    // producer side
+    alignas(MTMQ_CACHE_LINE)
+    _Atomic uint64_t tail;  // number of elements pushed so far (and MTMQ_FIN_BIT)
+    _Atomic uint64_t head_cache;  // producer's last seen value of head
     int last;  // index of last element in queue + 1
+    atomic_int reserved;  // SPSC: producer holds reservation of slot at last
+    atomic_int num_rd;  // number of currently waiting readers
+    atomic_int spin_wr;  // writers spin budget in nanoseconds
+#if MTMQ_WITH_STATS
+    atomic_int max_num;  // high-water mark of number of elements
+#endif
 
-    int size;  // queue max size
-    struct mtmq_elt *arr;  // queue elements array
+    // consumer side
+    alignas(MTMQ_CACHE_LINE)
+    _Atomic uint64_t head;  // number of elements popped so far
+    uint64_t tail_cache;  // consumer's last seen value of tail
+    int first;  // index of first element in queue
+    atomic_int num_wr;  // number of currently waiting writers
+    atomic_int spin_rd;  // readers spin budget in nanoseconds
+#if MTMQ_WITH_STATS
+    _Atomic uint64_t res_num;  // number of stamped elements taken
+    _Atomic uint64_t res_ns;  // total residency time of taken elements
+    _Atomic uint64_t res_hist[MTMQ_STATS_HIST];  // taken elements by residency time
+#endif
 };
 
 
-// Internal helper function for timeout calculation.
-static void calc_abs_timeout(struct timespec *ts, int timeout_ms)
+/* Size of queue structure rounded up to cache line. Elements array (or cells
+ * of MPMC engine) follows it in the same block.
+ */
+#define MTMQ_HDR_SIZE ((sizeof(mtmq_t) + MTMQ_CACHE_LINE-1) & ~(size_t)(MTMQ_CACHE_LINE-1))
+
+
+/* Marker of initialized queue in shared memory. Mixed with structure size,
+ * so process built with different layout does not open it.
+ */
+#define MTMQ_SHM_MAGIC (0x6d746d71u ^ (unsigned)sizeof(mtmq_t))
+
+
+/* Internal helpers to get arrays of queue block. They are located by offset
+ * rather than by stored pointer, so queue in shared memory is valid at any
+ * address it is mapped to.
+ */
+static mtmq_elt_t *ring_arr(mtmq_t *q)
+{
+    return (mtmq_elt_t*)((char*)q + MTMQ_HDR_SIZE);
+}
+
+static mtmq_cell_t *ring_cells(mtmq_t *q)
+{
+    return (mtmq_cell_t*)((char*)q + MTMQ_HDR_SIZE);
+}
+
+
+// Internal helper function to allocate memory aligned to cache line.
+static void *mem_alloc(size_t size)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, MTMQ_CACHE_LINE);
+#else
+    void *p;
+    return posix_memalign(&p, MTMQ_CACHE_LINE, size) ? NULL : p;
+#endif
+}
+
+
+// Internal helper function to free memory allocated by mem_alloc().
+static void mem_free(void *p)
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+
+#ifndef _WIN32
+/* Internal helper to allocate zeroed shared memory block: named POSIX shared
+ * memory object if name is not NULL, or anonymous mapping inherited by
+ * child processes otherwise.
+ */
+static void *shm_alloc(const char *name, size_t len)
+{
+    void *p;
+
+    if (!name) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        return (p == MAP_FAILED) ? NULL : p;
+    }
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return NULL;
+    p = MAP_FAILED;
+    if (ftruncate(fd, (off_t)len) == 0)
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+    return p;
+}
+
+
+/* Internal helper to allocate zeroed private memory block by mmap(), backed
+ * by huge pages with MTMQ_F_HUGE flag: reserved ones if there are any, or
+ * transparent ones otherwise. Length is updated to length of mapping.
+ */
+static void *map_alloc(size_t *len, int flags)
+{
+    void *p;
+
+#ifdef MAP_HUGETLB
+    if ((flags & MTMQ_F_HUGE) && *len >= MTMQ_HUGE_PAGE) {
+        size_t hlen = (*len + MTMQ_HUGE_PAGE-1) & ~(size_t)(MTMQ_HUGE_PAGE-1);
+        p = mmap(NULL, hlen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *len = hlen;
+            return p;
+        }
+    }
+#endif
+
+    p = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (flags & MTMQ_F_HUGE)
+        madvise(p, *len, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+#endif
+
+
+/* Internal helper to bind memory mapping to NUMA node, moving pages already
+ * allocated elsewhere if move is set. Returns 0 on success.
+ */
+static int numa_bind(void *p, size_t len, int node, int move)
+{
+#if MTMQ_WITH_NUMA
+    unsigned long mask[MTMQ_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+    mask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+    // MPOL_BIND and MPOL_MF_MOVE of <numaif.h>
+    return syscall(SYS_mbind, p, len, 2, mask, MTMQ_NUMA_NODES, move ? 2 : 0) == 0 ? 0 : -1;
+#else
+    (void)p;
+    (void)len;
+    (void)node;
+    (void)move;
+    return -1;
+#endif
+}
+
+
+// Internal helper function to get current time in nanoseconds.
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(MTMQ_CLOCK_TYPE, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* Event tracing.
+ *
+ * Compiled in only if MTMQ_TRACE is defined, otherwise trace points expand
+ * to nothing. Each thread records events to its own ring of MTMQ_TRACE_RECS
+ * records, overwriting the oldest ones, and mtmq_trace_write() saves rings
+ * of all threads for tracedec. Where <sys/sdt.h> is available, trace points
+ * are also USDT probes of provider mtmq with queue, arg and n arguments.
+ */
+#ifdef MTMQ_TRACE
+#   ifndef MTMQ_TRACE_RECS
+#       define MTMQ_TRACE_RECS 16384
+#   endif
+#   if defined(__has_include)
+#       if __has_include(<sys/sdt.h>)
+#           include <sys/sdt.h>
+#           define MTMQ_USDT(name, q, arg, n) STAP_PROBE3(mtmq, name, q, arg, n)
+#       endif
+#   endif
+#   ifndef MTMQ_USDT
+#       define MTMQ_USDT(name, q, arg, n) ((void)0)
+#   endif
+#   define MTMQ_TRACE_NOW() now_ns()
+#   define MTMQ_TRACE_EV_AT(q, name, start, arg, n) \
+        do { trace_rec(q, MTMQ_TEV_##name, start, arg, n); MTMQ_USDT(name, q, arg, n); } while (0)
+#else
+#   define MTMQ_TRACE_NOW() 0
+#   define MTMQ_TRACE_EV_AT(q, name, start, arg, n) ((void)(start))
+#endif
+#define MTMQ_TRACE_EV(q, name, arg, n) MTMQ_TRACE_EV_AT(q, name, 0, arg, n)
+
+
+#ifdef MTMQ_TRACE
+// Ring of trace records of thread.
+typedef struct mtmq_trace_buf {
+    struct mtmq_trace_buf *next;  // next ring in list of all rings
+    int thread;  // number of thread
+    _Atomic uint64_t num;  // number of records made so far
+    mtmq_trace_rec_t recs[MTMQ_TRACE_RECS];
+} mtmq_trace_buf_t;
+
+static pthread_mutex_t trace_mtx = PTHREAD_MUTEX_INITIALIZER;  // protects list of rings
+static mtmq_trace_buf_t *trace_bufs;  // rings of all threads, kept after threads exit
+static int trace_threads;  // number of rings
+static _Thread_local mtmq_trace_buf_t *trace_buf;  // ring of calling thread
+
+
+// Internal helper to record trace event (start 0 - event happens now).
+static void trace_rec(mtmq_t *q, int type, int64_t start, uint64_t arg, uint32_t n)
+{
+    mtmq_trace_buf_t *b = trace_buf;
+    if (!b) {
+        b = calloc(1, sizeof(*b));
+        if (!b)
+            return;
+        pthread_mutex_lock(&trace_mtx);
+        b->thread = trace_threads++;
+        b->next = trace_bufs;
+        trace_bufs = b;
+        pthread_mutex_unlock(&trace_mtx);
+        trace_buf = b;
+    }
+
+    uint64_t num = atomic_load_explicit(&b->num, memory_order_relaxed);
+    mtmq_trace_rec_t *r = &b->recs[num % MTMQ_TRACE_RECS];
+    r->ns = start ? (uint64_t)start : (uint64_t)now_ns();
+    r->queue = (uintptr_t)q;
+    r->arg = arg;
+    r->n = n;
+    r->type = (uint16_t)type;
+    r->thread = (uint16_t)b->thread;
+    atomic_store_explicit(&b->num, num+1, memory_order_release);
+}
+#endif
+
+
+/* Save trace records of all threads.
+ * In:
+ *   f - file opened for binary writing
+ * Out:
+ *   MTMQ_RC_OK - done
+ *   MTMQ_RC_ERROR - write failed, or tracing is not compiled in
+ * Note:
+ *   Records of threads running at the same time may be torn, so it should
+ *   be called when queues are quiet. Use tracedec to decode saved file.
+ */
+int mtmq_trace_write(FILE *f)
+{
+#ifdef MTMQ_TRACE
+    if (!f || fwrite(MTMQ_TRACE_MAGIC, 8, 1, f) != 1)
+        return MTMQ_RC_ERROR;
+
+    pthread_mutex_lock(&trace_mtx);
+    for (mtmq_trace_buf_t *b = trace_bufs; b; b = b->next) {
+        uint64_t num = atomic_load_explicit(&b->num, memory_order_acquire);
+        for (uint64_t i = (num > MTMQ_TRACE_RECS) ? num - MTMQ_TRACE_RECS : 0; i < num; i++)
+            fwrite(&b->recs[i % MTMQ_TRACE_RECS], sizeof(mtmq_trace_rec_t), 1, f);
+    }
+    pthread_mutex_unlock(&trace_mtx);
+
+    return (fflush(f) == 0 && !ferror(f)) ? MTMQ_RC_OK : MTMQ_RC_ERROR;
+#else
+    (void)f;
+    return MTMQ_RC_ERROR;
+#endif
+}
+
+
+// Internal helper to lock queue mutex, tracing contended acquisition.
+static int mtx_lock(mtmq_t *q)
 {
-    struct timespec t;
-    t.tv_nsec = timeout_ms;  // store to wider type
-    t.tv_nsec *= 1000000;  // convert milliseconds to nanosecons
+#ifdef MTMQ_TRACE
+    if (pthread_mutex_trylock(&q->mtx) == 0)
+        return 0;
+    int64_t start = now_ns();
+    int rc = pthread_mutex_lock(&q->mtx);
+    MTMQ_TRACE_EV_AT(q, LOCK, start, now_ns() - start, 0);
+    return rc;
+#else
+    return pthread_mutex_lock(&q->mtx);
+#endif
+}
+
+
+/* Initialize queue creation attributes with default values.
+ * In:
+ *   attr - attributes to initialize
+ */
+void mtmq_attr_init(mtmq_attr_t *attr)
+{
+    memset(attr, 0, sizeof(*attr));
+}
+
+
+// Internal helper to create queue on heap, or in shared memory if shared is set.
+static mtmq_t *queue_create(int size, const mtmq_attr_t *attr, int shared, const char *name)
+{
+    mtmq_t *ret;
+    int rc;
+
+    int flags = attr ? attr->flags : 0;
+    if (size <= 0)
+        return NULL;
+    if ((flags & MTMQ_F_SPSC) && (flags & MTMQ_F_MPMC))
+        return NULL;
+
+    int levels = (attr && attr->levels > 1) ? attr->levels : 1;
+    if (levels > MTMQ_MAX_LEVELS)
+        return NULL;
+    if (levels > 1 && ((flags & (MTMQ_F_SPSC | MTMQ_F_MPMC)) || attr->payload_size > 0))
+        return NULL;
+
+    int max_size = (attr && attr->max_size > size) ? attr->max_size : 0;
+    if (flags & MTMQ_F_UNBOUNDED) {
+        if (max_size)
+            return NULL;
+        max_size = INT_MAX;
+    }
+    if (max_size && ((flags & (MTMQ_F_SPSC | MTMQ_F_MPMC)) || levels > 1 || (attr && attr->payload_size > 0)))
+        return NULL;
+    // lanes and segments are referred to by pointers
+    if (shared && (levels > 1 || max_size))
+        return NULL;
+
+    int nshards = (attr && attr->shards > 1) ? attr->shards : 0;
+    if (nshards && (shared || levels > 1 || (flags & MTMQ_F_SPSC) || attr->payload_size > 0))
+        return NULL;
+    if ((flags & MTMQ_F_CONFLATE) && ((flags & (MTMQ_F_SPSC | MTMQ_F_MPMC)) || levels > 1 || max_size
+            || nshards || attr->payload_size > 0 || size > (1 << 30)))
+        return NULL;
+    if ((flags & MTMQ_F_OVERWRITE) && ((flags & (MTMQ_F_SPSC | MTMQ_F_MPMC)) || levels > 1 || max_size
+            || attr->payload_size > 0))
+        return NULL;
+    // segments have no stamps
+    if ((flags & MTMQ_F_STAMP) && max_size)
+        return NULL;
+    if ((flags & MTMQ_F_NUMA) && (attr->numa_node < 0 || attr->numa_node >= MTMQ_NUMA_NODES))
+        return NULL;
+    if (attr && (attr->rd_batch > 1 || attr->wr_batch > 1) && (flags & (MTMQ_F_SPSC | MTMQ_F_MPMC)))
+        return NULL;
+    // callback address is meaningful only in process which created queue
+    if (attr && attr->evict && (shared || !(flags & MTMQ_F_OVERWRITE)))
+        return NULL;
 
-    clock_gettime(MTMQ_CLOCK_TYPE, ts);
-    ts->tv_nsec += t.tv_nsec;
-    ts->tv_sec += ts->tv_nsec / 1000000000;
-    ts->tv_nsec = ts->tv_nsec % 1000000000;
+    if (flags & MTMQ_F_POW2) {
+        if (size > (1 << 30))
+            return NULL;
+        while (size & (size-1))
+            size = (size | (size-1)) + 1;
+    }
+
+    size_t mtmq_size = MTMQ_HDR_SIZE;
+
+    size_t arr_size = sizeof(mtmq_elt_t) * size * levels;
+    if (flags & MTMQ_F_MPMC)
+        arr_size = sizeof(mtmq_cell_t) * size;
+    if (levels > 1)
+        arr_size += sizeof(mtmq_lane_t) * levels;
+    if (max_size)
+        arr_size += sizeof(mtmq_seg_t);
+    // key index has at least twice as many entries as ring
+    uint32_t cfl_size = 0;
+    if (flags & MTMQ_F_CONFLATE) {
+        cfl_size = 2;
+        while (cfl_size < 2 * (uint32_t)size)
+            cfl_size <<= 1;
+        arr_size += sizeof(uint32_t) * cfl_size;
+    }
+    // sharded queue has no ring of its own
+    if (nshards)
+        arr_size = sizeof(mtmq_t*) * nshards;
+    arr_size += (~arr_size + 1) & (MTMQ_CACHE_LINE-1);
+
+    // payload slots are aligned for any type
+    size_t stride = (attr && attr->payload_size > 0) ? attr->payload_size : 0;
+    stride += (~stride + 1) & (alignof(max_align_t)-1);
+    size_t payload_size = stride * size;
+
+    size_t stamp_size = ((flags & MTMQ_F_STAMP) && !nshards) ? sizeof(int64_t) * size * levels : 0;
+
+    size_t total = mtmq_size + arr_size + payload_size + stamp_size;
+    size_t map_len = 0;
+#ifndef _WIN32
+    if (shared)
+        ret = shm_alloc(name, total);
+    else if (flags & (MTMQ_F_NUMA | MTMQ_F_HUGE)) {
+        map_len = total;
+        ret = map_alloc(&map_len, flags);
+    } else
+        ret = mem_alloc(total);
+#else
+    ret = mem_alloc(total);
+#endif
+    if (ret == NULL)
+        return NULL;
+
+    // pages are not touched yet, so they are allocated on the node
+    if (flags & MTMQ_F_NUMA)
+        numa_bind(ret, shared ? total : map_len, attr->numa_node, 0);
+
+    memset(ret, 0, total);
+    if (shared)
+        ret->shm_len = total;
+    ret->map_len = map_len;
+    if (payload_size) {
+        ret->payload_off = mtmq_size + arr_size;
+        ret->payload_stride = stride;
+    }
+    if (stamp_size)
+        ret->stamp_off = mtmq_size + arr_size + payload_size;
+    ret->flags = flags;
+    ret->size = max_size ? max_size : size;
+    ret->mask = (ret->size & (ret->size-1)) ? 0 : (ret->size-1);
+    ret->levels = levels;
+    ret->cfl_mask = cfl_size ? (cfl_size - 1) : 0;
+    if (attr && !nshards) {
+        ret->evict = attr->evict;
+        ret->evict_arg = attr->evict_arg;
+    }
+    ret->starve_limit = (levels > 1 && attr->starve_limit > 0) ? attr->starve_limit : 0;
+    ret->spin_max = (attr && attr->spin_ns > 0) ? attr->spin_ns : 0;
+    if (attr && !nshards) {
+        ret->rd_batch = (attr->rd_batch > 1) ? ((attr->rd_batch < size) ? attr->rd_batch : size) : 0;
+        ret->wr_batch = (attr->wr_batch > 1 && levels == 1) ? ((attr->wr_batch < size) ? attr->wr_batch : size) : 0;
+        ret->batch_ms = (attr->batch_ms > 0) ? attr->batch_ms : 0;
+    }
+    atomic_init(&ret->efd, -1);
+    ret->efd_wr = -1;
+    atomic_init(&ret->spin_rd, ret->spin_max);
+    atomic_init(&ret->spin_wr, ret->spin_max);
+#if MTMQ_WITH_FUTEX
+    ret->fx_priv = shared ? 0 : FUTEX_PRIVATE_FLAG;
+#endif
+    if ((flags & MTMQ_F_MPMC) && !nshards) {
+        for (int i=0; i<size; i++)
+            atomic_init(&ring_cells(ret)[i].seq, 2*i);
+    }
+    if (levels > 1)
+        ret->lanes = (mtmq_lane_t*)(ring_arr(ret) + (size_t)size * levels);
+    if (max_size && !nshards) {
+        ret->seg_base = (mtmq_seg_t*)((char*)ret + mtmq_size);
+        ret->seg_base->size = size;
+        ret->seg_head = ret->seg_tail = ret->seg_base;
+        ret->seg_cap = size;
+    }
+
+    pthread_mutexattr_t ma;
+    pthread_mutexattr_init(&ma);
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    rc = pthread_condattr_setclock(&ca, MTMQ_CLOCK_TYPE);
+    if (rc == 0 && shared) {
+        rc = pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+        if (rc == 0)
+            rc = pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+    }
+    if (rc != 0) {
+        pthread_condattr_destroy(&ca);
+        pthread_mutexattr_destroy(&ma);
+#ifndef _WIN32
+        if (shared) {
+            munmap(ret, total);
+            if (name)
+                shm_unlink(name);
+            return NULL;
+        }
+        if (map_len) {
+            munmap(ret, map_len);
+            return NULL;
+        }
+#endif
+        mem_free(ret);
+        return NULL;
+    }
+
+    pthread_mutex_init(&ret->mtx, &ma);
+    pthread_cond_init(&ret->cond_rd, &ca);
+    pthread_cond_init(&ret->cond_wr, &ca);
+    pthread_condattr_destroy(&ca);
+    pthread_mutexattr_destroy(&ma);
+
+    if (shared)
+        atomic_store(&ret->shm_magic, MTMQ_SHM_MAGIC);
+
+    if (nshards) {
+        mtmq_attr_t sub = *attr;
+        sub.shards = 0;
+        ret->shards = (mtmq_t**)((char*)ret + mtmq_size);
+        ret->nshards = nshards;
+        for (int i=0; i<nshards; i++) {
+            ret->shards[i] = mtmq_create_ex(size, &sub);
+            if (!ret->shards[i]) {
+                mtmq_destroy(ret);
+                return NULL;
+            }
+        }
+    }
+
+    return ret;
 }
 
 
 /* Create queue.
  * In:
- *   size - queue size
+ *   size - queue size
+ * Out:
+ *   NULL - create failed
+ *   not NULL - pointer to created queue
+ */
+mtmq_t *mtmq_create(int size)
+{
+    return mtmq_create_ex(size, NULL);
+}
+
+
+/* Create queue with given attributes.
+ * In:
+ *   size - queue size
+ *   attr - creation attributes (NULL means defaults)
+ * Out:
+ *   NULL - create failed
+ *   not NULL - pointer to created queue
+ * Note:
+ *   Queue created with MTMQ_F_SPSC flag must be used by at most one producer
+ *   thread and at most one consumer thread at a time. Push and pop then do
+ *   not touch mutex unless they have to wait or wake waiting side up.
+ *   Queue created with MTMQ_F_MPMC flag may be used by any number of threads,
+ *   producers and consumers claim slots by CAS and also take mutex only to
+ *   wait or to wake waiting side up.
+ *   With MTMQ_F_POW2 flag size is rounded up to power of two, so that ring
+ *   positions are wrapped by mask instead of division.
+ *   Queue with levels > 1 has a ring of given size for each priority level
+ *   (mutex engine only, without payload slots), see mtmq_push_prio().
+ *   Queue with max_size > size is elastic (mutex engine only, single level,
+ *   without payload slots): it starts with capacity of size elements, grows
+ *   by chaining segments up to max_size elements and shrinks back to size
+ *   once drained.
+ *   Queue created with MTMQ_F_UNBOUNDED flag (mutex engine only, with the same
+ *   restrictions) has no capacity limit, so push never waits. It is chain of
+ *   blocks of size elements, emptied blocks are kept for reuse until queue is
+ *   destroyed.
+ *   Queue with shards > 1 (single level, without payload slots, not SPSC) is
+ *   set of queues of given size and engine. Producer thread always pushes to
+ *   the same shard (or to shard of key, see mtmq_push_key()), so messages of
+ *   one producer keep their order. Consumers take messages from shards in
+ *   rotation and wait on all of them at once, as with mtmq_pop_any().
+ *   Queue created with MTMQ_F_CONFLATE flag (mutex engine only, single level,
+ *   fixed capacity, without payload slots) uses code as key: push of code
+ *   which is already queued replaces data of queued message in place and
+ *   does not wait for room, so queue holds at most one message per code.
+ *   Queue created with MTMQ_F_OVERWRITE flag (mutex engine only, single level,
+ *   fixed capacity, without payload slots) never makes producer wait: push to
+ *   full queue drops its oldest message. Dropped messages are passed to evict
+ *   callback (if set), which is called by pushing thread after releasing
+ *   queue mutex, and counted as dropped in queue statistics.
+ *   With MTMQ_F_NUMA flag queue memory is bound to NUMA node numa_node (on
+ *   Linux, if kernel supports NUMA), see also mtmq_migrate(). With MTMQ_F_HUGE
+ *   flag it is backed by huge pages where possible. Segments of elastic
+ *   and unbounded queues are allocated from heap as usual.
+ *   Mutex engine with rd_batch > 1 wakes blocked consumer up once queue holds
+ *   rd_batch messages, and with wr_batch > 1 (single level only) wakes
+ *   blocked producer up once there is room for wr_batch messages. With
+ *   batch_ms > 0 consumer (producer) woken up by first message (free slot)
+ *   waits for rest of batch at most batch_ms milliseconds. Consumers and
+ *   producers which don't have to block are not delayed.
+ *   Queue created with MTMQ_F_STAMP flag (fixed capacity) stamps every message
+ *   with time of its push (or commit). Consumers account time messages spent
+ *   in queue in residency histogram of queue statistics, and mtmq_pop_aged()
+ *   also returns age of popped message. Replacing data of conflated message
+ *   keeps its stamp, dropped messages are not accounted.
+ */
+mtmq_t *mtmq_create_ex(int size, const mtmq_attr_t *attr)
+{
+    return queue_create(size, attr, 0, NULL);
+}
+
+
+/* Create queue in shared memory, to be used by several processes.
+ * In:
+ *   name - name of POSIX shared memory object to create (like "/name"),
+ *     or NULL for anonymous shared memory inherited by child processes
+ *   size, attr - same as for mtmq_create_ex()
+ * Out:
+ *   NULL - create failed (including if object of this name exists)
+ *   not NULL - pointer to created queue
+ * Note:
+ *   Other processes attach to named queue by mtmq_open_shared(). Queue uses
+ *   process-shared mutex and condition variables (futex words on Linux).
+ *   Priority levels, elastic and unbounded queues, mtmq_pop_any() and
+ *   mtmq_get_fd() are not supported for shared queue. Data pointers are
+ *   passed as is, so between processes they are meaningful only for queue
+ *   with payload slots, where data of popped message points to its slot in
+ *   consumer's mapping. Process must not be killed inside queue operation,
+ *   as it may leave mutex locked.
+ */
+mtmq_t *mtmq_create_shared(const char *name, int size, const mtmq_attr_t *attr)
+{
+#ifndef _WIN32
+    return queue_create(size, attr, 1, name);
+#else
+    (void)name; (void)size; (void)attr;
+    return NULL;
+#endif
+}
+
+
+/* Attach to queue created by mtmq_create_shared() in another process.
+ * In:
+ *   name - name of shared memory object
+ * Out:
+ *   NULL - open failed: no such object or queue is not initialized yet
+ *   not NULL - pointer to queue, release it by mtmq_destroy()
+ */
+mtmq_t *mtmq_open_shared(const char *name)
+{
+#ifndef _WIN32
+    if (!name)
+        return NULL;
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= MTMQ_HDR_SIZE)
+        p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    mtmq_t *q = p;
+    if (atomic_load(&q->shm_magic) != MTMQ_SHM_MAGIC || q->shm_len != (size_t)st.st_size) {
+        munmap(p, st.st_size);
+        return NULL;
+    }
+    return q;
+#else
+    (void)name;
+    return NULL;
+#endif
+}
+
+
+/* Remove name of shared queue.
+ * In:
+ *   name - name of shared memory object
+ * Out:
+ *   MTMQ_RC_OK - done, processes which have queue opened may still use it
+ *   MTMQ_RC_ERROR - no such object
+ */
+int mtmq_unlink_shared(const char *name)
+{
+#ifndef _WIN32
+    if (name && shm_unlink(name) == 0)
+        return MTMQ_RC_OK;
+#else
+    (void)name;
+#endif
+    return MTMQ_RC_ERROR;
+}
+
+
+/* Destroy queue.
+ * In:
+ *   q - queue pointer
+ * Out:
+ *   MTMQ_RC_OK - queue deleted
+ *   MTMQ_RC_ERROR - some error occured
+ * Note:
+ *   Shared queue is only unmapped from calling process, its memory is freed
+ *   once all processes did so (and its name is removed by mtmq_unlink_shared()).
+ */
+int mtmq_destroy(mtmq_t *q)
+{
+    if (!q)
+        return MTMQ_RC_ERROR;
+
+#ifndef _WIN32
+    // other processes may still use synchronization objects of shared queue
+    if (q->shm_len)
+        return munmap(q, q->shm_len) == 0 ? MTMQ_RC_OK : MTMQ_RC_ERROR;
+#endif
+
+    for (int i=0; i<q->nshards; i++) {
+        if (q->shards[i] && mtmq_destroy(q->shards[i]) != MTMQ_RC_OK)
+            return MTMQ_RC_ERROR;
+        q->shards[i] = NULL;
+    }
+
+    int rc = pthread_cond_destroy(&q->cond_wr);
+    if (rc)
+        return MTMQ_RC_ERROR;
+
+    rc = pthread_cond_destroy(&q->cond_rd);
+    if (rc)
+        return MTMQ_RC_ERROR;
+
+    rc = pthread_mutex_destroy(&q->mtx);
+    if (rc)
+        return MTMQ_RC_ERROR;
+
+    for (int i=0; i<2; i++) {
+        for (mtmq_seg_t *seg = i ? q->seg_free : q->seg_head; seg; ) {
+            mtmq_seg_t *next = seg->next;
+            if (seg != q->seg_base)
+                free(seg);
+            seg = next;
+        }
+    }
+
+#ifndef _WIN32
+    int efd = atomic_load(&q->efd);
+    if (efd >= 0) {
+        if (q->efd_wr != efd)
+            close(q->efd_wr);
+        close(efd);
+    }
+
+    if (q->map_len)
+        return munmap(q, q->map_len) == 0 ? MTMQ_RC_OK : MTMQ_RC_ERROR;
+#endif
+
+    mem_free(q);
+    return MTMQ_RC_OK;
+}
+
+
+/* Move queue memory to NUMA node of calling thread.
+ * In:
+ *   q - queue
+ * Out:
+ *   MTMQ_RC_OK - done
+ *   MTMQ_RC_ERROR - queue was not created with MTMQ_F_NUMA or MTMQ_F_HUGE
+ *     flag (or is not shared), or NUMA is not supported
+ * Note:
+ *   Consumer pinned to its CPU may call it to make ring local to itself.
+ *   Queue may be used meanwhile, pages are migrated by kernel. Pages of
+ *   shared queue mapped by other processes are not moved.
+ */
+int mtmq_migrate(mtmq_t *q)
+{
+    int ret = MTMQ_RC_OK;
+
+    if (!q)
+        return MTMQ_RC_ERROR;
+
+    for (int i=0; i<q->nshards; i++) {
+        if (mtmq_migrate(q->shards[i]) != MTMQ_RC_OK)
+            ret = MTMQ_RC_ERROR;
+    }
+
+#if MTMQ_WITH_NUMA
+    unsigned int cpu, node;
+    size_t len = q->map_len ? q->map_len : q->shm_len;
+    if (!len || syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || node >= MTMQ_NUMA_NODES)
+        return MTMQ_RC_ERROR;
+    if (numa_bind(q, len, (int)node, 1) != 0)
+        return MTMQ_RC_ERROR;
+    return ret;
+#else
+    return MTMQ_RC_ERROR;
+#endif
+}
+
+
+// Internal helper to get ring index of free-running position.
+static int ring_idx(mtmq_t *q, uint64_t pos)
+{
+    return q->mask ? (int)(pos & q->mask) : (int)(pos % q->size);
+}
+
+
+// Internal helper to advance ring index by n <= size elements.
+static int ring_next(mtmq_t *q, int i, int n)
+{
+    i += n;
+    if (q->mask)
+        return i & q->mask;
+    return (i < q->size) ? i : (i - q->size);
+}
+
+
+/* Internal helper to get number of elements in ring of mutex or SPSC engine.
+ * Without mutex result is only a snapshot.
+ */
+static int ring_num(mtmq_t *q)
+{
+    uint64_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed) & ~MTMQ_FIN_BIT;
+    return (int)(tail - atomic_load_explicit(&q->head, memory_order_relaxed));
+}
+
+
+// Internal helper to advance counter owned by caller (or updated under mutex).
+static void counter_add(_Atomic uint64_t *c, int n)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+
+#if MTMQ_WITH_STATS
+// Internal helper to get histogram bucket of duration, see mtmq_stats_t.
+static int stat_bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int i = 0;
+
+    while (us > 1 && i < MTMQ_STATS_HIST-1) {
+        us >>= 1;
+        i++;
+    }
+    return i;
+}
+#endif
+
+
+// Internal helper to get time blocking wait starts at (0 without statistics).
+static int64_t stat_clock(void)
+{
+    return MTMQ_WITH_STATS ? now_ns() : 0;
+}
+
+
+/* Internal helper to account blocking wait of given side started at given
+ * time. Must be called with mutex locked.
+ */
+static void stat_wait(mtmq_t *q, int wr, int64_t start, int timedout)
+{
+#if MTMQ_WITH_STATS
+    mtmq_wstat_t *ws = &q->wstat[wr];
+    uint64_t ns = now_ns() - start;
+
+    ws->waits++;
+    ws->timeouts += timedout;
+    ws->wait_ns += ns;
+    ws->hist[stat_bucket(ns)]++;
+#else
+    (void)q; (void)wr; (void)start; (void)timedout;
+#endif
+}
+
+
+/* Internal helper to update high-water mark after producer advanced tail
+ * to given value. Cached head is lower bound of head and is refreshed by
+ * every read, so after reading shared line producers skip it until they
+ * pushed as many elements as the mark was above number of elements then.
+ */
+static void stat_hwm(mtmq_t *q, uint64_t tail)
+{
+#if MTMQ_WITH_STATS
+    int max = atomic_load_explicit(&q->max_num, memory_order_relaxed);
+
+    tail &= ~MTMQ_FIN_BIT;
+    if (tail - atomic_load_explicit(&q->head_cache, memory_order_relaxed) <= (uint64_t)max)
+        return;
+
+    uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    atomic_store_explicit(&q->head_cache, head, memory_order_relaxed);
+    int64_t num = (int64_t)(tail - head);
+    if (num > (int64_t)q->size * q->levels)
+        num = (int64_t)q->size * q->levels;
+    while (num > max && !atomic_compare_exchange_weak_explicit(&q->max_num, &max, (int)num,
+            memory_order_relaxed, memory_order_relaxed))
+        ;
+#else
+    (void)q; (void)tail;
+#endif
+}
+
+
+/* Signalling descriptor.
+ *
+ * Descriptor is readable while queue may have data (or is finalized), and
+ * is written only by the producer which sets fd_sig, so a burst of pushes
+ * costs one write. Consumer that leaves queue empty first drains descriptor,
+ * then drops fd_sig and checks queue again, re-signalling if a push slipped
+ * in. Producers check fd_sig after publishing with sequentially consistent
+ * operation, so either producer sees fd_sig dropped or consumer sees its
+ * element. Mutex engine calls both helpers with mutex locked.
+ */
+
+// Internal helper to check if queue has no elements (for signalling descriptor).
+static int fd_empty(mtmq_t *q)
+{
+    uint64_t head = atomic_load(&q->head);
+    return ((atomic_load(&q->tail) & ~MTMQ_FIN_BIT) == head);
+}
+
+
+// Internal helper to make signalling descriptor readable after push.
+static void fd_signal(mtmq_t *q)
+{
+#ifndef _WIN32
+    int efd = atomic_load(&q->efd);
+    if (efd < 0 || atomic_load(&q->fd_sig))
+        return;
+
+    int sig = 0;
+    if (!atomic_compare_exchange_strong(&q->fd_sig, &sig, 1))
+        return;
+
+    ssize_t rc;
+    if (efd == q->efd_wr) {
+        uint64_t one = 1;
+        rc = write(efd, &one, sizeof(one));
+    } else {
+        char c = 0;
+        rc = write(q->efd_wr, &c, 1);
+    }
+    (void)rc;  // full pipe is readable anyway
+#else
+    (void)q;
+#endif
+}
+
+
+// Internal helper to reset signalling descriptor when consumer finds queue empty.
+static void fd_clear(mtmq_t *q)
+{
+#ifndef _WIN32
+    int efd = atomic_load_explicit(&q->efd, memory_order_acquire);
+    if (efd < 0 || !fd_empty(q) || atomic_load(&q->fin))
+        return;
+
+    char buf[64];
+    if (efd == q->efd_wr) {
+        ssize_t rc = read(efd, buf, sizeof(uint64_t));
+        (void)rc;
+    } else {
+        while (read(efd, buf, sizeof(buf)) > 0)
+            ;
+    }
+
+    atomic_store(&q->fd_sig, 0);
+    if (!fd_empty(q) || atomic_load(&q->fin))
+        fd_signal(q);
+#else
+    (void)q;
+#endif
+}
+
+
+/* Internal helper to convert waiting result to return code. */
+static int wait_rc(int rc)
+{
+    if (rc == ETIMEDOUT)
+        return MTMQ_RC_TIMEDOUT;
+    if (rc == EINTR)
+        return MTMQ_RC_INTERRUPTED;
+    return MTMQ_RC_ERROR;
+}
+
+
+/* Internal helper for lock-free engines: check if given side has to wait.
+ * Before going to sleep must be called with mutex locked and waiters counter
+ * incremented, so loads here are ordered after that increment.
+ */
+static int lf_blocked(mtmq_t *q, int wr)
+{
+    if (q->flags & MTMQ_F_MPMC) {
+        if (wr) {
+            uint64_t pos = atomic_load(&q->tail) & ~MTMQ_FIN_BIT;
+            uint64_t seq = atomic_load(&ring_cells(q)[ring_idx(q, pos)].seq);
+            return (int64_t)(seq - 2*pos) < 0;
+        } else {
+            uint64_t pos = atomic_load(&q->head);
+            uint64_t seq = atomic_load(&ring_cells(q)[ring_idx(q, pos)].seq);
+            return (int64_t)(seq - (2*pos+1)) < 0;
+        }
+    }
+
+    uint64_t head = atomic_load(&q->head);
+    uint64_t tail = atomic_load(&q->tail) & ~MTMQ_FIN_BIT;
+    return wr ? (tail - head == (uint64_t)q->size) : (tail == head);
+}
+
+
+/* Internal helper for lock-free engines: check if some producer has claimed
+ * a slot but not yet published it. Consumers of finalized queue wait for such
+ * elements instead of reporting MTMQ_RC_FINALIZED.
+ */
+static int lf_inflight(mtmq_t *q)
+{
+    if (q->flags & MTMQ_F_MPMC)
+        return (atomic_load(&q->tail) & ~MTMQ_FIN_BIT) != atomic_load(&q->head);
+    return atomic_load(&q->reserved);
+}
+
+
+/* Internal helper: check if spinning side may stop spinning because queue
+ * became available for it or was finalized. Reads state without mutex.
+ */
+static int spin_done(mtmq_t *q, int wr)
+{
+    if (atomic_load_explicit(&q->fin, memory_order_relaxed))
+        return 1;
+    if (q->flags & (MTMQ_F_SPSC | MTMQ_F_MPMC))
+        return !lf_blocked(q, wr);
+
+    // with priority lanes writer stops spinning once some lane has room
+    int num = ring_num(q);
+    return wr ? (num < q->size * q->levels) : (num > 0);
+}
+
+
+/* Internal helper: adapt spin budget of given side to observed waiting time.
+ * Budget moves by 1/8 towards twice the waiting time, or decays by 1/8 if
+ * waiting was too long for spinning to pay off.
+ */
+static void spin_learn(mtmq_t *q, int wr, int64_t waited_ns)
+{
+    atomic_int *budget = wr ? &q->spin_wr : &q->spin_rd;
+    int b = atomic_load_explicit(budget, memory_order_relaxed);
+
+    if (2*waited_ns <= q->spin_max)
+        b += (int)(2*waited_ns - b) / 8;
+    else
+        b -= b / 8;
+
+    atomic_store_explicit(budget, b, memory_order_relaxed);
+}
+
+
+/* Internal helper: spin until queue becomes available for given side, it is
+ * finalized, or spin budget is exhausted. Spinning starts with exponentially
+ * growing series of pause instructions and then switches to yielding cpu.
+ * Returns 1 if waiting is over, 0 if caller has to block.
+ * When 'spun_ns' is not NULL it receives time spent spinning in vain.
+ */
+static int spin_wait(mtmq_t *q, int wr, int64_t *spun_ns)
+{
+    atomic_int *budget = wr ? &q->spin_wr : &q->spin_rd;
+    int limit = atomic_load_explicit(budget, memory_order_relaxed);
+    int64_t start = now_ns();
+    int64_t t = 0;
+
+    for (int i=0; t<limit; i++) {
+        if (spin_done(q, wr)) {
+            spin_learn(q, wr, t);
+            return 1;
+        }
+        if (i < MTMQ_SPIN_PAUSES) {
+            for (int j=0; j < (1<<i); j++)
+                MTMQ_CPU_RELAX();
+        } else
+            sched_yield();
+        t = now_ns() - start;
+    }
+
+    if (spun_ns)
+        *spun_ns = t;
+    return 0;
+}
+
+
+static void mtx_unlock(mtmq_t *q);
+
+
+/* Internal helper for lock-free engines: slow path of push (wr != 0) or
+ * pop (wr == 0). Waits on condition variable until queue becomes available
+ * for given side, is finalized (and has no elements in flight for readers),
+ * or absolute timeout 'to' expires (NULL means wait indefinately).
+ * Spins before blocking if spinning is enabled.
+ * Returns pthread error code of waiting.
+ */
+static int lf_wait(mtmq_t *q, int wr, const struct timespec *to)
+{
+    pthread_cond_t *cond = wr ? &q->cond_wr : &q->cond_rd;
+    atomic_int *num = wr ? &q->num_wr : &q->num_rd;
+    int64_t start = 0;
+    int rc;
+
+    int spin = q->spin_max != 0;
+    if (spin) {
+        if (spin_wait(q, wr, &start))
+            return 0;
+        start = now_ns() - start;
+    }
+
+    rc = mtx_lock(q);
+    if (rc != 0)
+        return rc;
+
+    atomic_fetch_add(num, 1);
+    int64_t blocked = 0;
+    for (rc=0; lf_blocked(q, wr) && (!q->fin || (!wr && lf_inflight(q))) && rc==0; ) {
+        if (!blocked)
+            blocked = stat_clock();
+        int64_t ws = MTMQ_TRACE_NOW();
+        if (to)
+            rc = pthread_cond_timedwait(cond, &q->mtx, to);
+        else
+            rc = pthread_cond_wait(cond, &q->mtx);
+        MTMQ_TRACE_EV_AT(q, WAIT, ws, now_ns() - ws, wr);
+    }
+    atomic_fetch_sub(num, 1);
+    if (blocked)
+        stat_wait(q, wr, blocked, rc == ETIMEDOUT && lf_blocked(q, wr));
+
+    mtx_unlock(q);
+
+    if (spin)
+        spin_learn(q, wr, now_ns() - start);
+
+    return rc;
+}
+
+
+// Internal helper to unlink watcher from its list. Must be called with mutex locked.
+static void watch_unlink(mtmq_t *q, mtmq_watch_t *w)
+{
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        q->watch[w->wr] = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    w->armed = 0;
+    atomic_fetch_sub(w->wr ? &q->num_wr : &q->num_rd, 1);
+}
+
+
+/* Internal helper to notify watchers that readers (or writers) are woken up.
+ * Must be called with mutex locked.
+ */
+static void watch_notify(mtmq_t *q, int wr)
+{
+    mtmq_watch_t *w = q->watch[wr];
+    while (w) {
+        mtmq_watch_t *next = w->next;
+        if (w->once) {
+            watch_unlink(q, w);
+            w->next = q->fired;
+            q->fired = w;
+        } else
+            w->fn(w->arg);
+        w = next;
+    }
+}
+
+
+// Internal helper to register watcher of queue. Must be called with mutex locked.
+static void watch_link(mtmq_t *q, mtmq_watch_t *w)
+{
+    w->prev = NULL;
+    w->next = q->watch[w->wr];
+    if (w->next)
+        w->next->prev = w;
+    q->watch[w->wr] = w;
+    w->armed = 1;
+    atomic_fetch_add(w->wr ? &q->num_wr : &q->num_rd, 1);
+}
+
+
+// Internal helper to register watcher of readers of queue.
+static void watch_add(mtmq_t *q, mtmq_watch_t *w)
+{
+    w->wr = 0;
+    w->once = 0;
+    mtx_lock(q);
+    watch_link(q, w);
+    mtx_unlock(q);
+}
+
+
+// Internal helper to unregister watcher of queue.
+static void watch_del(mtmq_t *q, mtmq_watch_t *w)
+{
+    mtx_lock(q);
+    watch_unlink(q, w);
+    mtx_unlock(q);
+}
+
+
+/* Internal helper for lock-free engines: wake up other side if it is waiting.
+ * Caller must publish its update with sequentially consistent operation, which
+ * pairs with increment of waiters counter in lf_wait(). So either we see the
+ * waiter here, or the waiter sees our update before going to sleep.
+ * When n > 1 elements (or free slots) were published, all waiters are woken.
+ */
+static void lf_wake(mtmq_t *q, int wr, int n)
+{
+    if (atomic_load(wr ? &q->num_wr : &q->num_rd)) {
+        pthread_cond_t *cond = wr ? &q->cond_wr : &q->cond_rd;
+        mtx_lock(q);
+        if (n > 1)
+            pthread_cond_broadcast(cond);
+        else
+            pthread_cond_signal(cond);
+        MTMQ_TRACE_EV(q, WAKE, wr, n);
+        watch_notify(q, wr);
+        mtx_unlock(q);
+    }
+}
+
+
+// Internal helper to get payload slot of element with given index.
+static void *slot_buf(mtmq_t *q, int i)
+{
+    return (char*)q + q->payload_off + (size_t)i * q->payload_stride;
+}
+
+
+// Internal helper to get index of element by its payload slot, -1 if invalid.
+static int slot_idx(mtmq_t *q, void *buf)
+{
+    char *base = (char*)q + q->payload_off;
+    if (!q->payload_off || (char*)buf < base)
+        return -1;
+
+    size_t off = (char*)buf - base;
+    if (off % q->payload_stride || off / q->payload_stride >= (size_t)q->size)
+        return -1;
+    return (int)(off / q->payload_stride);
+}
+
+
+/* Enqueue time stamps.
+ *
+ * Queue created with MTMQ_F_STAMP has array of enqueue times with entry per
+ * element of rings (or per cell of MPMC engine), which follows payload slots
+ * in queue block. Producer stamps element before publishing it and consumer
+ * reads stamp before releasing element, so stamps are ordered by the same
+ * operations as elements themselves. Consumer accounts residency time of
+ * every taken element and keeps age of the last one for mtmq_pop_aged().
+ */
+
+// Age of element last taken by calling thread from stamped queue.
+static _Thread_local int64_t stamp_age;
+
+// Internal helper to get time to stamp elements with (0 if queue is not stamped).
+static int64_t stamp_clock(mtmq_t *q)
+{
+    return q->stamp_off ? now_ns() : 0;
+}
+
+
+// Internal helper to stamp element with given index.
+static void stamp_put(mtmq_t *q, size_t i, int64_t now)
+{
+    if (q->stamp_off)
+        ((int64_t*)((char*)q + q->stamp_off))[i] = now;
+}
+
+
+/* Internal helper to account element with given index taken at given time.
+ * MPMC consumers update statistics concurrently, others one at a time.
+ */
+static void stamp_take(mtmq_t *q, size_t i, int64_t now)
+{
+    if (!q->stamp_off)
+        return;
+
+    int64_t age = now - ((int64_t*)((char*)q + q->stamp_off))[i];
+    if (age < 0)
+        age = 0;
+    stamp_age = age;
+
+#if MTMQ_WITH_STATS
+    _Atomic uint64_t *bucket = &q->res_hist[stat_bucket(age)];
+    if (q->flags & MTMQ_F_MPMC) {
+        atomic_fetch_add_explicit(&q->res_num, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&q->res_ns, age, memory_order_relaxed);
+        atomic_fetch_add_explicit(bucket, 1, memory_order_relaxed);
+    } else {
+        counter_add(&q->res_num, 1);
+        atomic_store_explicit(&q->res_ns, atomic_load_explicit(&q->res_ns, memory_order_relaxed) + age,
+            memory_order_relaxed);
+        counter_add(bucket, 1);
+    }
+#endif
+}
+
+
+/* Internal helper for SPSC engine: wait until there is room for at least one
+ * element. Room for n elements is enough to skip reading consumer's counter.
+ * On success '*ptail' receives current tail and '*proom' number of free slots.
+ */
+static int spsc_room(mtmq_t *q, int n, mtmq_dl_t *dl, uint64_t *ptail, int *proom)
+{
+    uint64_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (tail & MTMQ_FIN_BIT)
+        return MTMQ_RC_FINALIZED;
+
+    uint64_t head = atomic_load_explicit(&q->head_cache, memory_order_relaxed);
+    uint64_t room = q->size - (tail - head);
+    if (room < (uint64_t)n) {
+        head = atomic_load_explicit(&q->head, memory_order_acquire);
+        atomic_store_explicit(&q->head_cache, head, memory_order_relaxed);
+        room = q->size - (tail - head);
+        if (!room) {
+            int rc = dl->timeout ? lf_wait(q, 1, dl_get(dl)) : ETIMEDOUT;
+            tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+            if (tail & MTMQ_FIN_BIT)
+                return MTMQ_RC_FINALIZED;
+            head = atomic_load_explicit(&q->head, memory_order_acquire);
+            atomic_store_explicit(&q->head_cache, head, memory_order_relaxed);
+            room = q->size - (tail - head);
+            if (!room)
+                return wait_rc(rc);
+        }
+    }
+
+    *ptail = tail;
+    *proom = (int)room;
+    return MTMQ_RC_OK;
+}
+
+
+/* Internal helper for SPSC engine: check if queue is finalized and consumer at
+ * given head has nothing more to read. Commit publishes tail before dropping
+ * reservation flag, so tail is checked again after the flag.
+ */
+static int spsc_drained(mtmq_t *q, uint64_t head)
+{
+    if (!(atomic_load(&q->tail) & MTMQ_FIN_BIT) || atomic_load(&q->reserved))
+        return 0;
+    return (atomic_load(&q->tail) & ~MTMQ_FIN_BIT) == head;
+}
+
+
+/* Internal helper for SPSC engine: wait until there is at least one element.
+ * Having n elements is enough to skip reading producer's counter.
+ * On success '*phead' receives current head and '*pavail' number of elements.
+ */
+static int spsc_data(mtmq_t *q, int n, mtmq_dl_t *dl, uint64_t *phead, int *pavail)
+{
+    uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint64_t avail = q->tail_cache - head;
+    if (avail < (uint64_t)n) {
+        uint64_t tail = atomic_load(&q->tail);
+        q->tail_cache = tail & ~MTMQ_FIN_BIT;
+        avail = q->tail_cache - head;
+        if (!avail) {
+            if (spsc_drained(q, head))
+                return MTMQ_RC_FINALIZED;
+            int rc = dl->timeout ? lf_wait(q, 0, dl_get(dl)) : ETIMEDOUT;
+            tail = atomic_load(&q->tail);
+            q->tail_cache = tail & ~MTMQ_FIN_BIT;
+            avail = q->tail_cache - head;
+            if (!avail) {
+                fd_clear(q);
+                return spsc_drained(q, head) ? MTMQ_RC_FINALIZED : wait_rc(rc);
+            }
+        }
+    }
+
+    *phead = head;
+    *pavail = (int)avail;
+    return MTMQ_RC_OK;
+}
+
+
+// Push for SPSC engine.
+static int spsc_push(mtmq_t *q, int code, void *data, mtmq_dl_t *dl)
+{
+    uint64_t tail;
+    int room;
+
+    int ret = spsc_room(q, 1, dl, &tail, &room);
+    if (ret != MTMQ_RC_OK)
+        return ret;
+
+    mtmq_elt_t *e = &ring_arr(q)[q->last];
+    e->code = code;
+    e->data = data;
+    stamp_put(q, q->last, stamp_clock(q));
+
+    // only finalization can change tail under our feet
+    if (!atomic_compare_exchange_strong(&q->tail, &tail, tail+1))
+        return MTMQ_RC_FINALIZED;
+    q->last = ring_next(q, q->last, 1);
+    stat_hwm(q, tail+1);
+    MTMQ_TRACE_EV(q, ENQ, tail+1, 1);
+
+    lf_wake(q, 0, 1);
+    fd_signal(q);
+
+    return MTMQ_RC_OK;
+}
+
+
+// Pop for SPSC engine.
+static int spsc_pop(mtmq_t *q, int *code, void **data, mtmq_dl_t *dl)
+{
+    uint64_t head;
+    int avail;
+
+    int ret = spsc_data(q, 1, dl, &head, &avail);
+    if (ret != MTMQ_RC_OK)
+        return ret;
+
+    mtmq_elt_t *e = &ring_arr(q)[q->first];
+    *code = e->code;
+    *data = e->data;
+    stamp_take(q, q->first, stamp_clock(q));
+    q->first = ring_next(q, q->first, 1);
+    atomic_store(&q->head, head+1);
+    MTMQ_TRACE_EV(q, DEQ, head+1, 1);
+
+    lf_wake(q, 1, 1);
+    fd_clear(q);
+
+    return MTMQ_RC_OK;
+}
+
+
+// Batch push for SPSC engine.
+static int spsc_push_n(mtmq_t *q, const int *codes, void *const *datas, int n, mtmq_dl_t *dl, int *pushed)
+{
+    uint64_t tail;
+    int room;
+
+    int ret = spsc_room(q, n, dl, &tail, &room);
+    if (ret != MTMQ_RC_OK)
+        return ret;
+
+    // copy at most two contiguous runs of ring
+    int k = (room < n) ? room : n;
+    int run = (k < q->size - q->last) ? k : (q->size - q->last);
+    mtmq_elt_t *e = &ring_arr(q)[q->last];
+    for (int i=0; i<run; i++) {
+        e[i].code = codes[i];
+        e[i].data = datas[i];
+    }
+    for (int i=run; i<k; i++) {
+        ring_arr(q)[i-run].code = codes[i];
+        ring_arr(q)[i-run].data = datas[i];
+    }
+    if (q->stamp_off) {
+        int64_t now = now_ns();
+        for (int i=0; i<k; i++)
+            stamp_put(q, (i < run) ? (size_t)q->last + i : (size_t)(i - run), now);
+    }
+
+    if (!atomic_compare_exchange_strong(&q->tail, &tail, tail+k))
+        return MTMQ_RC_FINALIZED;
+    q->last = ring_next(q, q->last, k);
+    stat_hwm(q, tail+k);
+    MTMQ_TRACE_EV(q, ENQ, tail+k, k);
+
+    lf_wake(q, 0, k);
+    fd_signal(q);
+
+    *pushed = k;
+    return MTMQ_RC_OK;
+}
+
+
+// Batch pop for SPSC engine.
+static int spsc_pop_n(mtmq_t *q, int *codes, void **datas, int n, mtmq_dl_t *dl, int *popped)
+{
+    uint64_t head;
+    int avail;
+
+    int ret = spsc_data(q, n, dl, &head, &avail);
+    if (ret != MTMQ_RC_OK)
+        return ret;
+
+    // copy at most two contiguous runs of ring
+    int k = (avail < n) ? avail : n;
+    int run = (k < q->size - q->first) ? k : (q->size - q->first);
+    mtmq_elt_t *e = &ring_arr(q)[q->first];
+    for (int i=0; i<run; i++) {
+        codes[i] = e[i].code;
+        datas[i] = e[i].data;
+    }
+    for (int i=run; i<k; i++) {
+        codes[i] = ring_arr(q)[i-run].code;
+        datas[i] = ring_arr(q)[i-run].data;
+    }
+    if (q->stamp_off) {
+        int64_t now = now_ns();
+        for (int i=0; i<k; i++)
+            stamp_take(q, (i < run) ? (size_t)q->first + i : (size_t)(i - run), now);
+    }
+
+    q->first = ring_next(q, q->first, k);
+    atomic_store(&q->head, head+k);
+    MTMQ_TRACE_EV(q, DEQ, head+k, k);
+
+    lf_wake(q, 1, k);
+    fd_clear(q);
+
+    *popped = k;
+    return MTMQ_RC_OK;
+}
+
+
+/* Reserve slot for SPSC engine.
+ * Reservation flag is raised before checking finalization, so consumer that
+ * sees the queue finalized and empty also sees the reservation and waits for
+ * its commit instead of reporting MTMQ_RC_FINALIZED. The only producer can't
+ * have two reservations, so second one fails instead of clearing the flag.
+ */
+static int spsc_reserve(mtmq_t *q, void **buf, mtmq_dl_t *dl)
+{
+    uint64_t tail;
+    int room;
+
+    if (atomic_load_explicit(&q->reserved, memory_order_relaxed))
+        return MTMQ_RC_ERROR;
+    atomic_store(&q->reserved, 1);
+    if (atomic_load(&q->tail) & MTMQ_FIN_BIT) {
+        atomic_store(&q->reserved, 0);
+        lf_wake(q, 0, 1);
+        return MTMQ_RC_FINALIZED;
+    }
+
+    int ret = spsc_room(q, 1, dl, &tail, &room);
+    if (ret != MTMQ_RC_OK) {
+        atomic_store(&q->reserved, 0);
+        lf_wake(q, 0, 1);
+        return ret;
+    }
+
+    *buf = slot_buf(q, q->last);
+    return MTMQ_RC_OK;
+}
+
+
+// Commit reserved slot for SPSC engine.
+static int spsc_commit(mtmq_t *q, void *buf, int code)
+{
+    if (!atomic_load_explicit(&q->reserved, memory_order_relaxed) || buf != slot_buf(q, q->last))
+        return MTMQ_RC_ERROR;
+
+    mtmq_elt_t *e = &ring_arr(q)[q->last];
+    e->code = code;
+    e->data = buf;
+    stamp_put(q, q->last, stamp_clock(q));
+
+    // reservation made before finalization is still published
+    uint64_t tail = atomic_fetch_add(&q->tail, 1) + 1;
+    q->last = ring_next(q, q->last, 1);
+    atomic_store(&q->reserved, 0);
+    stat_hwm(q, tail);
+    MTMQ_TRACE_EV(q, ENQ, tail & ~MTMQ_FIN_BIT, 1);
+
+    lf_wake(q, 0, 1);
+    fd_signal(q);
+
+    return MTMQ_RC_OK;
+}
+
+
+// Peek first element for SPSC engine.
+static int spsc_peek(mtmq_t *q, int *code, void **buf, mtmq_dl_t *dl)
+{
+    uint64_t head;
+    int avail;
+
+    int ret = spsc_data(q, 1, dl, &head, &avail);
+    if (ret != MTMQ_RC_OK)
+        return ret;
+
+    *code = ring_arr(q)[q->first].code;
+    *buf = slot_buf(q, q->first);
+    return MTMQ_RC_OK;
+}
+
+
+// Release peeked element for SPSC engine.
+static int spsc_release(mtmq_t *q, void *buf)
+{
+    uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (head == q->tail_cache || buf != slot_buf(q, q->first))
+        return MTMQ_RC_ERROR;
+
+    stamp_take(q, q->first, stamp_clock(q));
+    q->first = ring_next(q, q->first, 1);
+    atomic_store(&q->head, head+1);
+    MTMQ_TRACE_EV(q, DEQ, head+1, 1);
+
+    lf_wake(q, 1, 1);
+    fd_clear(q);
+
+    return MTMQ_RC_OK;
+}
+
+
+/* Internal helper for MPMC engine: claim up to n free slots.
+ * Free slots beyond pos can't be taken by anybody else until tail is moved
+ * past them, so the whole run is claimed by single CAS.
+ * On success '*ppos' receives first claimed position and '*pk' number of slots.
+ */
+static int mpmc_claim_wr(mtmq_t *q, int n, mtmq_dl_t *dl, uint64_t *ppos, int *pk)
+{
+    int waited = 0;  // 1 - waited, 2 - deadline expired
+    int rc = 0;
+    int k;
+
+    uint64_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for (;;) {
+        if (pos & MTMQ_FIN_BIT)
+            return MTMQ_RC_FINALIZED;
+
+        for (k=0; k<n && k<q->size; k++) {
+            uint64_t seq = atomic_load_explicit(&ring_cells(q)[ring_idx(q, pos+k)].seq, memory_order_acquire);
+            if (seq != 2*(pos+k))
+                break;
+        }
+        if (k) {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos+k,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+            continue;
+        }
+
+        uint64_t seq = atomic_load_explicit(&ring_cells(q)[ring_idx(q, pos)].seq, memory_order_acquire);
+        if ((int64_t)(seq - 2*pos) < 0) {
+            // slot still holds element from previous lap, so queue is full
+            if (waited == 2)
+                return wait_rc(rc);
+            rc = dl->timeout ? lf_wait(q, 1, dl_get(dl)) : ETIMEDOUT;
+            waited = rc ? 2 : 1;
+        }
+        pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+
+    *ppos = pos;
+    *pk = k;
+    return MTMQ_RC_OK;
+}
+
+
+/* Internal helper for MPMC engine: claim up to n published elements.
+ * On success '*ppos' receives first claimed position and '*pk' number of elements.
+ */
+static int mpmc_claim_rd(mtmq_t *q, int n, mtmq_dl_t *dl, uint64_t *ppos, int *pk)
+{
+    int waited = 0;  // 1 - waited, 2 - deadline expired
+    int rc = 0;
+    int k;
+
+    uint64_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for (;;) {
+        for (k=0; k<n && k<q->size; k++) {
+            uint64_t seq = atomic_load_explicit(&ring_cells(q)[ring_idx(q, pos+k)].seq, memory_order_acquire);
+            if (seq != 2*(pos+k)+1)
+                break;
+        }
+        if (k) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos+k,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+            continue;
+        }
+
+        uint64_t seq = atomic_load_explicit(&ring_cells(q)[ring_idx(q, pos)].seq, memory_order_acquire);
+        if ((int64_t)(seq - (2*pos+1)) < 0) {
+            // slot is empty, or producer claimed it but not yet stored element
+            uint64_t tail = atomic_load(&q->tail);
+            if ((tail & MTMQ_FIN_BIT) && (tail & ~MTMQ_FIN_BIT) == pos)
+                return MTMQ_RC_FINALIZED;
+            if (waited == 2) {
+                fd_clear(q);
+                return wait_rc(rc);
+            }
+            rc = dl->timeout ? lf_wait(q, 0, dl_get(dl)) : ETIMEDOUT;
+            waited = rc ? 2 : 1;
+        }
+        pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+
+    *ppos = pos;
+    *pk = k;
+    return MTMQ_RC_OK;
+}
+
+
+// Push for MPMC engine.
+static int mpmc_push(mtmq_t *q, int code, void *data, mtmq_dl_t *dl)
+{
+    uint64_t pos;
+    int k;
+
+    int ret = mpmc_claim_wr(q, 1, dl, &pos, &k);
+    if (ret != MTMQ_RC_OK)
+        return ret;
+
+    mtmq_cell_t *c = &ring_cells(q)[ring_idx(q, pos)];
+    c->elt.code = code;
+    c->elt.data = data;
+    stamp_put(q, ring_idx(q, pos), stamp_clock(q));
+    atomic_store(&c->seq, 2*pos+1);
+    stat_hwm(q, pos+1);
+    MTMQ_TRACE_EV(q, ENQ, pos+1, 1);
+
+    lf_wake(q, 0, 1);
+    fd_signal(q);
+
+    return MTMQ_RC_OK;
+}
+
+
+// Pop for MPMC engine.
+static int mpmc_pop(mtmq_t *q, int *code, void **data, mtmq_dl_t *dl)
+{
+    uint64_t pos;
+    int k;
+
+    int ret = mpmc_claim_rd(q, 1, dl, &pos, &k);
+    if (ret != MTMQ_RC_OK)
+        return ret;
+
+    mtmq_cell_t *c = &ring_cells(q)[ring_idx(q, pos)];
+    *code = c->elt.code;
+    *data = c->elt.data;
+    stamp_take(q, ring_idx(q, pos), stamp_clock(q));
+    atomic_store(&c->seq, 2*(pos + q->size));
+    MTMQ_TRACE_EV(q, DEQ, pos+1, 1);
+
+    lf_wake(q, 1, 1);
+    fd_clear(q);
+
+    return MTMQ_RC_OK;
+}
+
+
+// Batch push for MPMC engine.
+static int mpmc_push_n(mtmq_t *q, const int *codes, void *const *datas, int n, mtmq_dl_t *dl, int *pushed)
+{
+    uint64_t pos;
+    int k;
+
+    int ret = mpmc_claim_wr(q, n, dl, &pos, &k);
+    if (ret != MTMQ_RC_OK)
+        return ret;
+
+    int64_t now = stamp_clock(q);
+    for (int i=0; i<k; i++) {
+        mtmq_cell_t *c = &ring_cells(q)[ring_idx(q, pos+i)];
+        c->elt.code = codes[i];
+        c->elt.data = datas[i];
+        stamp_put(q, ring_idx(q, pos+i), now);
+        atomic_store(&c->seq, 2*(pos+i)+1);
+    }
+    stat_hwm(q, pos+k);
+    MTMQ_TRACE_EV(q, ENQ, pos+k, k);
+
+    lf_wake(q, 0, k);
+    fd_signal(q);
+
+    *pushed = k;
+    return MTMQ_RC_OK;
+}
+
+
+// Batch pop for MPMC engine.
+static int mpmc_pop_n(mtmq_t *q, int *codes, void **datas, int n, mtmq_dl_t *dl, int *popped)
+{
+    uint64_t pos;
+    int k;
+
+    int ret = mpmc_claim_rd(q, n, dl, &pos, &k);
+    if (ret != MTMQ_RC_OK)
+        return ret;
+
+    int64_t now = stamp_clock(q);
+    for (int i=0; i<k; i++) {
+        mtmq_cell_t *c = &ring_cells(q)[ring_idx(q, pos+i)];
+        codes[i] = c->elt.code;
+        datas[i] = c->elt.data;
+        stamp_take(q, ring_idx(q, pos+i), now);
+        atomic_store(&c->seq, 2*(pos+i+q->size));
+    }
+    MTMQ_TRACE_EV(q, DEQ, pos+k, k);
+
+    lf_wake(q, 1, k);
+    fd_clear(q);
+
+    *popped = k;
+    return MTMQ_RC_OK;
+}
+
+
+// Reserve slot for MPMC engine.
+static int mpmc_reserve(mtmq_t *q, void **buf, mtmq_dl_t *dl)
+{
+    uint64_t pos;
+    int k;
+
+    int ret = mpmc_claim_wr(q, 1, dl, &pos, &k);
+    if (ret != MTMQ_RC_OK)
+        return ret;
+
+    *buf = slot_buf(q, ring_idx(q, pos));
+    return MTMQ_RC_OK;
+}
+
+
+/* Commit reserved slot for MPMC engine.
+ * Claimed slot keeps sequence number of free state, which tells its position.
+ * Position must be claimed already (below tail): free slot of a position not
+ * reserved yet, e.g. of one committed before and popped, is not accepted.
+ */
+static int mpmc_commit(mtmq_t *q, void *buf, int code)
+{
+    int i = slot_idx(q, buf);
+    if (i < 0)
+        return MTMQ_RC_ERROR;
+
+    mtmq_cell_t *c = &ring_cells(q)[i];
+    uint64_t seq = atomic_load_explicit(&c->seq, memory_order_relaxed);
+    uint64_t tail = atomic_load(&q->tail) & ~MTMQ_FIN_BIT;
+    if ((seq & 1) || (int64_t)(tail - seq/2) <= 0)
+        return MTMQ_RC_ERROR;
+
+    c->elt.code = code;
+    c->elt.data = buf;
+    stamp_put(q, i, stamp_clock(q));
+    atomic_store(&c->seq, seq+1);
+    stat_hwm(q, seq/2 + 1);
+    MTMQ_TRACE_EV(q, ENQ, seq/2 + 1, 1);
+
+    lf_wake(q, 0, 1);
+    fd_signal(q);
+
+    return MTMQ_RC_OK;
+}
+
+
+// Peek first element for MPMC engine.
+static int mpmc_peek(mtmq_t *q, int *code, void **buf, mtmq_dl_t *dl)
+{
+    uint64_t pos;
+    int k;
+
+    int ret = mpmc_claim_rd(q, 1, dl, &pos, &k);
+    if (ret != MTMQ_RC_OK)
+        return ret;
+
+    *code = ring_cells(q)[ring_idx(q, pos)].elt.code;
+    *buf = slot_buf(q, ring_idx(q, pos));
+    return MTMQ_RC_OK;
+}
+
+
+// Release peeked element for MPMC engine.
+static int mpmc_release(mtmq_t *q, void *buf)
+{
+    int i = slot_idx(q, buf);
+    if (i < 0)
+        return MTMQ_RC_ERROR;
+
+    // peeked position is claimed by consumer, so below head
+    mtmq_cell_t *c = &ring_cells(q)[i];
+    uint64_t seq = atomic_load_explicit(&c->seq, memory_order_relaxed);
+    uint64_t head = atomic_load(&q->head);
+    if (!(seq & 1) || (int64_t)(head - (seq - 1)/2) <= 0)
+        return MTMQ_RC_ERROR;
+
+    stamp_take(q, i, stamp_clock(q));
+    atomic_store(&c->seq, seq - 1 + 2*(uint64_t)q->size);
+    MTMQ_TRACE_EV(q, DEQ, (seq - 1)/2 + 1, 1);
+
+    lf_wake(q, 1, 1);
+    fd_clear(q);
+
+    return MTMQ_RC_OK;
+}
+
+
+/* Internal helpers for mutex engine: check if element can be written or read
+ * right now, and if queue is finalized and has nothing more for readers.
+ * Slots reserved by mtmq_reserve() or held by mtmq_peek() stall other producers
+ * or consumers until mtmq_commit() or mtmq_release().
+ */
+// Internal helper to get index of highest set bit of non-zero value.
+static int highest_bit(uint32_t v)
+{
+#if defined(__GNUC__)
+    return 31 - __builtin_clz(v);
+#else
+    int i = 0;
+    while (v >>= 1)
+        i++;
+    return i;
+#endif
+}
+
+
+// Internal helper for mutex engine: append element stamped now to lane of given priority.
+static void lane_put(mtmq_t *q, int prio, int code, void *data, int64_t now)
+{
+    mtmq_lane_t *l = &q->lanes[prio];
+    size_t i = (size_t)prio * q->size + ring_next(q, l->first, l->num);
+    mtmq_elt_t *e = &ring_arr(q)[i];
+    e->code = code;
+    e->data = data;
+    stamp_put(q, i, now);
+    l->num++;
+    q->lane_bits |= 1u << prio;
+}
+
+
+/* Internal helper for mutex engine: take element from highest non-empty lane
+ * at given time. After starve_limit pops in a row from top lane while lower
+ * lanes wait, next lower non-empty lane is served once.
+ */
+static void lane_take(mtmq_t *q, int *code, void **data, int64_t now)
+{
+    uint32_t bits = q->lane_bits;
+    int prio = highest_bit(bits);
+    uint32_t lower = bits & ((1u << prio) - 1);
+
+    if (q->starve_limit && lower) {
+        if (++q->streak > q->starve_limit) {
+            q->streak = 0;
+            prio = highest_bit(lower);
+        }
+    } else
+        q->streak = 0;
+
+    mtmq_lane_t *l = &q->lanes[prio];
+    size_t i = (size_t)prio * q->size + l->first;
+    mtmq_elt_t *e = &ring_arr(q)[i];
+    *code = e->code;
+    *data = e->data;
+    stamp_take(q, i, now);
+    l->first = ring_next(q, l->first, 1);
+    if (!--l->num)
+        q->lane_bits &= ~(1u << prio);
+}
+
+
+/* Internal helper for mutex engine: schedule wake-up of n parked waiters
+ * of given side, skipping ones already woken. Wake-ups are issued by
+ * mtx_unlock(), so woken thread does not run into locked mutex.
+ */
+static void mtx_post(mtmq_t *q, int wr, int n)
+{
+#if MTMQ_WITH_FUTEX
+    int idle = q->fx_park[wr] - q->fx_sig[wr];
+    if (n > idle)
+        n = idle;
+    q->fx_sig[wr] += n;
+    q->fx_pend[wr] += n;
+#else
+    pthread_cond_t *cond = wr ? &q->cond_wr : &q->cond_rd;
+    if (n > 1)
+        pthread_cond_broadcast(cond);
+    else
+        pthread_cond_signal(cond);
+    MTMQ_TRACE_EV(q, WAKE, wr, n);
+#endif
+}
+
+
+/* Internal helper: unlock mutex, issue scheduled wake-ups and call fired
+ * one-shot watchers.
+ */
+static void mtx_unlock(mtmq_t *q)
+{
+    mtmq_watch_t *fired = q->fired;
+    q->fired = NULL;
+#if MTMQ_WITH_FUTEX
+    int pend[2] = {q->fx_pend[0], q->fx_pend[1]};
+    q->fx_pend[0] = q->fx_pend[1] = 0;
+    pthread_mutex_unlock(&q->mtx);
+    for (int wr=0; wr<2; wr++) {
+        if (pend[wr]) {
+            atomic_fetch_add(&q->fx_seq[wr], 1);
+            syscall(SYS_futex, &q->fx_seq[wr], FUTEX_WAKE | q->fx_priv, pend[wr], NULL, NULL, 0);
+            MTMQ_TRACE_EV(q, WAKE, wr, pend[wr]);
+        }
+    }
+#else
+    pthread_mutex_unlock(&q->mtx);
+#endif
+    // callback may register watcher again
+    while (fired) {
+        mtmq_watch_t *w = fired;
+        fired = w->next;
+        w->fn(w->arg);
+    }
+}
+
+
+/* Internal helper for mutex engine: block until woken up or absolute timeout
+ * to expires (NULL - no timeout). Must be called with mutex locked, returns
+ * with mutex locked. Returns pthread error code of waiting.
+ * Note:
+ *   Futex word is read under mutex and bumped by waker after it released
+ *   mutex, so wake-up for state change made after waiter's check is not lost.
+ *   Interrupted waiting is reported as spurious wake-up.
+ */
+static int mtx_block(mtmq_t *q, int wr, const struct timespec *to)
+{
+#if MTMQ_WITH_FUTEX
+    int pend = q->fx_pend[0] || q->fx_pend[1];
+#else
+    int pend = 0;
+#endif
+    // scheduled wake-ups and fired one-shot watchers are not kept waiting for this thread
+    if (pend || q->fired) {
+        mtx_unlock(q);
+        mtx_lock(q);
+        return 0;
+    }
+
+    int64_t start = MTMQ_TRACE_NOW();
+#if MTMQ_WITH_FUTEX
+    int rc = 0;
+    unsigned seq = atomic_load(&q->fx_seq[wr]);
+    q->fx_park[wr]++;
+    pthread_mutex_unlock(&q->mtx);
+    if (syscall(SYS_futex, &q->fx_seq[wr], FUTEX_WAIT_BITSET | q->fx_priv, seq, to, NULL, FUTEX_BITSET_MATCH_ANY) < 0
+        && errno == ETIMEDOUT)
+        rc = ETIMEDOUT;
+    mtx_lock(q);
+    q->fx_park[wr]--;
+    // returning waiter takes one wake-up, whether it was woken or not
+    if (q->fx_sig[wr] > 0)
+        q->fx_sig[wr]--;
+#else
+    pthread_cond_t *cond = wr ? &q->cond_wr : &q->cond_rd;
+    int rc = to ? pthread_cond_timedwait(cond, &q->mtx, to) : pthread_cond_wait(cond, &q->mtx);
+#endif
+    MTMQ_TRACE_EV_AT(q, WAIT, start, now_ns() - start, wr);
+    return rc;
+}
+
+
+// Internal helper for mutex engine: wake up writers after n elements were taken.
+static void mtx_wake_wr(mtmq_t *q, int n)
+{
+    if (!q->num_wr)
+        return;
+    // with batch timer waiter is woken up by first free slot to start it
+    watch_notify(q, 1);
+    if (q->wr_batch && !q->fin) {
+        int room = q->size - ring_num(q);
+        if (room < q->wr_batch && !(q->batch_ms && room == n))
+            return;
+    }
+    // writers of different lanes share condition variable
+    mtx_post(q, 1, (n > 1 || q->lanes) ? INT_MAX : 1);
+}
+
+
+/* Internal helper for elastic queue: make sure newest segment has room,
+ * chaining new segment which doubles capacity (but not beyond max size,
+ * given number of pending elements is appended but not counted yet).
+ * Unbounded queue chains block of fixed size, reusing emptied one if any.
+ * Returns 0 if memory can't be allocated.
+ */
+static int seg_room(mtmq_t *q, int pending)
+{
+    mtmq_seg_t *tail = q->seg_tail;
+    mtmq_seg_t *seg;
+    if (tail->last < tail->size)
+        return 1;
+
+    int size = q->seg_cap;
+    int room = q->size - ring_num(q) - pending;
+    if (size > room)
+        size = room;
+
+    if (q->flags & MTMQ_F_UNBOUNDED) {
+        size = q->seg_base->size;
+        seg = q->seg_free;
+        if (seg)
+            q->seg_free = seg->next;
+        else
+            seg = malloc(sizeof(*seg) + sizeof(mtmq_elt_t) * size);
+    } else
+        seg = malloc(sizeof(*seg) + sizeof(mtmq_elt_t) * size);
+    if (!seg)
+        return 0;
+    seg->next = NULL;
+    seg->size = size;
+    seg->first = 0;
+    seg->last = 0;
+
+    tail->next = seg;
+    q->seg_tail = seg;
+    q->seg_cap += size;
+    return 1;
+}
+
+
+// Internal helper for elastic queue: append element, 0 if memory can't be allocated.
+static int seg_put(mtmq_t *q, int pending, int code, void *data)
+{
+    if (!seg_room(q, pending))
+        return 0;
+
+    mtmq_seg_t *tail = q->seg_tail;
+    tail->arr[tail->last].code = code;
+    tail->arr[tail->last].data = data;
+    tail->last++;
+    return 1;
+}
+
+
+// Internal helper for elastic queue: drop drained segment, which is not base one.
+static void seg_drop(mtmq_t *q, mtmq_seg_t *seg)
+{
+    if (q->flags & MTMQ_F_UNBOUNDED) {
+        seg->next = q->seg_free;
+        q->seg_free = seg;
+    } else
+        free(seg);
+}
+
+
+/* Internal helper for elastic queue: take first element. Drained segments
+ * are unchained, and once queue is empty it shrinks to base segment.
+ */
+static void seg_take(mtmq_t *q, int *code, void **data)
+{
+    mtmq_seg_t *seg = q->seg_head;
+    mtmq_elt_t *e = &seg->arr[seg->first++];
+    *code = e->code;
+    *data = e->data;
+
+    if (seg->first < seg->last)
+        return;
+
+    if (seg != q->seg_tail) {
+        // older segments are full, so this one is drained
+        q->seg_head = seg->next;
+        q->seg_cap -= seg->size;
+        if (seg != q->seg_base)
+            seg_drop(q, seg);
+        return;
+    }
+
+    if (seg != q->seg_base) {
+        seg_drop(q, seg);
+        seg = q->seg_base;
+        seg->next = NULL;
+        q->seg_head = q->seg_tail = seg;
+        q->seg_cap = seg->size;
+    }
+    seg->first = 0;
+    seg->last = 0;
+}
+
+
+/* Conflating queue.
+ *
+ * Key index is open-addressed hash table with linear probing, which maps
+ * code of each queued message to its ring slot (stored as slot + 1, 0 marks
+ * empty entry). It follows elements array in queue block and is updated under
+ * mutex together with ring.
+ */
+static uint32_t *cfl_idx(mtmq_t *q)
+{
+    return (uint32_t*)(ring_arr(q) + q->size);
+}
+
+
+// Internal helper for conflating queue: home entry of code (Fibonacci hashing).
+static uint32_t cfl_hash(mtmq_t *q, int code)
+{
+    return (uint32_t)(((uint32_t)code * 0x9e3779b97f4a7c15ull) >> 32) & q->cfl_mask;
+}
+
+
+// Internal helper for conflating queue: entry of code, or empty entry to put it to.
+static uint32_t cfl_find(mtmq_t *q, int code)
+{
+    uint32_t *idx = cfl_idx(q);
+    uint32_t h = cfl_hash(q, code);
+
+    while (idx[h] && ring_arr(q)[idx[h] - 1].code != code)
+        h = (h + 1) & q->cfl_mask;
+    return h;
+}
+
+
+// Internal helper for conflating queue: replace data of queued message, 0 if code is not queued.
+static int cfl_replace(mtmq_t *q, int code, void *data)
+{
+    uint32_t *idx = cfl_idx(q);
+    uint32_t h = cfl_find(q, code);
+
+    if (!idx[h])
+        return 0;
+    ring_arr(q)[idx[h] - 1].data = data;
+    return 1;
+}
+
+
+// Internal helper for conflating queue: index message just put to ring slot.
+static void cfl_add(mtmq_t *q, int code, int slot)
+{
+    cfl_idx(q)[cfl_find(q, code)] = (uint32_t)slot + 1;
+}
+
+
+/* Internal helper for conflating queue: remove code of message just taken
+ * from ring (its slot is not reused yet). Entries following removed one are
+ * shifted back, so that probe sequences have no holes.
+ */
+static void cfl_del(mtmq_t *q, int code)
+{
+    uint32_t *idx = cfl_idx(q);
+    uint32_t i = cfl_find(q, code);
+    uint32_t j = i;
+
+    for (;;) {
+        j = (j + 1) & q->cfl_mask;
+        if (!idx[j])
+            break;
+        // entry stays if its home is cyclically within (i, j]
+        uint32_t k = cfl_hash(q, ring_arr(q)[idx[j] - 1].code);
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        idx[i] = idx[j];
+        i = j;
+    }
+    idx[i] = 0;
+}
+
+
+/* Internal helper for overwriting queue: drop oldest element of full ring to
+ * make room for new one. Must be called with mutex locked.
+ */
+static void mtx_evict(mtmq_t *q, mtmq_elt_t *ev)
+{
+    *ev = ring_arr(q)[q->first];
+    if (q->cfl_mask)
+        cfl_del(q, ev->code);
+    q->first = ring_next(q, q->first, 1);
+    counter_add(&q->head, 1);
+    MTMQ_TRACE_EV(q, DROP, q->head, 1);
+#if MTMQ_WITH_STATS
+    q->dropped++;
+#endif
+}
+
+
+static int mtx_can_wr(mtmq_t *q, int prio)
+{
+    if (q->lanes)
+        return q->lanes[prio].num < q->size;
+    if (q->seg_base)
+        return ring_num(q) < q->size;
+    return ring_num(q) < q->size && !q->wr_busy;
+}
+
+/* Internal helper for mutex engine: check if elastic queue can't get segment
+ * room for next element. Chains new segment, so it's called by push only,
+ * once mtx_can_wr() said there is room.
+ */
+static int mtx_no_mem(mtmq_t *q)
+{
+    return q->seg_base && !seg_room(q, 0);
+}
+
+static int mtx_can_rd(mtmq_t *q)
+{
+    return ring_num(q) && !q->rd_busy;
+}
+
+static int mtx_drained(mtmq_t *q)
+{
+    return q->fin && !ring_num(q) && !q->wr_busy;
+}
+
+
+/* Internal helper for mutex engine: wake up readers after n elements were
+ * pushed, or reserved or peeked slot was returned. Once queue is finalized all
+ * readers are woken up, as the one which takes last message leaves queue
+ * drained for the others.
+ */
+static void mtx_wake_rd(mtmq_t *q, int n)
+{
+    if (!q->num_rd)
+        return;
+    // with batch timer waiter is woken up by first element to start it
+    int num = ring_num(q);
+    if (!q->rd_batch || q->fin || num >= q->rd_batch || (q->batch_ms && num == n))
+        mtx_post(q, 0, (q->fin || n > 1) ? INT_MAX : 1);
+    watch_notify(q, 0);
+}
+
+
+// Internal helper for mutex engine: check if batch is available for blocked writer or reader.
+static int mtx_batch_ready(mtmq_t *q, int wr)
+{
+    int num = ring_num(q);
+
+    if (q->fin)
+        return 1;
+    return wr ? (q->size - num >= q->wr_batch) : (num >= q->rd_batch);
+}
+
+
+/* Internal helper for mutex engine: keep waiter woken up by first element
+ * (or free slot) blocked until batch is available, but at most batch_ms
+ * milliseconds or until deadline. Must be called with mutex locked.
+ * Returns pthread error code of waiting, expired batch timer is not error.
+ */
+static int mtx_wait_batch(mtmq_t *q, int wr, mtmq_dl_t *dl)
+{
+    int rc = 0;
+    struct timespec bt;
+
+    calc_abs_timeout(&bt, q->batch_ms);
+    const struct timespec *to = dl_get(dl);
+    if (!to || bt.tv_sec < to->tv_sec || (bt.tv_sec == to->tv_sec && bt.tv_nsec < to->tv_nsec))
+        to = &bt;
+
+    while (rc == 0 && !mtx_batch_ready(q, wr))
+        rc = mtx_block(q, wr, to);
+
+    return (rc == ETIMEDOUT && to == &bt) ? 0 : rc;
+}
+
+
+/* Internal helper for mutex engine: spin with mutex unlocked before blocking.
+ * Must be called with mutex locked, returns with mutex locked.
+ * Returns -1 if waiting is over, 0 if spinning is disabled, or otherwise
+ * the time waiting started at (to let caller adapt spin budget).
+ */
+static int64_t mtx_spin(mtmq_t *q, int wr, int prio, mtmq_dl_t *dl)
+{
+    int64_t spun;
+
+    if (!q->spin_max || dl->timeout == 0)
+        return 0;
+
+    mtx_unlock(q);
+    int done = spin_wait(q, wr, &spun);
+    mtx_lock(q);
+
+    if (done && (wr ? (q->fin || mtx_can_wr(q, prio)) : (mtx_can_rd(q) || mtx_drained(q))))
+        return -1;
+    return now_ns() - spun;
+}
+
+
+/* Internal helper for mutex engine: wait until queue (lane of given priority)
+ * has room for writing or is finalized. Must be called with mutex locked.
+ * Returns pthread error code of waiting.
+ */
+static int mtx_wait_wr(mtmq_t *q, int prio, mtmq_dl_t *dl)
+{
+    int rc = 0;
+
+    if (!q->fin && !mtx_can_wr(q, prio)) {
+        // unbounded queue is full only if memory can't be allocated
+        if (q->flags & MTMQ_F_UNBOUNDED)
+            return ENOMEM;
+        if (dl->timeout == 0)
+            return ETIMEDOUT;
+        int64_t start = mtx_spin(q, 1, prio, dl);
+        if (start < 0)
+            return 0;
+        q->num_wr++;
+        int64_t blocked = stat_clock();
+        for (rc=0; !q->fin && !mtx_can_wr(q, prio) && rc==0; ) {
+            rc = mtx_block(q, 1, dl_get(dl));
+            if (rc == 0 && q->wr_batch && q->batch_ms && mtx_can_wr(q, prio))
+                rc = mtx_wait_batch(q, 1, dl);
+        }
+        q->num_wr--;
+        if (blocked)
+            stat_wait(q, 1, blocked, rc == ETIMEDOUT && !q->fin && !mtx_can_wr(q, prio));
+        if (start)
+            spin_learn(q, 1, now_ns() - start);
+    }
+
+    return rc;
+}
+
+
+/* Internal helper for mutex engine: wait until queue has data for reading
+ * or is finalized and drained. Must be called with mutex locked.
+ * Returns pthread error code of waiting.
+ */
+static int mtx_wait_rd(mtmq_t *q, mtmq_dl_t *dl)
+{
+    int rc = 0;
+
+    if (!mtx_can_rd(q) && !mtx_drained(q)) {
+        if (dl->timeout == 0)
+            return ETIMEDOUT;
+        int64_t start = mtx_spin(q, 0, 0, dl);
+        if (start < 0)
+            return 0;
+        q->num_rd++;
+        int64_t blocked = stat_clock();
+        for (rc=0; !mtx_can_rd(q) && !mtx_drained(q) && rc==0; ) {
+            rc = mtx_block(q, 0, dl_get(dl));
+            if (rc == 0 && q->rd_batch && q->batch_ms && mtx_can_rd(q))
+                rc = mtx_wait_batch(q, 0, dl);
+        }
+        q->num_rd--;
+        if (blocked)
+            stat_wait(q, 0, blocked, rc == ETIMEDOUT && !mtx_can_rd(q) && !mtx_drained(q));
+        if (start)
+            spin_learn(q, 0, now_ns() - start);
+    }
+
+    return rc;
+}
+
+
+// Push for mutex engine to lane of given priority.
+static int mtx_push(mtmq_t *q, int prio, int code, void *data, mtmq_dl_t *dl)
+{
+    int ret, rc;
+    int evicted = 0;
+    mtmq_elt_t ev;
+
+    rc = mtx_lock(q);
+    if (rc != 0)
+        return MTMQ_RC_ERROR;
+
+    // conflating queue has room for update of queued code even when full
+    if (q->cfl_mask && !q->fin && cfl_replace(q, code, data)) {
+        mtx_unlock(q);
+        return MTMQ_RC_OK;
+    }
+
+    // overwriting queue makes room by dropping oldest message instead of waiting
+    if ((q->flags & MTMQ_F_OVERWRITE) && !q->fin && ring_num(q) >= q->size) {
+        mtx_evict(q, &ev);
+        evicted = 1;
+    }
+
+    rc = mtx_wait_wr(q, prio, dl);
+
+    if (q->fin)
+        ret = MTMQ_RC_FINALIZED;
+    else if (q->cfl_mask && cfl_replace(q, code, data))
+        ret = MTMQ_RC_OK;
+    else if (mtx_can_wr(q, prio) && mtx_no_mem(q))
+        ret = MTMQ_RC_ERROR;
+    else if (mtx_can_wr(q, prio)) {
+        if (q->lanes)
+            lane_put(q, prio, code, data, stamp_clock(q));
+        else if (q->seg_base)
+            seg_put(q, 0, code, data);
+        else {
+            mtmq_elt_t *e = &ring_arr(q)[q->last];
+            e->code = code;
+            e->data = data;
+            stamp_put(q, q->last, stamp_clock(q));
+            if (q->cfl_mask)
+                cfl_add(q, code, q->last);
+            q->last = ring_next(q, q->last, 1);
+        }
+        counter_add(&q->tail, 1);
+        stat_hwm(q, q->tail);
+        MTMQ_TRACE_EV(q, ENQ, q->tail & ~MTMQ_FIN_BIT, 1);
+        fd_signal(q);
+        mtx_wake_rd(q, 1);
+        ret = MTMQ_RC_OK;
+    } else if (rc == ETIMEDOUT)
+        ret = MTMQ_RC_TIMEDOUT;
+    else if (rc == EINTR)
+        ret = MTMQ_RC_INTERRUPTED;
+    else
+        ret = MTMQ_RC_ERROR;
+
+    mtx_unlock(q);
+
+    if (evicted && q->evict)
+        q->evict(q->evict_arg, ev.code, ev.data);
+
+    return ret;
+}
+
+
+// Internal helper: mtmq_pop_any() with waiting deadline, defined below.
+static int pop_any_dl(mtmq_t **qs, int n, int *which, int *code, void **data, mtmq_dl_t *dl);
+
+
+/* Internal helper for sharded queue: shard of calling producer thread.
+ * Threads are numbered in order of their first push to any sharded queue.
+ */
+static mtmq_t *shard_own(mtmq_t *q)
+{
+    static atomic_uint next;
+    static _Thread_local unsigned int id;  // thread number + 1, 0 - not assigned yet
+
+    if (!id)
+        id = atomic_fetch_add_explicit(&next, 1, memory_order_relaxed) + 1;
+    return q->shards[(id - 1) % (unsigned int)q->nshards];
+}
+
+
+// Internal helper for sharded queue: shard of key (Fibonacci hashing).
+static mtmq_t *shard_key(mtmq_t *q, uint64_t key)
+{
+    uint32_t h = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32);
+    return q->shards[h % (unsigned int)q->nshards];
+}
+
+
+/* Calculate absolute deadline for mtmq_*_until() functions.
+ * In:
+ *   [out]deadline - time timeout_ms milliseconds from now on clock used for waiting
+ *   timeout_ms - timeout in milliseconds
+ */
+void mtmq_deadline(struct timespec *deadline, int timeout_ms)
+{
+    calc_abs_timeout(deadline, timeout_ms);
+}
+
+
+// Internal helper: mtmq_push() with waiting deadline.
+static int queue_push(mtmq_t *q, int code, void *data, mtmq_dl_t *dl)
+{
+    if (!q)
+        return MTMQ_RC_ERROR;
+
+    if (q->shards)
+        return queue_push(shard_own(q), code, data, dl);
+
+    if (q->flags & MTMQ_F_SPSC)
+        return spsc_push(q, code, data, dl);
+    if (q->flags & MTMQ_F_MPMC)
+        return mpmc_push(q, code, data, dl);
+
+    return mtx_push(q, 0, code, data, dl);
+}
+
+
+/* Push message to queue.
+ * In:
+ *   q - queue
+ *   code - integer code to put to queue
+ *   data - pointer to some application data to put to queue
+ *   timeout - timeout in milliseconds for operation to complete
+ *     if timeout < 0, then wait indefinately for queue to become
+ *     available for writing or is finalized.
+ * Out:
+ *   MTMQ_RC_OK - done
+ *   MTMQ_RC_FINALIZED - not done because queue is finalized
+ *   MTMQ_RC_TIMEDOUT - not done because of timeout
+ *   MTMQ_RC_INTERRUPTED - not done because waiting on condition variable was
+ *     interrupted by signal (note that on posix-compliant system this should
+ *     never happen)
+ *   MTMQ_RC_ERROR - some error occured that requires investigation and debugging.
+ */
+int mtmq_push(mtmq_t *q, int code, void *data, int timeout)
+{
+    mtmq_dl_t dl = dl_rel(timeout);
+    return queue_push(q, code, data, &dl);
+}
+
+
+/* Push message to queue, waiting until absolute deadline.
+ * In:
+ *   q, code, data - same as for mtmq_push()
+ *   deadline - time to wait for queue to become available for writing until,
+ *     NULL - wait indefinately
+ * Out:
+ *   same as for mtmq_push()
+ * Note:
+ *   Deadline is absolute time of clock used for waiting (CLOCK_MONOTONIC, or
+ *   CLOCK_REALTIME on Windows), see mtmq_deadline(). Loop of calls sharing
+ *   one deadline thus reads the clock only once, when computing it.
+ */
+int mtmq_push_until(mtmq_t *q, int code, void *data, const struct timespec *deadline)
+{
+    mtmq_dl_t dl = dl_until(deadline);
+    return queue_push(q, code, data, &dl);
+}
+
+
+/* Push message to queue if it can be done without waiting.
+ * In:
+ *   q, code, data - same as for mtmq_push()
+ * Out:
+ *   MTMQ_RC_OK - done
+ *   MTMQ_RC_FINALIZED - not done because queue is finalized
+ *   MTMQ_RC_TIMEDOUT - not done because queue is full
+ *   MTMQ_RC_ERROR - some error occured that requires investigation and debugging.
+ * Note:
+ *   Same as mtmq_push() with zero timeout, for event loops and coroutines
+ *   which wait for queue becoming writable by mtmq_notify() instead.
+ */
+int mtmq_try_push(mtmq_t *q, int code, void *data)
+{
+    mtmq_dl_t dl = dl_rel(0);
+    return queue_push(q, code, data, &dl);
+}
+
+
+/* Push message to queue with given priority.
+ * In:
+ *   q - queue
+ *   prio - priority level from 0 (lowest, used by mtmq_push()) to levels-1
+ *   code, data, timeout - same as for mtmq_push()
+ * Out:
+ *   same as for mtmq_push(), MTMQ_RC_ERROR if prio is out of range
+ * Note:
+ *   Every level has its own ring, so push waits only while ring of its level
+ *   is full. Consumers always take message from highest non-empty level,
+ *   unless starve_limit attribute lets message of lower level through.
+ */
+int mtmq_push_prio(mtmq_t *q, int prio, int code, void *data, int timeout)
+{
+    if (!q || prio < 0 || prio >= q->levels)
+        return MTMQ_RC_ERROR;
+
+    mtmq_dl_t dl = dl_rel(timeout);
+    if (q->shards || (q->flags & (MTMQ_F_SPSC | MTMQ_F_MPMC)))
+        return queue_push(q, code, data, &dl);
+
+    return mtx_push(q, prio, code, data, &dl);
+}
+
+
+/* Push message to shard of given key.
+ * In:
+ *   q - queue
+ *   key - key of message, messages of the same key go to the same shard
+ *   code, data, timeout - same as for mtmq_push()
+ * Out:
+ *   same as for mtmq_push()
+ * Note:
+ *   Messages of one key keep their order for single consumer, whichever
+ *   thread pushed them. Queue which is not sharded ignores the key.
+ */
+int mtmq_push_key(mtmq_t *q, uint64_t key, int code, void *data, int timeout)
+{
+    if (!q)
+        return MTMQ_RC_ERROR;
+
+    mtmq_dl_t dl = dl_rel(timeout);
+    return queue_push(q->shards ? shard_key(q, key) : q, code, data, &dl);
+}
+
+
+// Internal helper: mtmq_pop() with waiting deadline.
+static int queue_pop(mtmq_t *q, int *code, void **data, mtmq_dl_t *dl)
+{
+    int ret, rc;
+
+    if (!q)
+        return MTMQ_RC_ERROR;
+
+    if (q->shards) {
+        int which;
+        return pop_any_dl(q->shards, q->nshards, &which, code, data, dl);
+    }
+
+    if (q->flags & MTMQ_F_SPSC)
+        return spsc_pop(q, code, data, dl);
+    if (q->flags & MTMQ_F_MPMC)
+        return mpmc_pop(q, code, data, dl);
+
+    rc = mtx_lock(q);
+    if (rc != 0)
+        return MTMQ_RC_ERROR;
+
+    rc = mtx_wait_rd(q, dl);
+
+    if (mtx_can_rd(q)) {
+        if (q->lanes)
+            lane_take(q, code, data, stamp_clock(q));
+        else if (q->seg_base)
+            seg_take(q, code, data);
+        else {
+            mtmq_elt_t *e = &ring_arr(q)[q->first];
+            *code = e->code;
+            *data = e->data;
+            stamp_take(q, q->first, stamp_clock(q));
+            if (q->cfl_mask)
+                cfl_del(q, e->code);
+            q->first = ring_next(q, q->first, 1);
+        }
+        counter_add(&q->head, 1);
+        MTMQ_TRACE_EV(q, DEQ, q->head, 1);
+        mtx_wake_wr(q, 1);
+        ret = MTMQ_RC_OK;
+    } else if (mtx_drained(q))
+        ret = MTMQ_RC_FINALIZED;
+    else if (rc == ETIMEDOUT)
+        ret = MTMQ_RC_TIMEDOUT;
+    else if (rc == EINTR)
+        ret = MTMQ_RC_INTERRUPTED;
+    else
+        ret = MTMQ_RC_ERROR;
+
+    fd_clear(q);
+    mtx_unlock(q);
+
+    return ret;
+}
+
+
+/* Pop message from queue.
+ * In:
+ *   q - queue
+ *   [out]code - integer code to retrieve from queue
+ *   [out]data - pointer to some application data to retrieve from queue
+ *   timeout - timeout in milliseconds for operation to complete
+ *     if timeout < 0, then wait indefinately for queue to become
+ *     available for reading or is finalized.
+ * Out:
+ *   MTMQ_RC_OK - done
+ *   MTMQ_RC_FINALIZED - not done because queue is finalized
+ *   MTMQ_RC_TIMEDOUT - not done because of timeout
+ *   MTMQ_RC_INTERRUPTED - not done because waiting on condition variable was
+ *     interrupted by signal (note that on posix-compliant system this should
+ *     never happen)
+ *   MTMQ_RC_ERROR - some error occured that requires investigation and debugging.
+ * Note:
+ *   When queue is finalized consumer(s) will retrieve all available data from
+ *   queue before it(they) get MTMQ_RC_FINALIZED return code.
+ */
+int mtmq_pop(mtmq_t *q, int *code, void **data, int timeout)
+{
+    mtmq_dl_t dl = dl_rel(timeout);
+    return queue_pop(q, code, data, &dl);
+}
+
+
+/* Pop message from queue, waiting until absolute deadline.
+ * In:
+ *   q, code, data - same as for mtmq_pop()
+ *   deadline - time to wait for queue to become available for reading until,
+ *     NULL - wait indefinately
+ * Out:
+ *   same as for mtmq_pop()
+ * Note:
+ *   Deadline is absolute time of clock used for waiting (CLOCK_MONOTONIC, or
+ *   CLOCK_REALTIME on Windows), see mtmq_deadline(). Loop of calls sharing
+ *   one deadline thus reads the clock only once, when computing it.
+ */
+int mtmq_pop_until(mtmq_t *q, int *code, void **data, const struct timespec *deadline)
+{
+    mtmq_dl_t dl = dl_until(deadline);
+    return queue_pop(q, code, data, &dl);
+}
+
+
+/* Pop message from queue if it can be done without waiting.
+ * In:
+ *   q, [out]code, [out]data - same as for mtmq_pop()
+ * Out:
+ *   MTMQ_RC_OK - done
+ *   MTMQ_RC_FINALIZED - not done because queue is finalized and drained
+ *   MTMQ_RC_TIMEDOUT - not done because queue is empty
+ *   MTMQ_RC_ERROR - some error occured that requires investigation and debugging.
+ * Note:
+ *   Same as mtmq_pop() with zero timeout, see mtmq_try_push().
+ */
+int mtmq_try_pop(mtmq_t *q, int *code, void **data)
+{
+    mtmq_dl_t dl = dl_rel(0);
+    return queue_pop(q, code, data, &dl);
+}
+
+
+/* Pop message from queue, with time it spent in queue.
+ * In:
+ *   q - queue created with MTMQ_F_STAMP flag
+ *   [out]code, [out]data, timeout - same as for mtmq_pop()
+ *   [out]age_ns - nanoseconds since message was pushed (or committed)
+ * Out:
+ *   same as for mtmq_pop(), MTMQ_RC_ERROR if queue is not stamped
+ * Note:
+ *   Consumer may use age to shed work which became stale while queued,
+ *   see also residency histogram of mtmq_get_stats().
+ */
+int mtmq_pop_aged(mtmq_t *q, int *code, void **data, int64_t *age_ns, int timeout)
+{
+    if (!q || !age_ns || !(q->flags & MTMQ_F_STAMP))
+        return MTMQ_RC_ERROR;
+
+    mtmq_dl_t dl = dl_rel(timeout);
+    int ret = queue_pop(q, code, data, &dl);
+    if (ret == MTMQ_RC_OK)
+        *age_ns = stamp_age;
+    return ret;
+}
+
+
+// Internal helper for mutex engine: take up to n newest elements, newest first. Must be called with mutex locked.
+static int mtx_take_back(mtmq_t *q, int *codes, void **datas, int n)
+{
+    int num = ring_num(q);
+    int k = (n < num) ? n : num;
+    int64_t now = stamp_clock(q);
+    for (int i=0; i<k; i++) {
+        q->last = ring_next(q, q->last, q->size - 1);
+        mtmq_elt_t *e = &ring_arr(q)[q->last];
+        codes[i] = e->code;
+        datas[i] = e->data;
+        stamp_take(q, q->last, now);
+        if (q->cfl_mask)
+            cfl_del(q, e->code);
+    }
+    counter_add(&q->tail, -k);
+    MTMQ_TRACE_EV(q, DEQ, (q->tail & ~MTMQ_FIN_BIT) + k, k);
+#if MTMQ_WITH_STATS
+    q->backs += k;
+#endif
+    mtx_wake_wr(q, k);
+    return k;
+}
+
+
+/* Pop several newest messages from queue at once.
+ * In:
+ *   q, codes, datas, n, timeout, popped - same as for mtmq_pop_n()
+ * Out:
+ *   same as for mtmq_pop_n(), MTMQ_RC_ERROR if queue does not support it
+ * Note:
+ *   Messages are taken newest first, see mtmq_pop_back(), under single lock
+ *   acquisition and waiting writers are woken up once.
+ */
+int mtmq_pop_back_n(mtmq_t *q, int *codes, void **datas, int n, int timeout, int *popped)
+{
+    mtmq_dl_t dl = dl_rel(timeout);
+    int ret, rc;
+
+    *popped = 0;
+    if (!q || n < 0 || (q->flags & (MTMQ_F_SPSC | MTMQ_F_MPMC)) || q->lanes || q->seg_base || q->payload_off || q->shards)
+        return MTMQ_RC_ERROR;
+    if (n == 0)
+        return MTMQ_RC_OK;
+
+    rc = mtx_lock(q);
+    if (rc != 0)
+        return MTMQ_RC_ERROR;
+
+    rc = mtx_wait_rd(q, &dl);
+
+    if (mtx_can_rd(q)) {
+        *popped = mtx_take_back(q, codes, datas, n);
+        ret = MTMQ_RC_OK;
+    } else if (mtx_drained(q))
+        ret = MTMQ_RC_FINALIZED;
+    else
+        ret = wait_rc(rc);
+
+    fd_clear(q);
+    mtx_unlock(q);
+
+    return ret;
+}
+
+
+/* Pop newest message from queue.
+ * In:
+ *   q, code, data, timeout - same as for mtmq_pop()
+ * Out:
+ *   same as for mtmq_pop(), MTMQ_RC_ERROR if queue does not support it
+ * Note:
+ *   Takes message pushed last, so that owner of queue may process its
+ *   messages in LIFO order while other consumers pop oldest ones. Only for
+ *   mutex engine without priority levels, segments and payload slots.
+ */
+int mtmq_pop_back(mtmq_t *q, int *code, void **data, int timeout)
+{
+    int popped;
+    return mtmq_pop_back_n(q, code, data, 1, timeout, &popped);
+}
+
+
+// Internal helper: mtmq_push_n() with waiting deadline.
+static int queue_push_n(mtmq_t *q, const int *codes, void *const *datas, int n, mtmq_dl_t *dl, int *pushed)
+{
+    int ret, rc;
+
+    *pushed = 0;
+    if (!q || n < 0)
+        return MTMQ_RC_ERROR;
+    if (n == 0)
+        return MTMQ_RC_OK;
+
+    if (q->shards)
+        return queue_push_n(shard_own(q), codes, datas, n, dl, pushed);
+
+    if (q->flags & MTMQ_F_SPSC)
+        return spsc_push_n(q, codes, datas, n, dl, pushed);
+    if (q->flags & MTMQ_F_MPMC)
+        return mpmc_push_n(q, codes, datas, n, dl, pushed);
+
+    // conflating queue looks every code up, and overwriting queue may drop
+    // message per pushed one, so messages are pushed one by one
+    if (q->cfl_mask || (q->flags & MTMQ_F_OVERWRITE)) {
+        mtmq_dl_t now = dl_rel(0);
+        ret = MTMQ_RC_OK;
+        while (*pushed < n) {
+            ret = mtx_push(q, 0, codes[*pushed], datas[*pushed], *pushed ? &now : dl);
+            if (ret != MTMQ_RC_OK)
+                break;
+            (*pushed)++;
+        }
+        return *pushed ? MTMQ_RC_OK : ret;
+    }
+
+    rc = mtx_lock(q);
+    if (rc != 0)
+        return MTMQ_RC_ERROR;
+
+    rc = mtx_wait_wr(q, 0, dl);
+
+    if (q->fin)
+        ret = MTMQ_RC_FINALIZED;
+    else if (mtx_can_wr(q, 0) && mtx_no_mem(q))
+        ret = MTMQ_RC_ERROR;
+    else if (mtx_can_wr(q, 0)) {
+        int room = q->size - (q->lanes ? q->lanes[0].num : ring_num(q));
+        int k = (n < room) ? n : room;
+        int64_t now = stamp_clock(q);
+        if (q->lanes) {
+            for (int i=0; i<k; i++)
+                lane_put(q, 0, codes[i], datas[i], now);
+        } else if (q->seg_base) {
+            for (int i=0; i<k; i++) {
+                if (!seg_put(q, i, codes[i], datas[i])) {
+                    k = i;
+                    break;
+                }
+            }
+        } else {
+            // copy at most two contiguous runs of ring
+            int run = (k < q->size - q->last) ? k : (q->size - q->last);
+            mtmq_elt_t *e = &ring_arr(q)[q->last];
+            for (int i=0; i<run; i++) {
+                e[i].code = codes[i];
+                e[i].data = datas[i];
+            }
+            for (int i=run; i<k; i++) {
+                ring_arr(q)[i-run].code = codes[i];
+                ring_arr(q)[i-run].data = datas[i];
+            }
+            if (q->stamp_off) {
+                for (int i=0; i<k; i++)
+                    stamp_put(q, (i < run) ? (size_t)q->last + i : (size_t)(i - run), now);
+            }
+            q->last = ring_next(q, q->last, k);
+        }
+        counter_add(&q->tail, k);
+        stat_hwm(q, q->tail);
+        MTMQ_TRACE_EV(q, ENQ, q->tail & ~MTMQ_FIN_BIT, k);
+        fd_signal(q);
+        mtx_wake_rd(q, k);
+        *pushed = k;
+        ret = MTMQ_RC_OK;
+    } else
+        ret = wait_rc(rc);
+
+    mtx_unlock(q);
+
+    return ret;
+}
+
+
+/* Push several messages to queue at once.
+ * In:
+ *   q - queue
+ *   codes - array of n integer codes to put to queue
+ *   datas - array of n pointers to application data to put to queue
+ *   n - number of messages to push
+ *   timeout - timeout in milliseconds to wait for queue to have room for
+ *     at least one message, if timeout < 0, then wait indefinately.
+ *   [out]pushed - number of messages actually pushed (first ones of arrays)
+ * Out:
+ *   MTMQ_RC_OK - done, at least one message pushed (if n > 0)
+ *   others - same as for mtmq_push(), nothing pushed
+ * Note:
+ *   As many messages as fit are pushed under single lock acquisition and
+ *   waiting readers are woken up once.
+ */
+int mtmq_push_n(mtmq_t *q, const int *codes, void *const *datas, int n, int timeout, int *pushed)
+{
+    mtmq_dl_t dl = dl_rel(timeout);
+    return queue_push_n(q, codes, datas, n, &dl, pushed);
+}
+
+
+/* Push several messages to queue at once, waiting until absolute deadline.
+ * In:
+ *   q, codes, datas, n, pushed - same as for mtmq_push_n()
+ *   deadline - same as for mtmq_push_until()
+ * Out:
+ *   same as for mtmq_push_n()
+ */
+int mtmq_push_n_until(mtmq_t *q, const int *codes, void *const *datas, int n, const struct timespec *deadline, int *pushed)
+{
+    mtmq_dl_t dl = dl_until(deadline);
+    return queue_push_n(q, codes, datas, n, &dl, pushed);
+}
+
+
+/* Internal helper for mutex engine: take up to n available elements and wake
+ * up writers. Must be called with mutex locked. Returns number of elements taken.
+ */
+static int mtx_take_n(mtmq_t *q, int *codes, void **datas, int n)
+{
+    int num = ring_num(q);
+    int k = (n < num) ? n : num;
+    int64_t now = stamp_clock(q);
+    if (q->lanes) {
+        for (int i=0; i<k; i++)
+            lane_take(q, &codes[i], &datas[i], now);
+    } else if (q->seg_base) {
+        for (int i=0; i<k; i++)
+            seg_take(q, &codes[i], &datas[i]);
+    } else {
+        // copy at most two contiguous runs of ring
+        int run = (k < q->size - q->first) ? k : (q->size - q->first);
+        mtmq_elt_t *e = &ring_arr(q)[q->first];
+        for (int i=0; i<run; i++) {
+            codes[i] = e[i].code;
+            datas[i] = e[i].data;
+        }
+        for (int i=run; i<k; i++) {
+            codes[i] = ring_arr(q)[i-run].code;
+            datas[i] = ring_arr(q)[i-run].data;
+        }
+        if (q->stamp_off) {
+            for (int i=0; i<k; i++)
+                stamp_take(q, (i < run) ? (size_t)q->first + i : (size_t)(i - run), now);
+        }
+        if (q->cfl_mask) {
+            for (int i=0; i<k; i++)
+                cfl_del(q, codes[i]);
+        }
+        q->first = ring_next(q, q->first, k);
+    }
+    counter_add(&q->head, k);
+    MTMQ_TRACE_EV(q, DEQ, q->head, k);
+    mtx_wake_wr(q, k);
+    return k;
+}
+
+
+// Internal helper for mutex engine: finalize queue. Must be called with mutex locked.
+static void mtx_finalize(mtmq_t *q)
+{
+    if (!q->fin) {
+        q->fin = 1;
+        atomic_fetch_or(&q->tail, MTMQ_FIN_BIT);
+        fd_signal(q);
+        mtx_wake_rd(q, INT_MAX);
+        mtx_wake_wr(q, INT_MAX);
+        // waiters of lock-free engines sleep on condition variables, not futex
+        if (q->flags & (MTMQ_F_SPSC | MTMQ_F_MPMC)) {
+            pthread_cond_broadcast(&q->cond_rd);
+            pthread_cond_broadcast(&q->cond_wr);
+        }
+    }
+}
+
+
+// Internal helper: mtmq_pop_n() with waiting deadline.
+static int queue_pop_n(mtmq_t *q, int *codes, void **datas, int n, mtmq_dl_t *dl, int *popped)
+{
+    int ret, rc;
+
+    *popped = 0;
+    if (!q || n < 0)
+        return MTMQ_RC_ERROR;
+    if (n == 0)
+        return MTMQ_RC_OK;
+
+    if (q->shards) {
+        // sweep shards in rotation, then wait for message in any of them
+        static _Thread_local unsigned int start;
+        int first = (int)(start++ % (unsigned int)q->nshards);
+        mtmq_dl_t now = dl_rel(0);
+        int fin = 0;
+        for (int i=0; i<q->nshards && *popped < n; i++) {
+            int k;
+            rc = queue_pop_n(q->shards[(first + i) % q->nshards], codes + *popped, datas + *popped, n - *popped, &now, &k);
+            if (rc == MTMQ_RC_OK)
+                *popped += k;
+            else if (rc == MTMQ_RC_FINALIZED)
+                fin++;
+            else if (rc != MTMQ_RC_TIMEDOUT)
+                return rc;
+        }
+        if (*popped)
+            return MTMQ_RC_OK;
+        if (fin == q->nshards)
+            return MTMQ_RC_FINALIZED;
+        int which;
+        ret = pop_any_dl(q->shards, q->nshards, &which, codes, datas, dl);
+        if (ret == MTMQ_RC_OK)
+            *popped = 1;
+        return ret;
+    }
+
+    if (q->flags & MTMQ_F_SPSC)
+        return spsc_pop_n(q, codes, datas, n, dl, popped);
+    if (q->flags & MTMQ_F_MPMC)
+        return mpmc_pop_n(q, codes, datas, n, dl, popped);
+
+    rc = mtx_lock(q);
+    if (rc != 0)
+        return MTMQ_RC_ERROR;
+
+    rc = mtx_wait_rd(q, dl);
+
+    if (mtx_can_rd(q)) {
+        *popped = mtx_take_n(q, codes, datas, n);
+        ret = MTMQ_RC_OK;
+    } else if (mtx_drained(q))
+        ret = MTMQ_RC_FINALIZED;
+    else
+        ret = wait_rc(rc);
+
+    fd_clear(q);
+    mtx_unlock(q);
+
+    return ret;
+}
+
+
+/* Pop several messages from queue at once.
+ * In:
+ *   q - queue
+ *   [out]codes - array for up to n integer codes retrieved from queue
+ *   [out]datas - array for up to n data pointers retrieved from queue
+ *   n - max number of messages to pop
+ *   timeout - timeout in milliseconds to wait for at least one message,
+ *     if timeout < 0, then wait indefinately.
+ *   [out]popped - number of messages actually popped
+ * Out:
+ *   MTMQ_RC_OK - done, at least one message popped (if n > 0)
+ *   others - same as for mtmq_pop(), nothing popped
+ * Note:
+ *   All available messages (up to n) are popped under single lock
+ *   acquisition and waiting writers are woken up once.
+ */
+int mtmq_pop_n(mtmq_t *q, int *codes, void **datas, int n, int timeout, int *popped)
+{
+    mtmq_dl_t dl = dl_rel(timeout);
+    return queue_pop_n(q, codes, datas, n, &dl, popped);
+}
+
+
+/* Pop several messages from queue at once, waiting until absolute deadline.
+ * In:
+ *   q, codes, datas, n, popped - same as for mtmq_pop_n()
+ *   deadline - same as for mtmq_pop_until()
+ * Out:
+ *   same as for mtmq_pop_n()
+ */
+int mtmq_pop_n_until(mtmq_t *q, int *codes, void **datas, int n, const struct timespec *deadline, int *popped)
+{
+    mtmq_dl_t dl = dl_until(deadline);
+    return queue_pop_n(q, codes, datas, n, &dl, popped);
+}
+
+
+/* Internal helper to take up to n elements without waiting, finalizing queue
+ * first if fin is set. Mutex engine does both under single lock acquisition.
+ */
+static int queue_drain(mtmq_t *q, int fin, int *codes, void **datas, int n, int *drained)
+{
+    int ret;
+
+    *drained = 0;
+    if (!q || n < 0)
+        return MTMQ_RC_ERROR;
+
+    if (q->shards) {
+        if (fin)
+            mtmq_finalize(q);
+        int num = 0;
+        for (int i=0; i<q->nshards; i++) {
+            int k;
+            ret = queue_drain(q->shards[i], 0, codes + *drained, datas + *drained, n - *drained, &k);
+            if (ret == MTMQ_RC_FINALIZED)
+                num++;
+            else if (ret != MTMQ_RC_OK)
+                return ret;
+            *drained += k;
+        }
+        return (num == q->nshards) ? MTMQ_RC_FINALIZED : MTMQ_RC_OK;
+    }
+
+    if (q->flags & (MTMQ_F_SPSC | MTMQ_F_MPMC)) {
+        if (fin)
+            mtmq_finalize(q);
+        if (n == 0)
+            return MTMQ_RC_OK;
+        mtmq_dl_t dl = dl_rel(0);
+        ret = queue_pop_n(q, codes, datas, n, &dl, drained);
+        return (ret == MTMQ_RC_TIMEDOUT) ? MTMQ_RC_OK : ret;
+    }
+
+    if (mtx_lock(q) != 0)
+        return MTMQ_RC_ERROR;
+
+    if (fin)
+        mtx_finalize(q);
+    if (mtx_can_rd(q))
+        *drained = mtx_take_n(q, codes, datas, n);
+    ret = (*drained == 0 && mtx_drained(q)) ? MTMQ_RC_FINALIZED : MTMQ_RC_OK;
+
+    fd_clear(q);
+    mtx_unlock(q);
+
+    return ret;
+}
+
+
+/* Take all messages currently in queue, without waiting.
+ * In:
+ *   q - queue
+ *   [out]codes - array for up to n integer codes retrieved from queue
+ *   [out]datas - array for up to n data pointers retrieved from queue
+ *   n - max number of messages to take, see mtmq_count()
+ *   [out]drained - number of messages actually taken
+ * Out:
+ *   MTMQ_RC_OK - done, maybe nothing taken if queue is empty
+ *   MTMQ_RC_FINALIZED - nothing taken because queue is finalized and drained
+ *   MTMQ_RC_ERROR - some error occured
+ * Note:
+ *   Unlike loop of mtmq_pop() calls, mutex engine takes all messages under
+ *   single lock acquisition. For SPSC queue it must be called by consumer.
+ */
+int mtmq_drain(mtmq_t *q, int *codes, void **datas, int n, int *drained)
+{
+    return queue_drain(q, 0, codes, datas, n, drained);
+}
+
+
+/* Reserve slot for in-place writing of message payload.
+ * In:
+ *   q - queue created with non-zero payload_size attribute
+ *   [out]buf - pointer to payload slot of payload_size bytes
+ *   timeout - same as for mtmq_push()
+ * Out:
+ *   same as for mtmq_push()
+ * Note:
+ *   Message becomes visible to consumers after mtmq_commit(). Except for MPMC
+ *   engine, only one reservation may be outstanding at a time, other producers
+ *   wait until it is committed. Reservation made before finalization can still
+ *   be committed and consumers will retrieve it.
+ */
+int mtmq_reserve(mtmq_t *q, void **buf, int timeout)
+{
+    mtmq_dl_t dl = dl_rel(timeout);
+    int ret, rc;
+
+    if (!q || !q->payload_off)
+        return MTMQ_RC_ERROR;
+
+    if (q->flags & MTMQ_F_SPSC)
+        return spsc_reserve(q, buf, &dl);
+    if (q->flags & MTMQ_F_MPMC)
+        return mpmc_reserve(q, buf, &dl);
+
+    rc = mtx_lock(q);
+    if (rc != 0)
+        return MTMQ_RC_ERROR;
+
+    rc = mtx_wait_wr(q, 0, &dl);
+
+    if (q->fin)
+        ret = MTMQ_RC_FINALIZED;
+    else if (mtx_can_wr(q, 0)) {
+        q->wr_busy = 1;
+        *buf = slot_buf(q, q->last);
+        ret = MTMQ_RC_OK;
+    } else
+        ret = wait_rc(rc);
+
+    mtx_unlock(q);
+
+    return ret;
+}
+
+
+/* Commit message written to reserved slot.
+ * In:
+ *   q - queue
+ *   buf - payload slot returned by mtmq_reserve()
+ *   code - integer code of message
  * Out:
- *   NULL - create failed
- *   not NULL - pointer to created queue
+ *   MTMQ_RC_OK - message is put to queue, its data pointer is buf
+ *   MTMQ_RC_ERROR - buf is not reserved slot
  */
-mtmq_t *mtmq_create(int size)
+int mtmq_commit(mtmq_t *q, void *buf, int code)
 {
-    mtmq_t *ret;
-    int rc;
-
-    size_t mtmq_size = sizeof(mtmq_t);
-    mtmq_size += (~mtmq_size + 1) & (sizeof(void*)-1);
+    int ret;
 
-    size_t arr_size = sizeof(mtmq_elt_t) * size;
-
-    ret = malloc(mtmq_size + arr_size);
-    if (ret == NULL)
-        return NULL;
+    if (!q || !q->payload_off)
+        return MTMQ_RC_ERROR;
 
-    memset(ret, 0, mtmq_size + arr_size);
-    ret->size = size;
-    ret->arr = (mtmq_elt_t*)(ret+1);
+    if (q->flags & MTMQ_F_SPSC)
+        return spsc_commit(q, buf, code);
+    if (q->flags & MTMQ_F_MPMC)
+        return mpmc_commit(q, buf, code);
 
-    pthread_mutex_init(&ret->mtx, NULL);
+    if (mtx_lock(q) != 0)
+        return MTMQ_RC_ERROR;
 
-    pthread_condattr_t ca;
-    pthread_condattr_init(&ca);
-    rc = pthread_condattr_setclock(&ca, MTMQ_CLOCK_TYPE);
-    if (rc != 0) {
-        pthread_condattr_destroy(&ca);
-        pthread_mutex_destroy(&ret->mtx);
-        free(ret);
-        return NULL;
-    }
+    if (q->wr_busy && buf == slot_buf(q, q->last)) {
+        mtmq_elt_t *e = &ring_arr(q)[q->last];
+        e->code = code;
+        e->data = buf;
+        stamp_put(q, q->last, stamp_clock(q));
+        q->last = ring_next(q, q->last, 1);
+        counter_add(&q->tail, 1);
+        stat_hwm(q, q->tail);
+        MTMQ_TRACE_EV(q, ENQ, q->tail & ~MTMQ_FIN_BIT, 1);
+        fd_signal(q);
+        q->wr_busy = 0;
+        mtx_wake_rd(q, 1);
+        mtx_wake_wr(q, 1);
+        ret = MTMQ_RC_OK;
+    } else
+        ret = MTMQ_RC_ERROR;
 
-    pthread_cond_init(&ret->cond_rd, &ca);
-    pthread_cond_init(&ret->cond_wr, &ca);
-    pthread_condattr_destroy(&ca);
+    mtx_unlock(q);
 
     return ret;
 }
 
 
-/* Destroy queue.
+/* Get first message of queue without removing it.
  * In:
- *   q - queue pointer
+ *   q - queue created with non-zero payload_size attribute
+ *   [out]code - integer code of message
+ *   [out]buf - pointer to payload slot of message
+ *   timeout - same as for mtmq_pop()
  * Out:
- *   MTMQ_RC_OK - queue deleted
- *   MTMQ_RC_ERROR - some error occured
+ *   same as for mtmq_pop()
+ * Note:
+ *   Slot stays valid until mtmq_release(). Except for MPMC engine, other
+ *   consumers wait until peeked message is released.
  */
-int mtmq_destroy(mtmq_t *q)
+int mtmq_peek(mtmq_t *q, int *code, void **buf, int timeout)
 {
-    if (!q)
-        return MTMQ_RC_ERROR;
+    mtmq_dl_t dl = dl_rel(timeout);
+    int ret, rc;
 
-    int rc = pthread_cond_destroy(&q->cond_wr);
-    if (rc)
+    if (!q || !q->payload_off)
         return MTMQ_RC_ERROR;
 
-    rc = pthread_cond_destroy(&q->cond_rd);
-    if (rc)
-        return MTMQ_RC_ERROR;
+    if (q->flags & MTMQ_F_SPSC)
+        return spsc_peek(q, code, buf, &dl);
+    if (q->flags & MTMQ_F_MPMC)
+        return mpmc_peek(q, code, buf, &dl);
 
-    rc = pthread_mutex_destroy(&q->mtx);
-    if (rc)
+    rc = mtx_lock(q);
+    if (rc != 0)
         return MTMQ_RC_ERROR;
 
-    free(q);
-    return MTMQ_RC_OK;
+    rc = mtx_wait_rd(q, &dl);
+
+    if (mtx_can_rd(q)) {
+        q->rd_busy = 1;
+        *code = ring_arr(q)[q->first].code;
+        *buf = slot_buf(q, q->first);
+        ret = MTMQ_RC_OK;
+    } else if (mtx_drained(q))
+        ret = MTMQ_RC_FINALIZED;
+    else
+        ret = wait_rc(rc);
+
+    fd_clear(q);
+    mtx_unlock(q);
+
+    return ret;
 }
 
 
-/* Push message to queue.
+/* Remove message obtained by mtmq_peek() from queue.
  * In:
  *   q - queue
- *   code - integer code to put to queue
- *   data - pointer to some application data to put to queue
- *   timeout - timeout in milliseconds for operation to complete
- *     if timeout < 0, then wait indefinately for queue to become
- *     available for writing or is finalized.
+ *   buf - payload slot returned by mtmq_peek()
  * Out:
- *   MTMQ_RC_OK - done
- *   MTMQ_RC_FINALIZED - not done because queue is finalized
- *   MTMQ_RC_TIMEDOUT - not done because of timeout
- *   MTMQ_RC_INTERRUPTED - not done because waiting on condition variable was
- *     interrupted by signal (note that on posix-compliant system this should
- *     never happen)
- *   MTMQ_RC_ERROR - some error occured that requires investigation and debugging.
+ *   MTMQ_RC_OK - slot is returned to queue
+ *   MTMQ_RC_ERROR - buf is not peeked slot
  */
-int mtmq_push(mtmq_t *q, int code, void *data, int timeout)
+int mtmq_release(mtmq_t *q, void *buf)
 {
-    int ret, rc;
+    int ret;
 
-    if (!q)
+    if (!q || !q->payload_off)
         return MTMQ_RC_ERROR;
 
-    rc = pthread_mutex_lock(&q->mtx);
-    if (rc != 0)
-        return MTMQ_RC_ERROR;
+    if (q->flags & MTMQ_F_SPSC)
+        return spsc_release(q, buf);
+    if (q->flags & MTMQ_F_MPMC)
+        return mpmc_release(q, buf);
 
-    q->num_wr++;
-    if (timeout < 0) {
-        for (rc=0; !q->fin && q->num==q->size && rc==0; ) {
-            rc = pthread_cond_wait(&q->cond_wr, &q->mtx);
-        }
-    } else {
-        struct timespec to;
-        calc_abs_timeout(&to, timeout);
-        for (rc=0; !q->fin && q->num==q->size && rc==0; ) {
-            rc = pthread_cond_timedwait(&q->cond_wr, &q->mtx, &to);
-        }
-    }
-    q->num_wr--;
+    if (mtx_lock(q) != 0)
+        return MTMQ_RC_ERROR;
 
-    if (q->fin)
-        ret = MTMQ_RC_FINALIZED;
-    else if (q->num < q->size) {
-        mtmq_elt_t *e = &q->arr[q->last];
-        e->code = code;
-        e->data = data;
-        q->last = (q->last+1 < q->size) ? (q->last+1) : 0;
-        q->num++;
-        if (q->num_rd)
-            pthread_cond_signal(&q->cond_rd);
+    if (q->rd_busy && buf == slot_buf(q, q->first)) {
+        stamp_take(q, q->first, stamp_clock(q));
+        q->first = ring_next(q, q->first, 1);
+        counter_add(&q->head, 1);
+        MTMQ_TRACE_EV(q, DEQ, q->head, 1);
+        q->rd_busy = 0;
+        mtx_wake_wr(q, 1);
+        mtx_wake_rd(q, 1);
+        fd_clear(q);
         ret = MTMQ_RC_OK;
-    } else if (rc == ETIMEDOUT)
-        ret = MTMQ_RC_TIMEDOUT;
-    else if (rc == EINTR)
-        ret = MTMQ_RC_INTERRUPTED;
-    else
+    } else
         ret = MTMQ_RC_ERROR;
 
-    pthread_mutex_unlock(&q->mtx);
+    mtx_unlock(q);
 
     return ret;
 }
 
 
-/* Pop message from queue.
+// Internal helper: check if side wr of queue has no need to wait. Must be called with mutex locked.
+static int notify_ready(mtmq_t *q, int wr)
+{
+    if (q->flags & (MTMQ_F_SPSC | MTMQ_F_MPMC)) {
+        if (wr)
+            return q->fin || !lf_blocked(q, 1);
+        return !lf_blocked(q, 0) || (q->fin && !lf_inflight(q));
+    }
+    if (wr)
+        return q->fin || (q->flags & MTMQ_F_OVERWRITE) || mtx_can_wr(q, 0);
+    return mtx_can_rd(q) || mtx_drained(q);
+}
+
+
+/* Register one-shot notification of queue becoming readable or writable.
  * In:
  *   q - queue
- *   [out]code - integer code to retrieve from queue
- *   [out]data - pointer to some application data to retrieve from queue
- *   timeout - timeout in milliseconds for operation to complete
- *     if timeout < 0, then wait indefinately for queue to become
- *     available for reading or is finalized.
+ *   wr - 0 - notify when queue may be readable, 1 - when it may be writable
+ *   n - notification with fn and arg set by caller, not registered anywhere
  * Out:
- *   MTMQ_RC_OK - done
- *   MTMQ_RC_FINALIZED - not done because queue is finalized
- *   MTMQ_RC_TIMEDOUT - not done because of timeout
- *   MTMQ_RC_INTERRUPTED - not done because waiting on condition variable was
- *     interrupted by signal (note that on posix-compliant system this should
- *     never happen)
- *   MTMQ_RC_ERROR - some error occured that requires investigation and debugging.
+ *   MTMQ_RC_OK - registered, n->fn(n->arg) will be called once
+ *   MTMQ_RC_ERROR - n is registered already, or queue is shared between
+ *     processes or sharded
  * Note:
- *   When queue is finalized consumer(s) will retrieve all available data from
- *   queue before it(they) get MTMQ_RC_FINALIZED return code.
+ *   Callback is called after one of mtmq_try_push() (mtmq_try_pop()) would
+ *   succeed, or queue is finalized (and drained for readers). It's called
+ *   without queue mutex locked, by thread which made queue ready, or by
+ *   calling thread before returning if queue is ready already. It's a hint
+ *   only: the operation may still find queue empty (full) if other threads
+ *   were faster, in which case notification should be registered again,
+ *   which callback may do itself. Node memory must stay valid until callback
+ *   was called or notification was cancelled by mtmq_notify_cancel(), and
+ *   queue must not be destroyed with notification registered.
  */
-int mtmq_pop(mtmq_t *q, int *code, void **data, int timeout)
+int mtmq_notify(mtmq_t *q, int wr, mtmq_notify_t *n)
 {
-    int ret, rc;
+    if (!q || !n || !n->fn || q->shm_len || q->shards)
+        return MTMQ_RC_ERROR;
 
-    if (!q)
+    if (mtx_lock(q) != 0)
         return MTMQ_RC_ERROR;
 
-    rc = pthread_mutex_lock(&q->mtx);
-    if (rc != 0)
+    if (n->armed) {
+        mtx_unlock(q);
         return MTMQ_RC_ERROR;
+    }
+    n->wr = (wr != 0);
+    n->once = 1;
+    watch_link(q, n);
 
-    q->num_rd++;
-    if (timeout < 0) {
-        for (rc=0; !q->num && !q->fin && rc==0; ) {
-            rc = pthread_cond_wait(&q->cond_rd, &q->mtx);
-        }
-    } else {
-        struct timespec to;
-        calc_abs_timeout(&to, timeout);
-        for (rc=0; !q->num && !q->fin && rc==0; ) {
-            rc = pthread_cond_timedwait(&q->cond_rd, &q->mtx, &to);
-        }
-    }
-    q->num_rd--;
-
-    if (q->num) {
-        mtmq_elt_t *e = &q->arr[q->first];
-        *code = e->code;
-        *data = e->data;
-        q->first = (q->first+1 < q->size) ? (q->first+1) : 0;
-        q->num--;
-        if (q->num_wr)
-            pthread_cond_signal(&q->cond_wr);
-        ret = MTMQ_RC_OK;
-    } else if (q->fin)
-        ret = MTMQ_RC_FINALIZED;
-    else if (rc == ETIMEDOUT)
-        ret = MTMQ_RC_TIMEDOUT;
-    else if (rc == EINTR)
-        ret = MTMQ_RC_INTERRUPTED;
-    else
-        ret = MTMQ_RC_ERROR;
+    // registered watcher is counted before state is checked, so readiness is not lost
+    if (notify_ready(q, n->wr)) {
+        watch_unlink(q, n);
+        n->next = q->fired;
+        q->fired = n;
+    }
+    mtx_unlock(q);
 
-    pthread_mutex_unlock(&q->mtx);
+    return MTMQ_RC_OK;
+}
 
-    return ret;
+
+/* Cancel notification registered by mtmq_notify().
+ * In:
+ *   q - queue notification is registered with
+ *   n - notification
+ * Out:
+ *   MTMQ_RC_OK - cancelled, callback will not be called
+ *   MTMQ_RC_ERROR - not registered, callback was called or is about to be
+ *     called (so node memory must stay valid until it returns)
+ */
+int mtmq_notify_cancel(mtmq_t *q, mtmq_notify_t *n)
+{
+    if (!q || !n || q->shm_len || q->shards)
+        return MTMQ_RC_ERROR;
+
+    if (mtx_lock(q) != 0)
+        return MTMQ_RC_ERROR;
+
+    int armed = n->armed;
+    if (armed)
+        watch_unlink(q, n);
+    mtx_unlock(q);
+
+    return armed ? MTMQ_RC_OK : MTMQ_RC_ERROR;
 }
 
 
@@ -278,19 +3766,38 @@ int mtmq_pop(mtmq_t *q, int *code, void **data, int timeout)
  * Note:
  *   After finalizing queue caller should make sure all producers and consumers
  *   are not using this queue any more and then destroy queue by calling mtmq_destroy(q).
+ *   Sharded queue finalizes all its shards.
  */
 void mtmq_finalize(mtmq_t *q)
 {
     if (!q)
         return;
 
-    pthread_mutex_lock(&q->mtx);
-    if (!q->fin) {
-        q->fin = 1;
-        if (q->num_rd) pthread_cond_broadcast(&q->cond_rd);
-        if (q->num_wr) pthread_cond_broadcast(&q->cond_wr);
-    }
-    pthread_mutex_unlock(&q->mtx);
+    mtx_lock(q);
+    mtx_finalize(q);
+    mtx_unlock(q);
+
+    for (int i=0; i<q->nshards; i++)
+        mtmq_finalize(q->shards[i]);
+}
+
+
+/* Finalize queue and take messages left in it, to hand them over elsewhere.
+ * In:
+ *   q - queue
+ *   [out]codes, [out]datas, n, [out]stolen - same as for mtmq_drain()
+ * Out:
+ *   same as for mtmq_drain()
+ * Note:
+ *   Mutex engine finalizes queue and takes messages under single lock
+ *   acquisition, so no consumer gets any of them. Lock-free engines take
+ *   messages after finalizing, consumers running at the same time may still
+ *   pop some. Messages beyond n and messages being committed by producers
+ *   stay in queue for consumers.
+ */
+int mtmq_finalize_and_steal(mtmq_t *q, int *codes, void **datas, int n, int *stolen)
+{
+    return queue_drain(q, 1, codes, datas, n, stolen);
 }
 
 
@@ -306,10 +3813,327 @@ int mtmq_is_finalized(mtmq_t *q)
     int ret = 1;
 
     if (q) {
-        pthread_mutex_lock(&q->mtx);
+        mtx_lock(q);
         ret = q->fin;
-        pthread_mutex_unlock(&q->mtx);
+        mtx_unlock(q);
+    }
+
+    return ret;
+}
+
+
+/* Get number of messages in queue.
+ * In:
+ *   q - queue
+ * Out:
+ *   number of messages at the moment of call (-1 if q is NULL)
+ * Note:
+ *   With concurrent producers and consumers value is approximate. For MPMC
+ *   engine it includes messages being pushed or popped.
+ */
+int mtmq_count(mtmq_t *q)
+{
+    if (!q)
+        return -1;
+
+    if (q->shards) {
+        int64_t num = 0;
+        for (int i=0; i<q->nshards; i++)
+            num += mtmq_count(q->shards[i]);
+        return (num > INT_MAX) ? INT_MAX : (int)num;
+    }
+
+    uint64_t head = atomic_load(&q->head);
+    uint64_t tail = atomic_load(&q->tail) & ~MTMQ_FIN_BIT;
+    uint64_t num = tail - head;
+    uint64_t cap = (uint64_t)q->size * q->levels;
+    return (num > cap) ? (int)cap : (int)num;
+}
+
+
+/* Get queue statistics.
+ * In:
+ *   q - queue
+ *   [out]stats - statistics snapshot
+ * Out:
+ *   MTMQ_RC_OK - done
+ *   MTMQ_RC_ERROR - statistics are compiled out (stats is zeroed) or bad arguments
+ * Note:
+ *   Counters are read without stopping producers and consumers, so snapshot
+ *   of busy queue is only approximately consistent.
+ */
+int mtmq_get_stats(mtmq_t *q, mtmq_stats_t *stats)
+{
+    if (!q || !stats)
+        return MTMQ_RC_ERROR;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->size = q->size;
+
+    if (q->shards) {
+        int ret = MTMQ_RC_OK;
+        stats->size = 0;
+        for (int i=0; i<q->nshards; i++) {
+            mtmq_stats_t s;
+            if (mtmq_get_stats(q->shards[i], &s) != MTMQ_RC_OK)
+                ret = MTMQ_RC_ERROR;
+            stats->size = (stats->size > INT_MAX - s.size) ? INT_MAX : stats->size + s.size;
+            stats->num += s.num;
+            stats->max_num += s.max_num;
+            stats->pushes += s.pushes;
+            stats->pops += s.pops;
+            stats->dropped += s.dropped;
+            stats->wr_waits += s.wr_waits;
+            stats->rd_waits += s.rd_waits;
+            stats->wr_timeouts += s.wr_timeouts;
+            stats->rd_timeouts += s.rd_timeouts;
+            stats->wr_wait_ns += s.wr_wait_ns;
+            stats->rd_wait_ns += s.rd_wait_ns;
+            stats->res_num += s.res_num;
+            stats->res_ns += s.res_ns;
+            for (int j=0; j<MTMQ_STATS_HIST; j++) {
+                stats->wr_hist[j] += s.wr_hist[j];
+                stats->rd_hist[j] += s.rd_hist[j];
+                stats->res_hist[j] += s.res_hist[j];
+            }
+        }
+        return ret;
+    }
+
+    if (!MTMQ_WITH_STATS)
+        return MTMQ_RC_ERROR;
+
+#if MTMQ_WITH_STATS
+    if (mtx_lock(q) != 0)
+        return MTMQ_RC_ERROR;
+
+    uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed) & ~MTMQ_FIN_BIT;
+    int64_t num = (int64_t)(tail - head);
+
+    int64_t cap = (int64_t)q->size * q->levels;
+    stats->num = (num < 0) ? 0 : (num > cap) ? (int)cap : (int)num;
+    stats->max_num = atomic_load_explicit(&q->max_num, memory_order_relaxed);
+    stats->pushes = tail + q->backs;
+    stats->pops = head + q->backs - q->dropped;
+    stats->dropped = q->dropped;
+    stats->rd_waits = q->wstat[0].waits;
+    stats->wr_waits = q->wstat[1].waits;
+    stats->rd_timeouts = q->wstat[0].timeouts;
+    stats->wr_timeouts = q->wstat[1].timeouts;
+    stats->rd_wait_ns = q->wstat[0].wait_ns;
+    stats->wr_wait_ns = q->wstat[1].wait_ns;
+    memcpy(stats->rd_hist, q->wstat[0].hist, sizeof(stats->rd_hist));
+    memcpy(stats->wr_hist, q->wstat[1].hist, sizeof(stats->wr_hist));
+    // lock-free consumers update residency without mutex
+    stats->res_num = atomic_load_explicit(&q->res_num, memory_order_relaxed);
+    stats->res_ns = atomic_load_explicit(&q->res_ns, memory_order_relaxed);
+    for (int j=0; j<MTMQ_STATS_HIST; j++)
+        stats->res_hist[j] = atomic_load_explicit(&q->res_hist[j], memory_order_relaxed);
+
+    mtx_unlock(q);
+#endif
+
+    return MTMQ_RC_OK;
+}
+
+
+/* Get file descriptor signalling that queue has messages.
+ * In:
+ *   q - queue
+ * Out:
+ *   >= 0 - descriptor, readable while queue may have messages or is finalized
+ *   -1 - descriptor can't be created
+ * Note:
+ *   Descriptor (eventfd, or pipe where eventfd is unavailable) is created on
+ *   first call and closed by mtmq_destroy(). Consumer should not read it, but
+ *   pop messages with zero timeout until MTMQ_RC_TIMEDOUT (or
+ *   MTMQ_RC_FINALIZED), which resets the descriptor when queue is empty.
+ *   Readiness may be spurious, e.g. while another consumer is popping.
+ */
+int mtmq_get_fd(mtmq_t *q)
+{
+    // descriptor is valid only in process which created it
+    if (!q || q->shm_len || q->shards)
+        return -1;
+
+    int efd = atomic_load(&q->efd);
+    if (efd >= 0)
+        return efd;
+
+#ifndef _WIN32
+    if (mtx_lock(q) != 0)
+        return -1;
+
+    efd = atomic_load(&q->efd);
+    if (efd < 0) {
+        int efd_wr = -1;
+#ifdef __linux__
+        efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        efd_wr = efd;
+#endif
+        if (efd < 0) {
+            int p[2];
+            if (pipe(p) == 0) {
+                for (int i=0; i<2; i++) {
+                    fcntl(p[i], F_SETFL, fcntl(p[i], F_GETFL) | O_NONBLOCK);
+                    fcntl(p[i], F_SETFD, FD_CLOEXEC);
+                }
+                efd = p[0];
+                efd_wr = p[1];
+            }
+        }
+
+        if (efd >= 0) {
+            q->efd_wr = efd_wr;
+            atomic_store(&q->efd, efd);
+            // pushes published before producers could see descriptor
+            if (!fd_empty(q) || q->fin)
+                fd_signal(q);
+        }
+    }
+
+    mtx_unlock(q);
+#endif
+
+    return efd;
+}
+
+
+// Waiter of mtmq_pop_any().
+typedef struct mtmq_waiter {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    int signalled;
+} mtmq_waiter_t;
+
+
+// Internal helper: watcher callback of mtmq_pop_any().
+static void waiter_signal(void *arg)
+{
+    mtmq_waiter_t *w = arg;
+
+    pthread_mutex_lock(&w->mtx);
+    w->signalled = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mtx);
+}
+
+
+/* Internal helper: try to pop message from any of queues starting with given
+ * one. Returns MTMQ_RC_TIMEDOUT if no queue has message, MTMQ_RC_FINALIZED if
+ * all queues are finalized and drained.
+ */
+static int pop_any_try(mtmq_t **qs, int n, int start, int *which, int *code, void **data)
+{
+    int fin = 0;
+
+    for (int i=0; i<n; i++) {
+        int j = (start + i) % n;
+        int rc = mtmq_pop(qs[j], code, data, 0);
+        if (rc == MTMQ_RC_OK) {
+            *which = j;
+            return MTMQ_RC_OK;
+        }
+        if (rc == MTMQ_RC_FINALIZED)
+            fin++;
+        else if (rc != MTMQ_RC_TIMEDOUT)
+            return rc;
+    }
+
+    return (fin == n) ? MTMQ_RC_FINALIZED : MTMQ_RC_TIMEDOUT;
+}
+
+
+/* Pop message from any of several queues.
+ * In:
+ *   qs - array of n queues
+ *   n - number of queues
+ *   [out]which - index of queue message was popped from (-1 if none)
+ *   [out]code, [out]data, timeout - same as for mtmq_pop()
+ * Out:
+ *   MTMQ_RC_OK - done
+ *   MTMQ_RC_FINALIZED - all queues are finalized and drained
+ *   others - same as for mtmq_pop()
+ * Note:
+ *   Queues are scanned round-robin starting with a different one on each call,
+ *   so busy queue does not starve others. Caller blocks on single waiter which
+ *   is registered with every queue, instead of polling them.
+ */
+int mtmq_pop_any(mtmq_t **qs, int n, int *which, int *code, void **data, int timeout)
+{
+    mtmq_dl_t dl = dl_rel(timeout);
+    return pop_any_dl(qs, n, which, code, data, &dl);
+}
+
+
+static int pop_any_dl(mtmq_t **qs, int n, int *which, int *code, void **data, mtmq_dl_t *dl)
+{
+    static _Thread_local unsigned int start;
+    mtmq_watch_t local[16];
+    mtmq_waiter_t w;
+    int ret, rc = 0;
+
+    if (!qs || n <= 0 || !which)
+        return MTMQ_RC_ERROR;
+    *which = -1;
+    for (int i=0; i<n; i++) {
+        // watchers live on stack of waiting thread, and are not passed to shards
+        if (!qs[i] || qs[i]->shm_len || qs[i]->shards)
+            return MTMQ_RC_ERROR;
     }
 
+    int first = (int)(start++ % (unsigned int)n);
+    ret = pop_any_try(qs, n, first, which, code, data);
+    if (ret != MTMQ_RC_TIMEDOUT || dl->timeout == 0)
+        return ret;
+
+    mtmq_watch_t *nodes = (n <= (int)(sizeof(local)/sizeof(local[0]))) ? local : malloc(sizeof(*nodes) * n);
+    if (!nodes)
+        return MTMQ_RC_ERROR;
+
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, MTMQ_CLOCK_TYPE);
+    pthread_cond_init(&w.cond, &ca);
+    pthread_condattr_destroy(&ca);
+    pthread_mutex_init(&w.mtx, NULL);
+    w.signalled = 0;
+
+    const struct timespec *to = dl_get(dl);
+
+    for (int i=0; i<n; i++) {
+        nodes[i].fn = waiter_signal;
+        nodes[i].arg = &w;
+        watch_add(qs[i], &nodes[i]);
+    }
+
+    for (;;) {
+        // messages pushed before registration are seen here
+        ret = pop_any_try(qs, n, first, which, code, data);
+        if (ret != MTMQ_RC_TIMEDOUT || rc != 0)
+            break;
+
+        pthread_mutex_lock(&w.mtx);
+        while (!w.signalled && rc == 0) {
+            if (!to)
+                rc = pthread_cond_wait(&w.cond, &w.mtx);
+            else
+                rc = pthread_cond_timedwait(&w.cond, &w.mtx, to);
+        }
+        w.signalled = 0;
+        pthread_mutex_unlock(&w.mtx);
+    }
+    if (ret == MTMQ_RC_TIMEDOUT)
+        ret = wait_rc(rc);
+
+    for (int i=0; i<n; i++)
+        watch_del(qs[i], &nodes[i]);
+
+    pthread_mutex_destroy(&w.mtx);
+    pthread_cond_destroy(&w.cond);
+    if (nodes != local)
+        free(nodes);
+
     return ret;
 }
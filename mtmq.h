@@ -1,6 +1,8 @@
 #ifndef MTMQ_H_INCLUDED
 #define MTMQ_H_INCLUDED
 
+#include <stdint.h>
+#include <time.h>
 
 // Opaque type for queue.
 typedef struct mtmq mtmq_t;
@@ -11,16 +13,135 @@ enum {
     MTMQ_RC_FINALIZED, // operation was not performed because queue is finalized
     MTMQ_RC_TIMEDOUT, // operation not performed in given amount of time
     MTMQ_RC_INTERRUPTED, // interrupted by signal (should never happen on posix-compliant system)
-    MTMQ_RC_ERROR // some error happened (requires investigation and debugging)
+    MTMQ_RC_ERROR, // some error happened (requires investigation and debugging)
+    MTMQ_RC_DROPPED // subscriber of broadcast ring was dropped for lagging behind
 };
 
+// Queue creation flags.
+enum {
+    MTMQ_F_SPSC = 0x0001, // single producer / single consumer lock-free ring
+    MTMQ_F_MPMC = 0x0002, // multiple producers / multiple consumers lock-free ring
+    MTMQ_F_POW2 = 0x0004, // round size up to power of two for mask-based indexing
+    MTMQ_F_UNBOUNDED = 0x0008, // no capacity limit, size is number of elements per block
+    MTMQ_F_CONFLATE = 0x0010, // code is key, push of queued code replaces its data in place
+    MTMQ_F_OVERWRITE = 0x0020, // push to full queue drops its oldest message instead of waiting
+    MTMQ_F_NUMA = 0x0040, // bind queue memory to NUMA node numa_node
+    MTMQ_F_HUGE = 0x0080, // back queue memory by huge pages where possible
+    MTMQ_F_STAMP = 0x0100 // stamp messages with enqueue time, for residency statistics and ages
+};
+
+// Callback for messages dropped by overwriting queue.
+typedef void (*mtmq_evict_fn)(void *arg, int code, void *data);
+
+// Max number of priority levels of queue.
+#define MTMQ_MAX_LEVELS 32
+
+// Queue creation attributes.
+typedef struct mtmq_attr {
+    int flags; // combination of MTMQ_F_* flags
+    int spin_ns; // max time in nanoseconds to spin before blocking, 0 - don't spin
+    int payload_size; // size of inline payload slot of each element, 0 - no slots
+    int levels; // number of priority levels (mutex engine only), 0 or 1 - single FIFO
+    int starve_limit; // pops of higher levels in a row before waiting lower level is served, 0 - strict priority
+    int max_size; // max capacity of elastic queue (mutex engine only), 0 - fixed capacity
+    int shards; // number of shards of queue, 0 or 1 - not sharded
+    mtmq_evict_fn evict; // overwriting queue: called for each dropped message, NULL - none
+    void *evict_arg; // first argument of evict callback
+    int numa_node; // NUMA node of queue memory (with MTMQ_F_NUMA flag)
+    int rd_batch; // blocked consumer is woken up once queue holds rd_batch messages (mutex engine), 0 - at once
+    int wr_batch; // blocked producer is woken up once queue has room for wr_batch messages (mutex engine), 0 - at once
+    int batch_ms; // max time blocked side waits for rest of its batch, 0 - no limit
+} mtmq_attr_t;
+
+
+// Number of buckets of wait time histograms.
+#define MTMQ_STATS_HIST 32
+
+/* Queue statistics.
+ *
+ * Waits count times producers (wr) or consumers (rd) had to block on full or
+ * empty queue, not counting attempts with zero timeout. Bucket i of histograms
+ * counts waits of [2^i, 2^(i+1)) microseconds, first bucket also shorter and
+ * last bucket also longer ones. Residency histogram of queue created with
+ * MTMQ_F_STAMP flag counts messages by time from push to pop, in the same
+ * buckets.
+ */
+typedef struct mtmq_stats {
+    int size; // queue max size
+    int num; // number of elements in queue
+    int max_num; // high-water mark of number of elements
+    uint64_t pushes; // number of messages pushed so far (MPMC: including pending reservations)
+    uint64_t pops; // number of messages popped so far (MPMC: including pending peeks)
+    uint64_t dropped; // number of messages dropped by overwriting pushes
+    uint64_t wr_waits; // number of blocking waits of producers
+    uint64_t rd_waits; // number of blocking waits of consumers
+    uint64_t wr_timeouts; // number of producer waits ended by timeout
+    uint64_t rd_timeouts; // number of consumer waits ended by timeout
+    uint64_t wr_wait_ns; // total time producers spent blocked
+    uint64_t rd_wait_ns; // total time consumers spent blocked
+    uint64_t wr_hist[MTMQ_STATS_HIST]; // producer waits by duration
+    uint64_t rd_hist[MTMQ_STATS_HIST]; // consumer waits by duration
+    uint64_t res_num; // number of stamped messages taken by consumers
+    uint64_t res_ns; // total time they spent in queue
+    uint64_t res_hist[MTMQ_STATS_HIST]; // messages by time spent in queue
+} mtmq_stats_t;
+
+// Callback of readiness notification.
+typedef void (*mtmq_notify_fn)(void *arg);
+
+/* Readiness notification, see mtmq_notify().
+ *
+ * Owned by caller, who sets fn and arg; other fields are private to queue.
+ */
+typedef struct mtmq_notify {
+    mtmq_notify_fn fn; // called once queue may be readable (writable) or is finalized
+    void *arg; // argument of fn
+    struct mtmq_notify *prev;
+    struct mtmq_notify *next;
+    int wr;
+    int once;
+    int armed;
+} mtmq_notify_t;
+
 
+void mtmq_attr_init(mtmq_attr_t *attr);
 mtmq_t *mtmq_create(int size);
+mtmq_t *mtmq_create_ex(int size, const mtmq_attr_t *attr);
+mtmq_t *mtmq_create_shared(const char *name, int size, const mtmq_attr_t *attr);
+mtmq_t *mtmq_open_shared(const char *name);
+int mtmq_unlink_shared(const char *name);
 int mtmq_destroy(mtmq_t *q);
+int mtmq_migrate(mtmq_t *q);
+void mtmq_deadline(struct timespec *deadline, int timeout_ms);
 int mtmq_push(mtmq_t *q, int code, void *data, int timeout);
+int mtmq_push_until(mtmq_t *q, int code, void *data, const struct timespec *deadline);
+int mtmq_push_prio(mtmq_t *q, int prio, int code, void *data, int timeout);
+int mtmq_push_key(mtmq_t *q, uint64_t key, int code, void *data, int timeout);
 int mtmq_pop(mtmq_t *q, int *code, void **data, int timeout);
+int mtmq_pop_until(mtmq_t *q, int *code, void **data, const struct timespec *deadline);
+int mtmq_pop_aged(mtmq_t *q, int *code, void **data, int64_t *age_ns, int timeout);
+int mtmq_try_push(mtmq_t *q, int code, void *data);
+int mtmq_try_pop(mtmq_t *q, int *code, void **data);
+int mtmq_pop_back(mtmq_t *q, int *code, void **data, int timeout);
+int mtmq_pop_back_n(mtmq_t *q, int *codes, void **datas, int n, int timeout, int *popped);
+int mtmq_push_n(mtmq_t *q, const int *codes, void *const *datas, int n, int timeout, int *pushed);
+int mtmq_push_n_until(mtmq_t *q, const int *codes, void *const *datas, int n, const struct timespec *deadline, int *pushed);
+int mtmq_pop_n(mtmq_t *q, int *codes, void **datas, int n, int timeout, int *popped);
+int mtmq_pop_n_until(mtmq_t *q, int *codes, void **datas, int n, const struct timespec *deadline, int *popped);
+int mtmq_drain(mtmq_t *q, int *codes, void **datas, int n, int *drained);
+int mtmq_pop_any(mtmq_t **qs, int n, int *which, int *code, void **data, int timeout);
+int mtmq_reserve(mtmq_t *q, void **buf, int timeout);
+int mtmq_commit(mtmq_t *q, void *buf, int code);
+int mtmq_peek(mtmq_t *q, int *code, void **buf, int timeout);
+int mtmq_release(mtmq_t *q, void *buf);
+int mtmq_notify(mtmq_t *q, int wr, mtmq_notify_t *n);
+int mtmq_notify_cancel(mtmq_t *q, mtmq_notify_t *n);
 void mtmq_finalize(mtmq_t *q);
+int mtmq_finalize_and_steal(mtmq_t *q, int *codes, void **datas, int n, int *stolen);
 int mtmq_is_finalized(mtmq_t *q);
+int mtmq_count(mtmq_t *q);
+int mtmq_get_stats(mtmq_t *q, mtmq_stats_t *stats);
+int mtmq_get_fd(mtmq_t *q);
 
 
 #endif
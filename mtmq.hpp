@@ -0,0 +1,464 @@
+#ifndef MTMQ_HPP_INCLUDED
+#define MTMQ_HPP_INCLUDED
+
+/* C++ typed queue with compile-time capacity (C++17, header-only).
+ *
+ *   mtmq_cpp::typed_queue<T, Capacity, MultiProducer, MultiConsumer>
+ *   mtmq_cpp::spsc_queue<T, Capacity> - one producer and one consumer thread
+ *   mtmq_cpp::mpmc_queue<T, Capacity> - any number of both
+ *
+ * Counterpart of mtmq_typed.h for arbitrary element types: elements are
+ * constructed in their slot by push (moved, copied or emplaced) and moved out
+ * and destroyed by pop, so element is moved only if operation succeeds (push
+ * to SPSC queue which loses to concurrent finalization moves it back). With
+ * single producer and consumer queue uses ring with cached counters,
+ * otherwise cells with sequence counters, both as in mtmq.c.
+ *
+ * Operations return MTMQ_RC_* codes with the same meaning and timeout
+ * convention (milliseconds, < 0 - forever, 0 - don't wait) as mtmq_push()
+ * and mtmq_pop(). Elements left in queue are destroyed with it.
+ *
+ * With C++20 coroutines, also awaitable operations on mtmq_t queues (these
+ * need mtmq.c linked):
+ *
+ *   co_await mtmq_cpp::async_push(q, code, data) - MTMQ_RC_* code
+ *   co_await mtmq_cpp::async_pop(q) - mtmq_cpp::pop_result
+ */
+
+extern "C" {
+#include "mtmq.h"
+}
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#   include <coroutine>
+#   define MTMQ_HPP_COROUTINES 1
+#endif
+
+#ifndef MTMQ_CACHE_LINE
+#   define MTMQ_CACHE_LINE 128
+#endif
+
+
+namespace mtmq_cpp {
+
+template <typename T, std::size_t Capacity, bool MultiProducer = false, bool MultiConsumer = false>
+class typed_queue {
+    static_assert(Capacity > 1 && (Capacity & (Capacity - 1)) == 0, "capacity must be power of two, at least 2");
+    static_assert(std::is_nothrow_move_constructible<T>::value && std::is_nothrow_move_assignable<T>::value,
+        "element must be movable without throwing");
+
+    static constexpr bool spsc = !MultiProducer && !MultiConsumer;
+    static constexpr std::uint64_t fin_bit = std::uint64_t(1) << 63;
+    static constexpr std::uint64_t mask = Capacity - 1;
+
+    struct slot {
+        alignas(T) unsigned char raw[sizeof(T)];
+        T *get() { return std::launder(reinterpret_cast<T*>(raw)); }
+    };
+
+    // seq == pos - free for position pos, seq == pos + 1 - holds element of pos
+    struct cell : slot {
+        std::atomic<std::uint64_t> seq;
+    };
+
+    using cell_t = typename std::conditional<spsc, slot, cell>::type;
+
+public:
+    typed_queue()
+    {
+        if constexpr (!spsc) {
+            for (std::uint64_t i=0; i<Capacity; i++)
+                cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~typed_queue()
+    {
+        std::uint64_t head = head_.load(std::memory_order_relaxed);
+        std::uint64_t tail = tail_.load(std::memory_order_relaxed) & ~fin_bit;
+        for (; head != tail; head++)
+            cells_[head & mask].get()->~T();
+    }
+
+    typed_queue(const typed_queue&) = delete;
+    typed_queue &operator=(const typed_queue&) = delete;
+
+    int try_push(const T &v) { return try_emplace(v); }
+    int try_push(T &&v)
+    {
+        // SPSC producer learns of concurrent finalization only after element is in slot
+        if constexpr (spsc && std::is_nothrow_move_assignable<T>::value) {
+            std::uint64_t pos;
+            int rc = claim_wr_(pos);
+            if (rc != MTMQ_RC_OK)
+                return rc;
+
+            cell_t &c = cells_[pos & mask];
+            ::new (static_cast<void*>(c.raw)) T(std::move(v));
+            return publish_(c, pos, &v);
+        } else
+            return try_emplace(std::move(v));
+    }
+
+    /* Construct element in place from args, only if there is room. Claimed
+     * MPMC cell can't be given back, so element which may throw on
+     * construction is constructed first and moved to cell. Element emplaced
+     * to SPSC queue which is finalized meanwhile is destroyed, so args may be
+     * moved from even if MTMQ_RC_FINALIZED is returned.
+     */
+    template <typename... Args>
+    int try_emplace(Args&&... args)
+    {
+        if constexpr (!spsc && !std::is_nothrow_constructible<T, Args&&...>::value) {
+            T tmp(std::forward<Args>(args)...);
+            return try_emplace(std::move(tmp));
+        }
+
+        std::uint64_t pos;
+        int rc = claim_wr_(pos);
+        if (rc != MTMQ_RC_OK)
+            return rc;
+
+        cell_t &c = cells_[pos & mask];
+        ::new (static_cast<void*>(c.raw)) T(std::forward<Args>(args)...);
+        return publish_(c, pos);
+    }
+
+    int push(const T &v, int timeout = -1)
+    {
+        // copy once rather than on every retry
+        if constexpr (!spsc && !std::is_nothrow_copy_constructible<T>::value) {
+            T tmp(v);
+            return push(std::move(tmp), timeout);
+        } else
+            return wait_(1, timeout, [&] { return try_emplace(v); });
+    }
+
+    int push(T &&v, int timeout = -1)
+    {
+        return wait_(1, timeout, [&] { return try_push(std::move(v)); });
+    }
+
+    int try_pop(T &v)
+    {
+        std::uint64_t pos;
+        int rc = claim_rd_(pos);
+        if (rc != MTMQ_RC_OK)
+            return rc;
+
+        cell_t &c = cells_[pos & mask];
+        T *p = c.get();
+        v = std::move(*p);
+        p->~T();
+        release_(c, pos);
+        return MTMQ_RC_OK;
+    }
+
+    int pop(T &v, int timeout = -1)
+    {
+        return wait_(0, timeout, [&] { return try_pop(v); });
+    }
+
+    // Producers get MTMQ_RC_FINALIZED from now on, consumers once queue is drained.
+    void finalize()
+    {
+        tail_.fetch_or(fin_bit);
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (int i=0; i<2; i++) {
+            epoch_[i].fetch_add(1, std::memory_order_release);
+            cond_[i].notify_all();
+        }
+    }
+
+    bool is_finalized() const
+    {
+        return (tail_.load() & fin_bit) != 0;
+    }
+
+    int count() const
+    {
+        std::uint64_t head = head_.load();
+        std::uint64_t num = (tail_.load() & ~fin_bit) - head;
+        return (num > Capacity) ? int(Capacity) : int(num);
+    }
+
+    static constexpr std::size_t capacity() { return Capacity; }
+
+private:
+    // Claim position of free slot, or fail with MTMQ_RC_TIMEDOUT if queue is full.
+    int claim_wr_(std::uint64_t &pos)
+    {
+        pos = tail_.load(std::memory_order_relaxed);
+        if constexpr (spsc) {
+            if (pos & fin_bit)
+                return MTMQ_RC_FINALIZED;
+            if (pos - head_cache_ >= Capacity) {
+                head_cache_ = head_.load(std::memory_order_acquire);
+                if (pos - head_cache_ >= Capacity)
+                    return MTMQ_RC_TIMEDOUT;
+            }
+            return MTMQ_RC_OK;
+        } else {
+            for (;;) {
+                if (pos & fin_bit)
+                    return MTMQ_RC_FINALIZED;
+                std::uint64_t seq = cells_[pos & mask].seq.load(std::memory_order_acquire);
+                std::int64_t dif = std::int64_t(seq - pos);
+                if (dif == 0) {
+                    if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        return MTMQ_RC_OK;
+                } else if (dif < 0)
+                    return MTMQ_RC_TIMEDOUT;
+                else
+                    pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /* Publish element constructed in slot of claimed position. If queue was
+     * finalized meanwhile, element is moved back to 'back' (unless NULL) and
+     * destroyed.
+     */
+    int publish_(cell_t &c, std::uint64_t pos, T *back = nullptr)
+    {
+        if constexpr (spsc) {
+            // only finalization can change tail under our feet
+            if (!tail_.compare_exchange_strong(pos, pos + 1)) {
+                if (back)
+                    *back = std::move(*c.get());
+                c.get()->~T();
+                return MTMQ_RC_FINALIZED;
+            }
+        } else
+            c.seq.store(pos + 1);
+        wake_(0);
+        return MTMQ_RC_OK;
+    }
+
+    // Claim position of published element, or fail with MTMQ_RC_TIMEDOUT if queue is empty.
+    int claim_rd_(std::uint64_t &pos)
+    {
+        pos = head_.load(std::memory_order_relaxed);
+        if constexpr (spsc) {
+            if (pos == tail_cache_) {
+                std::uint64_t tail = tail_.load();
+                tail_cache_ = tail & ~fin_bit;
+                if (pos == tail_cache_)
+                    return (tail & fin_bit) ? MTMQ_RC_FINALIZED : MTMQ_RC_TIMEDOUT;
+            }
+            return MTMQ_RC_OK;
+        } else {
+            for (;;) {
+                std::uint64_t seq = cells_[pos & mask].seq.load(std::memory_order_acquire);
+                std::int64_t dif = std::int64_t(seq - (pos + 1));
+                if (dif == 0) {
+                    if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        return MTMQ_RC_OK;
+                } else if (dif < 0) {
+                    // empty, or producer claimed cell but not yet stored element
+                    std::uint64_t tail = tail_.load();
+                    if ((tail & fin_bit) && (tail & ~fin_bit) == pos)
+                        return MTMQ_RC_FINALIZED;
+                    return MTMQ_RC_TIMEDOUT;
+                } else
+                    pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Return slot of taken element to producers.
+    void release_(cell_t &c, std::uint64_t pos)
+    {
+        if constexpr (spsc) {
+            (void)c;
+            head_.store(pos + 1);
+        } else
+            c.seq.store(pos + Capacity);
+        wake_(1);
+    }
+
+    /* Wake up side wr after the other side published its change by sequentially
+     * consistent operation, so either it sees waiter registered or waiter sees
+     * the change. Epoch is bumped under mutex, so wake-up is never lost.
+     */
+    void wake_(int wr)
+    {
+        if (waiting_[wr].load() == 0)
+            return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        epoch_[wr].fetch_add(1, std::memory_order_release);
+        cond_[wr].notify_one();
+    }
+
+    // Retry operation op of side wr until it's done, queue is finalized or timeout expires.
+    template <typename Op>
+    int wait_(int wr, int timeout, Op op)
+    {
+        int rc = op();
+        if (rc != MTMQ_RC_TIMEDOUT || timeout == 0)
+            return rc;
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        waiting_[wr].fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (;;) {
+            unsigned int epoch = epoch_[wr].load();
+            rc = op();
+            if (rc != MTMQ_RC_TIMEDOUT)
+                break;
+
+            std::unique_lock<std::mutex> lock(mtx_);
+            auto woken = [&] { return epoch_[wr].load(std::memory_order_relaxed) != epoch; };
+            if (timeout < 0)
+                cond_[wr].wait(lock, woken);
+            else if (!cond_[wr].wait_until(lock, deadline, woken)) {
+                lock.unlock();
+                rc = op();
+                break;
+            }
+        }
+        waiting_[wr].fetch_sub(1);
+        return rc;
+    }
+
+    // producer side
+    alignas(MTMQ_CACHE_LINE) std::atomic<std::uint64_t> tail_{0};  // elements pushed so far (and fin_bit)
+    std::uint64_t head_cache_ = 0;  // SPSC: producer's last seen value of head
+    // consumer side
+    alignas(MTMQ_CACHE_LINE) std::atomic<std::uint64_t> head_{0};  // elements popped so far
+    std::uint64_t tail_cache_ = 0;  // SPSC: consumer's last seen value of tail
+    // waiting readers [0] and writers [1]
+    alignas(MTMQ_CACHE_LINE) std::mutex mtx_;
+    std::condition_variable cond_[2];
+    std::atomic<int> waiting_[2] = {{0}, {0}};  // number of registered waiters
+    std::atomic<unsigned int> epoch_[2] = {{0}, {0}};  // number of wake-ups
+    alignas(MTMQ_CACHE_LINE) cell_t cells_[Capacity];
+};
+
+
+template <typename T, std::size_t Capacity>
+using spsc_queue = typed_queue<T, Capacity, false, false>;
+
+template <typename T, std::size_t Capacity>
+using mpmc_queue = typed_queue<T, Capacity, true, true>;
+
+
+#ifdef MTMQ_HPP_COROUTINES
+
+/* Awaiter of operation on mtmq_t queue, Derived provides attempt_() doing
+ * operation without waiting. Suspended coroutine is resumed by thread which
+ * made queue ready (from callback of mtmq_notify()), or right away by the
+ * awaiting thread if queue became ready while suspending.
+ */
+template <typename Derived, int Wr>
+class ready_awaiter {
+public:
+    ready_awaiter(const ready_awaiter&) = delete;
+    ready_awaiter &operator=(const ready_awaiter&) = delete;
+
+    bool await_ready()
+    {
+        rc_ = self_().attempt_();
+        return rc_ != MTMQ_RC_TIMEDOUT;
+    }
+
+    // after successful registration coroutine may be resumed before we return
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        h_ = h;
+        node_.fn = &ready_awaiter::on_ready_;
+        node_.arg = this;
+        if (mtmq_notify(q_, Wr, &node_) != MTMQ_RC_OK) {
+            rc_ = MTMQ_RC_ERROR;
+            return false;
+        }
+        return true;
+    }
+
+protected:
+    explicit ready_awaiter(mtmq_t *q) : q_(q) {}
+
+    mtmq_t *q_;
+    int rc_ = MTMQ_RC_ERROR;
+
+private:
+    Derived &self_() { return static_cast<Derived&>(*this); }
+
+    static void on_ready_(void *arg)
+    {
+        ready_awaiter *a = static_cast<ready_awaiter*>(arg);
+        a->rc_ = a->self_().attempt_();
+        // other thread was faster, wait for next chance
+        if (a->rc_ == MTMQ_RC_TIMEDOUT) {
+            if (mtmq_notify(a->q_, Wr, &a->node_) == MTMQ_RC_OK)
+                return;
+            a->rc_ = MTMQ_RC_ERROR;
+        }
+        a->h_.resume();
+    }
+
+    mtmq_notify_t node_{};
+    std::coroutine_handle<> h_;
+};
+
+
+// Result of awaited pop.
+struct pop_result {
+    int rc;  // MTMQ_RC_* code
+    int code;  // message code, if rc is MTMQ_RC_OK
+    void *data;  // message data, if rc is MTMQ_RC_OK
+};
+
+
+class push_awaiter : public ready_awaiter<push_awaiter, 1> {
+    friend class ready_awaiter<push_awaiter, 1>;
+public:
+    push_awaiter(mtmq_t *q, int code, void *data) : ready_awaiter(q), code_(code), data_(data) {}
+    int await_resume() const { return rc_; }
+private:
+    int attempt_() { return mtmq_try_push(q_, code_, data_); }
+    int code_;
+    void *data_;
+};
+
+
+class pop_awaiter : public ready_awaiter<pop_awaiter, 0> {
+    friend class ready_awaiter<pop_awaiter, 0>;
+public:
+    explicit pop_awaiter(mtmq_t *q) : ready_awaiter(q) {}
+    pop_result await_resume() const { return {rc_, code_, data_}; }
+private:
+    int attempt_() { return mtmq_try_pop(q_, &code_, &data_); }
+    int code_ = 0;
+    void *data_ = nullptr;
+};
+
+
+// Push message, suspending coroutine while queue is full.
+inline push_awaiter async_push(mtmq_t *q, int code, void *data)
+{
+    return push_awaiter(q, code, data);
+}
+
+// Pop message, suspending coroutine while queue is empty.
+inline pop_awaiter async_pop(mtmq_t *q)
+{
+    return pop_awaiter(q);
+}
+
+#endif
+
+}  // namespace mtmq_cpp
+
+
+#endif
@@ -0,0 +1,379 @@
+/* Broadcast ring with per-subscriber cursors.
+ *
+ */
+
+
+#include "mtmq_bcast.h"
+#include "mtmq_clock.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+
+// Broadcast ring element.
+typedef struct mtmq_bcast_elt {
+    int code;
+    void *data;
+} mtmq_bcast_elt_t;
+
+
+// Subscriber state.
+enum {
+    BCAST_SUB_FREE,  // slot is not used
+    BCAST_SUB_ACTIVE,  // subscriber reads messages
+    BCAST_SUB_DROPPED  // subscriber lagged behind and lost messages
+};
+
+
+// Subscriber.
+typedef struct mtmq_bcast_sub {
+    uint64_t pos;  // number of next message to read
+    int state;  // one of BCAST_SUB_* values
+} mtmq_bcast_sub_t;
+
+
+/* Broadcast ring.
+ *
+ * Producer writes each message to ring once, every subscriber reads it at
+ * its own cursor. Slot is reused when the slowest subscriber has read it, so
+ * subscriber lagging size messages behind blocks producers or, with
+ * MTMQ_BCAST_F_DROP flag, is dropped. Message counters are free-running.
+ */
+struct mtmq_bcast {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond_rd;  // subscribers wait for new messages
+    pthread_cond_t cond_wr;  // producers wait for the slowest subscriber
+    int size;  // ring size
+    int max_subs;  // number of subscriber slots
+    int flags;  // creation flags
+    int fin;  // ring is finalized
+    int rd_waiting;  // number of subscribers waiting on cond_rd
+    int wr_waiting;  // number of producers waiting on cond_wr
+    uint64_t tail;  // number of messages pushed so far
+    uint64_t head;  // cursor of the slowest subscriber (may lag behind actual one)
+    mtmq_bcast_elt_t *arr;  // ring
+    mtmq_bcast_sub_t subs[];  // subscriber slots
+};
+
+
+/* Create broadcast ring.
+ * In:
+ *   size - ring size
+ *   max_subs - max number of subscribers
+ *   flags - combination of MTMQ_BCAST_F_* flags
+ * Out:
+ *   NULL - create failed
+ *   not NULL - pointer to created ring
+ * Note:
+ *   Messages pushed while ring has no subscribers are not kept.
+ */
+mtmq_bcast_t *mtmq_bcast_create(int size, int max_subs, int flags)
+{
+    if (size <= 0 || max_subs <= 0)
+        return NULL;
+
+    size_t subs_size = sizeof(mtmq_bcast_sub_t) * max_subs;
+    mtmq_bcast_t *b = calloc(1, sizeof(*b) + subs_size + sizeof(mtmq_bcast_elt_t) * size);
+    if (!b)
+        return NULL;
+    b->size = size;
+    b->max_subs = max_subs;
+    b->flags = flags;
+    b->arr = (mtmq_bcast_elt_t*)((char*)b->subs + subs_size);
+
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    int rc = pthread_condattr_setclock(&ca, MTMQ_CLOCK_TYPE);
+    if (rc != 0) {
+        pthread_condattr_destroy(&ca);
+        free(b);
+        return NULL;
+    }
+
+    pthread_mutex_init(&b->mtx, NULL);
+    pthread_cond_init(&b->cond_rd, &ca);
+    pthread_cond_init(&b->cond_wr, &ca);
+    pthread_condattr_destroy(&ca);
+
+    return b;
+}
+
+
+/* Destroy broadcast ring.
+ * In:
+ *   b - ring
+ * Out:
+ *   MTMQ_RC_OK - ring deleted
+ *   MTMQ_RC_ERROR - some error occured
+ */
+int mtmq_bcast_destroy(mtmq_bcast_t *b)
+{
+    if (!b)
+        return MTMQ_RC_ERROR;
+
+    int rc = pthread_cond_destroy(&b->cond_wr);
+    if (rc)
+        return MTMQ_RC_ERROR;
+    rc = pthread_cond_destroy(&b->cond_rd);
+    if (rc)
+        return MTMQ_RC_ERROR;
+    rc = pthread_mutex_destroy(&b->mtx);
+    if (rc)
+        return MTMQ_RC_ERROR;
+
+    free(b);
+
+    return MTMQ_RC_OK;
+}
+
+
+// Internal helper to update cursor of the slowest subscriber.
+static void bcast_min(mtmq_bcast_t *b)
+{
+    uint64_t head = b->tail;
+
+    for (int i=0; i<b->max_subs; i++) {
+        if (b->subs[i].state == BCAST_SUB_ACTIVE && b->subs[i].pos < head)
+            head = b->subs[i].pos;
+    }
+    b->head = head;
+}
+
+
+// Internal helper to wait on condition variable, to - deadline or NULL.
+static int bcast_wait(mtmq_bcast_t *b, pthread_cond_t *cond, int *waiting, const struct timespec *to)
+{
+    (*waiting)++;
+    int rc = to ? pthread_cond_timedwait(cond, &b->mtx, to) : pthread_cond_wait(cond, &b->mtx);
+    (*waiting)--;
+
+    if (rc == 0)
+        return MTMQ_RC_OK;
+    if (rc == ETIMEDOUT)
+        return MTMQ_RC_TIMEDOUT;
+    if (rc == EINTR)
+        return MTMQ_RC_INTERRUPTED;
+    return MTMQ_RC_ERROR;
+}
+
+
+/* Subscribe to broadcast ring.
+ * In:
+ *   b - ring
+ * Out:
+ *   >= 0 - subscriber id
+ *   -1 - no free subscriber slot or ring is finalized
+ * Note:
+ *   Subscriber receives messages pushed after subscribing.
+ */
+int mtmq_bcast_subscribe(mtmq_bcast_t *b)
+{
+    int ret = -1;
+
+    if (!b)
+        return -1;
+
+    pthread_mutex_lock(&b->mtx);
+    for (int i=0; i<b->max_subs && !b->fin; i++) {
+        if (b->subs[i].state == BCAST_SUB_FREE) {
+            b->subs[i].state = BCAST_SUB_ACTIVE;
+            b->subs[i].pos = b->tail;
+            ret = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&b->mtx);
+
+    return ret;
+}
+
+
+/* Unsubscribe from broadcast ring.
+ * In:
+ *   b - ring
+ *   sub - subscriber id (active or dropped)
+ * Out:
+ *   MTMQ_RC_OK - done
+ *   MTMQ_RC_ERROR - sub is not valid subscriber id
+ * Note:
+ *   Subscriber must not be used by its consumer any more.
+ */
+int mtmq_bcast_unsubscribe(mtmq_bcast_t *b, int sub)
+{
+    if (!b || sub < 0 || sub >= b->max_subs)
+        return MTMQ_RC_ERROR;
+
+    pthread_mutex_lock(&b->mtx);
+    int state = b->subs[sub].state;
+    b->subs[sub].state = BCAST_SUB_FREE;
+    // the slowest subscriber may have gone
+    if (state == BCAST_SUB_ACTIVE && b->subs[sub].pos == b->head && b->wr_waiting)
+        pthread_cond_broadcast(&b->cond_wr);
+    pthread_mutex_unlock(&b->mtx);
+
+    return (state == BCAST_SUB_FREE) ? MTMQ_RC_ERROR : MTMQ_RC_OK;
+}
+
+
+/* Push message to all subscribers of broadcast ring.
+ * In:
+ *   b - ring
+ *   code, data, timeout - same as for mtmq_push()
+ * Out:
+ *   same as for mtmq_push()
+ * Note:
+ *   Producer waits while the slowest subscriber is size messages behind.
+ *   With MTMQ_BCAST_F_DROP flag such subscribers are dropped instead: their
+ *   pops return MTMQ_RC_DROPPED until they unsubscribe. Data is shared by
+ *   all subscribers, so they should treat it as read-only.
+ */
+int mtmq_bcast_push(mtmq_bcast_t *b, int code, void *data, int timeout)
+{
+    mtmq_dl_t dl = dl_rel(timeout);
+    int ret = MTMQ_RC_OK;
+
+    if (!b)
+        return MTMQ_RC_ERROR;
+
+    pthread_mutex_lock(&b->mtx);
+
+    while (!b->fin && b->tail - b->head >= (uint64_t)b->size) {
+        bcast_min(b);
+        if (b->tail - b->head < (uint64_t)b->size)
+            break;
+        if (b->flags & MTMQ_BCAST_F_DROP) {
+            for (int i=0; i<b->max_subs; i++) {
+                if (b->subs[i].state == BCAST_SUB_ACTIVE && b->subs[i].pos == b->head)
+                    b->subs[i].state = BCAST_SUB_DROPPED;
+            }
+            bcast_min(b);
+            // dropped subscribers may be waiting for message
+            if (b->rd_waiting)
+                pthread_cond_broadcast(&b->cond_rd);
+            continue;
+        }
+        if (timeout == 0) {
+            ret = MTMQ_RC_TIMEDOUT;
+            break;
+        }
+        ret = bcast_wait(b, &b->cond_wr, &b->wr_waiting, dl_get(&dl));
+        if (ret != MTMQ_RC_OK)
+            break;
+    }
+
+    if (b->fin)
+        ret = MTMQ_RC_FINALIZED;
+    else if (b->tail - b->head < (uint64_t)b->size) {
+        mtmq_bcast_elt_t *e = &b->arr[b->tail % b->size];
+        e->code = code;
+        e->data = data;
+        b->tail++;
+        if (b->rd_waiting)
+            pthread_cond_broadcast(&b->cond_rd);
+        ret = MTMQ_RC_OK;
+    }
+
+    pthread_mutex_unlock(&b->mtx);
+
+    return ret;
+}
+
+
+/* Pop several messages of subscriber from broadcast ring.
+ * In:
+ *   b - ring
+ *   sub - subscriber id
+ *   codes, datas, n, timeout, popped - same as for mtmq_pop_n()
+ * Out:
+ *   same as for mtmq_pop_n()
+ *   MTMQ_RC_DROPPED - subscriber was dropped for lagging behind
+ *   MTMQ_RC_ERROR - also if sub is not valid subscriber id
+ * Note:
+ *   Subscriber id must be used by one consumer thread at a time.
+ */
+int mtmq_bcast_pop_n(mtmq_bcast_t *b, int sub, int *codes, void **datas, int n, int timeout, int *popped)
+{
+    mtmq_dl_t dl = dl_rel(timeout);
+    int ret = MTMQ_RC_OK;
+
+    *popped = 0;
+    if (!b || sub < 0 || sub >= b->max_subs || n < 0)
+        return MTMQ_RC_ERROR;
+    if (n == 0)
+        return MTMQ_RC_OK;
+
+    pthread_mutex_lock(&b->mtx);
+
+    mtmq_bcast_sub_t *s = &b->subs[sub];
+    while (s->state == BCAST_SUB_ACTIVE && s->pos == b->tail && !b->fin) {
+        if (timeout == 0) {
+            ret = MTMQ_RC_TIMEDOUT;
+            break;
+        }
+        ret = bcast_wait(b, &b->cond_rd, &b->rd_waiting, dl_get(&dl));
+        if (ret != MTMQ_RC_OK)
+            break;
+    }
+
+    if (s->state == BCAST_SUB_FREE)
+        ret = MTMQ_RC_ERROR;
+    else if (s->state == BCAST_SUB_DROPPED)
+        ret = MTMQ_RC_DROPPED;
+    else if (s->pos != b->tail) {
+        uint64_t pos = s->pos;
+        int k;
+        for (k=0; k<n && pos != b->tail; k++, pos++) {
+            mtmq_bcast_elt_t *e = &b->arr[pos % b->size];
+            codes[k] = e->code;
+            datas[k] = e->data;
+        }
+        // the slowest subscriber frees slots for waiting producers
+        if (s->pos == b->head && b->wr_waiting)
+            pthread_cond_broadcast(&b->cond_wr);
+        s->pos = pos;
+        *popped = k;
+        ret = MTMQ_RC_OK;
+    } else if (b->fin)
+        ret = MTMQ_RC_FINALIZED;
+
+    pthread_mutex_unlock(&b->mtx);
+
+    return ret;
+}
+
+
+/* Pop message of subscriber from broadcast ring.
+ * In:
+ *   b - ring
+ *   sub - subscriber id
+ *   code, data, timeout - same as for mtmq_pop()
+ * Out:
+ *   same as for mtmq_bcast_pop_n()
+ */
+int mtmq_bcast_pop(mtmq_bcast_t *b, int sub, int *code, void **data, int timeout)
+{
+    int popped;
+    return mtmq_bcast_pop_n(b, sub, code, data, 1, timeout, &popped);
+}
+
+
+/* Finalize broadcast ring.
+ * In:
+ *   b - ring
+ * Note:
+ *   Producers get MTMQ_RC_FINALIZED at once, subscribers after reading
+ *   messages left for them.
+ */
+void mtmq_bcast_finalize(mtmq_bcast_t *b)
+{
+    if (!b)
+        return;
+
+    pthread_mutex_lock(&b->mtx);
+    b->fin = 1;
+    pthread_cond_broadcast(&b->cond_rd);
+    pthread_cond_broadcast(&b->cond_wr);
+    pthread_mutex_unlock(&b->mtx);
+}
@@ -0,0 +1,25 @@
+#ifndef MTMQ_BCAST_H_INCLUDED
+#define MTMQ_BCAST_H_INCLUDED
+
+#include "mtmq.h"
+
+// Opaque type for broadcast ring.
+typedef struct mtmq_bcast mtmq_bcast_t;
+
+// Broadcast ring creation flags.
+enum {
+    MTMQ_BCAST_F_DROP = 0x0001 // drop lagging subscribers instead of blocking producer
+};
+
+
+mtmq_bcast_t *mtmq_bcast_create(int size, int max_subs, int flags);
+int mtmq_bcast_destroy(mtmq_bcast_t *b);
+int mtmq_bcast_subscribe(mtmq_bcast_t *b);
+int mtmq_bcast_unsubscribe(mtmq_bcast_t *b, int sub);
+int mtmq_bcast_push(mtmq_bcast_t *b, int code, void *data, int timeout);
+int mtmq_bcast_pop(mtmq_bcast_t *b, int sub, int *code, void **data, int timeout);
+int mtmq_bcast_pop_n(mtmq_bcast_t *b, int sub, int *codes, void **datas, int n, int timeout, int *popped);
+void mtmq_bcast_finalize(mtmq_bcast_t *b);
+
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef MTMQ_CLOCK_H_INCLUDED
+#define MTMQ_CLOCK_H_INCLUDED
+
+/* Waiting clock and deadlines shared by queue modules.
+ *
+ * Internal header, not part of API.
+ */
+
+#include <time.h>
+
+
+/* Clock type to use when waiting on condition variable.
+ *
+ * Use of CLOCK_MONOTONIC ensures waiting does not hang if
+ * host time is set back in time. But it isn't supported on MinGW.
+ */
+#ifdef _WIN32
+#   define MTMQ_CLOCK_TYPE CLOCK_REALTIME
+#else
+#   define MTMQ_CLOCK_TYPE CLOCK_MONOTONIC
+#endif
+
+
+// Internal helper function for timeout calculation.
+static inline void calc_abs_timeout(struct timespec *ts, int timeout_ms)
+{
+    struct timespec t;
+    t.tv_nsec = timeout_ms;  // store to wider type
+    t.tv_nsec *= 1000000;  // convert milliseconds to nanosecons
+
+    clock_gettime(MTMQ_CLOCK_TYPE, ts);
+    ts->tv_nsec += t.tv_nsec;
+    ts->tv_sec += ts->tv_nsec / 1000000000;
+    ts->tv_nsec = ts->tv_nsec % 1000000000;
+}
+
+
+/* Waiting deadline of operation.
+ *
+ * Relative timeout is turned into absolute deadline only when operation is
+ * about to block, so calls which find room (or data) don't read the clock.
+ */
+typedef struct mtmq_dl {
+    int timeout;  // timeout in milliseconds, < 0 - wait indefinately, 0 - don't wait
+    int set;  // abs is valid
+    struct timespec abs;  // absolute deadline
+} mtmq_dl_t;
+
+
+// Internal helper to make deadline of relative timeout in milliseconds.
+static inline mtmq_dl_t dl_rel(int timeout)
+{
+    mtmq_dl_t dl = { .timeout = timeout };
+    return dl;
+}
+
+
+// Internal helper to make deadline of absolute time (NULL - wait indefinately).
+static inline mtmq_dl_t dl_until(const struct timespec *until)
+{
+    mtmq_dl_t dl = { .timeout = until ? 1 : -1 };
+    if (until) {
+        dl.set = 1;
+        dl.abs = *until;
+    }
+    return dl;
+}
+
+
+// Internal helper to get absolute deadline to wait for, NULL if there is none.
+static inline const struct timespec *dl_get(mtmq_dl_t *dl)
+{
+    if (dl->timeout < 0)
+        return NULL;
+    if (!dl->set) {
+        calc_abs_timeout(&dl->abs, dl->timeout);
+        dl->set = 1;
+    }
+    return &dl->abs;
+}
+
+#endif
@@ -0,0 +1,356 @@
+/* Per-thread magazines of payload buffers.
+ *
+ */
+
+
+#include "mtmq_mag.h"
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+
+// Internal helper macro to round size up to alignment of any type.
+#define MAG_ALIGN(size) (((size) + alignof(max_align_t)-1) & ~(size_t)(alignof(max_align_t)-1))
+
+
+// Header of buffer, located just before buffer returned to application.
+typedef struct mtmq_mag_hdr {
+    struct mtmq_mag_owner *owner;  // magazine buffer belongs to
+    struct mtmq_mag_hdr *next;  // next buffer in free list of magazine
+} mtmq_mag_hdr_t;
+
+#define MAG_HDR_SIZE MAG_ALIGN(sizeof(mtmq_mag_hdr_t))
+
+
+// Block of buffers allocated from heap at once.
+typedef struct mtmq_mag_chunk {
+    struct mtmq_mag_chunk *next;  // next chunk of allocator
+} mtmq_mag_chunk_t;
+
+#define MAG_CHUNK_SIZE MAG_ALIGN(sizeof(mtmq_mag_chunk_t))
+
+
+/* Magazine of thread.
+ *
+ * Thread allocates from its free list without locking. Buffers freed by other
+ * threads are collected in batches and pushed to return queue of magazine
+ * they belong to, owner takes them back once its free list is empty. Magazine
+ * of exited thread is adopted by next thread starting to use allocator.
+ */
+typedef struct mtmq_mag_owner {
+    struct mtmq_mag_owner *next;  // next magazine of allocator
+    struct mtmq_mag *mag;  // allocator
+    int dead;  // thread exited, magazine is free for adoption (under allocator mutex)
+    mtmq_mag_hdr_t *free;  // buffers ready for allocation
+    mtmq_t *ret;  // buffers freed by other threads
+    struct mtmq_mag_owner *out_owner;  // magazine of buffers in outgoing batch
+    int num_out;  // number of buffers in outgoing batch
+    void **out;  // outgoing batch
+    void **in;  // buffers taken from return queue
+    int *codes;  // message codes for return queue, all zero
+} mtmq_mag_owner_t;
+
+
+/* Allocator.
+ *
+ * Buffers never go back to heap until allocator is destroyed, so they stay
+ * hot in caches of threads reusing them.
+ */
+struct mtmq_mag {
+    size_t stride;  // distance between buffers in chunk
+    int batch;  // number of buffers in chunk and in returned batch
+    pthread_key_t key;  // magazine of calling thread
+    pthread_mutex_t mtx;  // protects lists of magazines and chunks
+    mtmq_mag_owner_t *owners;  // all magazines
+    mtmq_mag_chunk_t *chunks;  // all chunks
+};
+
+
+// Internal helper to push outgoing batch of magazine to owner of its buffers.
+static int mag_flush(mtmq_mag_owner_t *o)
+{
+    int ret = MTMQ_RC_OK;
+    int done = 0;
+
+    while (done < o->num_out) {
+        int k;
+        ret = mtmq_push_n(o->out_owner->ret, o->codes, o->out + done, o->num_out - done, -1, &k);
+        if (ret != MTMQ_RC_OK)
+            break;
+        done += k;
+    }
+    o->num_out = 0;
+
+    return ret;
+}
+
+
+// Internal helper called on thread exit with magazine of thread.
+static void mag_exit(void *arg)
+{
+    mtmq_mag_owner_t *o = arg;
+
+    mag_flush(o);
+    pthread_mutex_lock(&o->mag->mtx);
+    o->dead = 1;
+    pthread_mutex_unlock(&o->mag->mtx);
+}
+
+
+// Internal helper to create magazine.
+static mtmq_mag_owner_t *mag_owner_new(mtmq_mag_t *m)
+{
+    int batch = m->batch;
+
+    mtmq_mag_owner_t *o = calloc(1, sizeof(*o) + (sizeof(void*) * 2 + sizeof(int)) * batch);
+    if (!o)
+        return NULL;
+    o->mag = m;
+    o->out = (void**)(o + 1);
+    o->in = o->out + batch;
+    o->codes = (int*)(o->in + batch);
+
+    // return queue never blocks freeing thread
+    mtmq_attr_t attr;
+    mtmq_attr_init(&attr);
+    attr.flags = MTMQ_F_UNBOUNDED;
+    o->ret = mtmq_create_ex(batch, &attr);
+    if (!o->ret) {
+        free(o);
+        return NULL;
+    }
+
+    return o;
+}
+
+
+// Internal helper to get magazine of calling thread, adopting or creating one on first use.
+static mtmq_mag_owner_t *mag_self(mtmq_mag_t *m)
+{
+    mtmq_mag_owner_t *o = pthread_getspecific(m->key);
+    if (o)
+        return o;
+
+    pthread_mutex_lock(&m->mtx);
+    for (o = m->owners; o && !o->dead; o = o->next)
+        ;
+    if (o)
+        o->dead = 0;
+    pthread_mutex_unlock(&m->mtx);
+
+    if (!o) {
+        o = mag_owner_new(m);
+        if (!o)
+            return NULL;
+        pthread_mutex_lock(&m->mtx);
+        o->next = m->owners;
+        m->owners = o;
+        pthread_mutex_unlock(&m->mtx);
+    }
+
+    if (pthread_setspecific(m->key, o) != 0) {
+        pthread_mutex_lock(&m->mtx);
+        o->dead = 1;
+        pthread_mutex_unlock(&m->mtx);
+        return NULL;
+    }
+
+    return o;
+}
+
+
+// Internal helper to refill empty free list of magazine.
+static void mag_refill(mtmq_mag_t *m, mtmq_mag_owner_t *o)
+{
+    int k;
+
+    // buffers returned by other threads first
+    if (mtmq_pop_n(o->ret, o->codes, o->in, m->batch, 0, &k) == MTMQ_RC_OK) {
+        for (int i=0; i<k; i++) {
+            mtmq_mag_hdr_t *h = (mtmq_mag_hdr_t*)((char*)o->in[i] - MAG_HDR_SIZE);
+            h->next = o->free;
+            o->free = h;
+        }
+        return;
+    }
+
+    mtmq_mag_chunk_t *c = malloc(MAG_CHUNK_SIZE + m->stride * m->batch);
+    if (!c)
+        return;
+    pthread_mutex_lock(&m->mtx);
+    c->next = m->chunks;
+    m->chunks = c;
+    pthread_mutex_unlock(&m->mtx);
+
+    for (int i=m->batch-1; i>=0; i--) {
+        mtmq_mag_hdr_t *h = (mtmq_mag_hdr_t*)((char*)c + MAG_CHUNK_SIZE + m->stride * i);
+        h->owner = o;
+        h->next = o->free;
+        o->free = h;
+    }
+}
+
+
+/* Create allocator of payload buffers.
+ * In:
+ *   buf_size - size of each buffer
+ *   batch - number of buffers allocated from heap at once, and number of
+ *     freed buffers sent back to allocating thread at once
+ * Out:
+ *   NULL - create failed
+ *   not NULL - pointer to created allocator
+ * Note:
+ *   Allocator is meant for data of messages allocated by producer and freed
+ *   by consumer of queue (any number of queues may share it). Each thread
+ *   allocates buffers from its own magazine without locking, buffers freed
+ *   by other threads come back to it in batches through return queue.
+ */
+mtmq_mag_t *mtmq_mag_create(int buf_size, int batch)
+{
+    if (buf_size <= 0 || batch <= 0)
+        return NULL;
+
+    mtmq_mag_t *m = calloc(1, sizeof(*m));
+    if (!m)
+        return NULL;
+    m->stride = MAG_HDR_SIZE + MAG_ALIGN((size_t)buf_size);
+    m->batch = batch;
+
+    if (pthread_key_create(&m->key, mag_exit) != 0) {
+        free(m);
+        return NULL;
+    }
+    pthread_mutex_init(&m->mtx, NULL);
+
+    return m;
+}
+
+
+/* Destroy allocator, with all its buffers.
+ * In:
+ *   m - allocator
+ * Out:
+ *   MTMQ_RC_OK - allocator deleted
+ *   MTMQ_RC_ERROR - some error occured
+ * Note:
+ *   No thread may use allocator or its buffers any more.
+ */
+int mtmq_mag_destroy(mtmq_mag_t *m)
+{
+    int ret = MTMQ_RC_OK;
+
+    if (!m)
+        return MTMQ_RC_ERROR;
+
+    // exiting threads must not touch magazines any more
+    if (pthread_key_delete(m->key) != 0)
+        ret = MTMQ_RC_ERROR;
+
+    while (m->owners) {
+        mtmq_mag_owner_t *o = m->owners;
+        m->owners = o->next;
+        if (mtmq_destroy(o->ret) != MTMQ_RC_OK)
+            ret = MTMQ_RC_ERROR;
+        free(o);
+    }
+    while (m->chunks) {
+        mtmq_mag_chunk_t *c = m->chunks;
+        m->chunks = c->next;
+        free(c);
+    }
+
+    if (pthread_mutex_destroy(&m->mtx) != 0)
+        ret = MTMQ_RC_ERROR;
+    free(m);
+
+    return ret;
+}
+
+
+/* Allocate buffer.
+ * In:
+ *   m - allocator
+ * Out:
+ *   NULL - out of memory
+ *   not NULL - buffer of allocator's buf_size, aligned for any type
+ */
+void *mtmq_mag_alloc(mtmq_mag_t *m)
+{
+    if (!m)
+        return NULL;
+
+    mtmq_mag_owner_t *o = mag_self(m);
+    if (!o)
+        return NULL;
+
+    if (!o->free)
+        mag_refill(m, o);
+    mtmq_mag_hdr_t *h = o->free;
+    if (!h)
+        return NULL;
+    o->free = h->next;
+
+    return (char*)h + MAG_HDR_SIZE;
+}
+
+
+/* Free buffer.
+ * In:
+ *   m - allocator
+ *   buf - buffer allocated by mtmq_mag_alloc(m), or NULL
+ * Note:
+ *   Buffer of other thread is kept in batch of calling thread until batch is
+ *   full or next buffer belongs to another thread, see mtmq_mag_flush().
+ */
+void mtmq_mag_free(mtmq_mag_t *m, void *buf)
+{
+    if (!m || !buf)
+        return;
+
+    mtmq_mag_hdr_t *h = (mtmq_mag_hdr_t*)((char*)buf - MAG_HDR_SIZE);
+    mtmq_mag_owner_t *o = mag_self(m);
+
+    if (o == h->owner) {
+        h->next = o->free;
+        o->free = h;
+        return;
+    }
+
+    // calling thread has no magazine to batch buffers in
+    if (!o) {
+        mtmq_push(h->owner->ret, 0, buf, -1);
+        return;
+    }
+
+    if (o->num_out && o->out_owner != h->owner)
+        mag_flush(o);
+    o->out_owner = h->owner;
+    o->out[o->num_out++] = buf;
+    if (o->num_out == m->batch)
+        mag_flush(o);
+}
+
+
+/* Send buffers freed by calling thread back to their threads.
+ * In:
+ *   m - allocator
+ * Out:
+ *   MTMQ_RC_OK - done
+ *   MTMQ_RC_ERROR - some error occured
+ * Note:
+ *   Consumer going idle should call it, so that buffers don't stay in its
+ *   incomplete batch. Batch is also sent when thread exits.
+ */
+int mtmq_mag_flush(mtmq_mag_t *m)
+{
+    if (!m)
+        return MTMQ_RC_ERROR;
+
+    mtmq_mag_owner_t *o = pthread_getspecific(m->key);
+    if (!o)
+        return MTMQ_RC_OK;
+
+    return (mag_flush(o) == MTMQ_RC_OK) ? MTMQ_RC_OK : MTMQ_RC_ERROR;
+}
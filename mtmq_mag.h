@@ -0,0 +1,17 @@
+#ifndef MTMQ_MAG_H_INCLUDED
+#define MTMQ_MAG_H_INCLUDED
+
+#include "mtmq.h"
+
+// Opaque type for payload buffer allocator.
+typedef struct mtmq_mag mtmq_mag_t;
+
+
+mtmq_mag_t *mtmq_mag_create(int buf_size, int batch);
+int mtmq_mag_destroy(mtmq_mag_t *m);
+void *mtmq_mag_alloc(mtmq_mag_t *m);
+void mtmq_mag_free(mtmq_mag_t *m, void *buf);
+int mtmq_mag_flush(mtmq_mag_t *m);
+
+
+#endif
@@ -0,0 +1,230 @@
+/* Pool of per-worker queues with work stealing.
+ *
+ */
+
+
+#include "mtmq_pool.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+
+/* Pool.
+ *
+ * Every worker owns a queue, so workers pushing and popping their own
+ * messages don't contend on single mutex. Worker which has nothing to do
+ * steals half of messages of the first non-empty peer queue, and waits on
+ * all queues at once when there is none.
+ */
+struct mtmq_pool {
+    int workers;  // number of workers (and queues)
+    int flags;  // creation flags
+    atomic_uint next;  // worker to push next message from outside pool to
+    mtmq_t *qs[];  // queue of each worker
+};
+
+
+/* Create pool of worker queues.
+ * In:
+ *   workers - number of workers
+ *   size - size of each worker queue
+ *   flags - combination of MTMQ_POOL_F_* flags
+ *   attr - creation attributes of worker queues (NULL means defaults)
+ * Out:
+ *   NULL - create failed
+ *   not NULL - pointer to created pool
+ * Note:
+ *   Worker queues are consumed by peers too, so MTMQ_F_SPSC is not allowed.
+ *   Idle workers wait on all queues with mtmq_pop_any(), which doesn't take
+ *   sharded queues, so neither are shards.
+ *   With MTMQ_POOL_F_LIFO flag queues must support mtmq_pop_back_n(): mutex
+ *   engine without priority levels, segments and payload slots.
+ */
+mtmq_pool_t *mtmq_pool_create(int workers, int size, int flags, const mtmq_attr_t *attr)
+{
+    if (workers <= 0)
+        return NULL;
+    if (attr && ((attr->flags & MTMQ_F_SPSC) || attr->shards > 1))
+        return NULL;
+    if ((flags & MTMQ_POOL_F_LIFO) && attr && ((attr->flags & (MTMQ_F_MPMC | MTMQ_F_UNBOUNDED))
+            || attr->levels > 1 || attr->payload_size > 0 || attr->max_size > size))
+        return NULL;
+
+    mtmq_pool_t *p = calloc(1, sizeof(*p) + sizeof(p->qs[0]) * workers);
+    if (!p)
+        return NULL;
+    p->workers = workers;
+    p->flags = flags;
+    atomic_init(&p->next, 0);
+
+    for (int i=0; i<workers; i++) {
+        p->qs[i] = mtmq_create_ex(size, attr);
+        if (!p->qs[i]) {
+            mtmq_pool_destroy(p);
+            return NULL;
+        }
+    }
+
+    return p;
+}
+
+
+/* Destroy pool.
+ * In:
+ *   p - pool
+ * Out:
+ *   MTMQ_RC_OK - pool deleted
+ *   MTMQ_RC_ERROR - some error occured
+ */
+int mtmq_pool_destroy(mtmq_pool_t *p)
+{
+    int ret = MTMQ_RC_OK;
+
+    if (!p)
+        return MTMQ_RC_ERROR;
+
+    for (int i=0; i<p->workers; i++) {
+        if (p->qs[i] && mtmq_destroy(p->qs[i]) != MTMQ_RC_OK)
+            ret = MTMQ_RC_ERROR;
+    }
+    free(p);
+
+    return ret;
+}
+
+
+/* Get queue of worker.
+ * In:
+ *   p - pool
+ *   worker - worker index
+ * Out:
+ *   queue, or NULL if worker is out of range
+ */
+mtmq_t *mtmq_pool_queue(mtmq_pool_t *p, int worker)
+{
+    if (!p || worker < 0 || worker >= p->workers)
+        return NULL;
+    return p->qs[worker];
+}
+
+
+/* Push message to pool.
+ * In:
+ *   p - pool
+ *   worker - index of pushing worker, its own queue gets message,
+ *     or -1 to spread messages pushed from outside pool over all workers
+ *   code, data, timeout - same as for mtmq_push()
+ * Out:
+ *   same as for mtmq_push(), MTMQ_RC_ERROR if worker is out of range
+ */
+int mtmq_pool_push(mtmq_pool_t *p, int worker, int code, void *data, int timeout)
+{
+    if (!p || worker < -1 || worker >= p->workers)
+        return MTMQ_RC_ERROR;
+
+    if (worker < 0)
+        worker = (int)(atomic_fetch_add_explicit(&p->next, 1, memory_order_relaxed) % (unsigned)p->workers);
+
+    return mtmq_push(p->qs[worker], code, data, timeout);
+}
+
+
+// Internal helper to pop up to n messages from own queue without waiting.
+static int pool_pop_own(mtmq_pool_t *p, int worker, int *codes, void **datas, int n, int *popped)
+{
+    mtmq_t *q = p->qs[worker];
+
+    if (!(p->flags & MTMQ_POOL_F_LIFO))
+        return mtmq_pop_n(q, codes, datas, n, 0, popped);
+
+    return mtmq_pop_back_n(q, codes, datas, n, 0, popped);
+}
+
+
+// Internal helper to steal up to n messages, at most half of peer's queue.
+static int pool_steal(mtmq_pool_t *p, int worker, int *codes, void **datas, int n, int *popped)
+{
+    for (int i=1; i<p->workers; i++) {
+        mtmq_t *q = p->qs[(worker + i) % p->workers];
+        int num = mtmq_count(q);
+        if (num <= 0)
+            continue;
+        int k = (num + 1) / 2;
+        if (mtmq_pop_n(q, codes, datas, (k < n) ? k : n, 0, popped) == MTMQ_RC_OK)
+            return MTMQ_RC_OK;
+    }
+
+    *popped = 0;
+    return MTMQ_RC_TIMEDOUT;
+}
+
+
+/* Pop several messages from pool on behalf of worker.
+ * In:
+ *   p - pool
+ *   worker - worker index
+ *   codes, datas, n, timeout, popped - same as for mtmq_pop_n()
+ * Out:
+ *   same as for mtmq_pop_n(), MTMQ_RC_ERROR if worker is out of range
+ *   MTMQ_RC_FINALIZED - pool is finalized and all queues are drained
+ * Note:
+ *   Worker pops its own queue first (newest messages first with
+ *   MTMQ_POOL_F_LIFO flag), then steals oldest messages of first non-empty
+ *   peer queue, and only then waits for message on any queue of pool.
+ */
+int mtmq_pool_pop_n(mtmq_pool_t *p, int worker, int *codes, void **datas, int n, int timeout, int *popped)
+{
+    int which;
+
+    *popped = 0;
+    if (!p || worker < 0 || worker >= p->workers || n < 0)
+        return MTMQ_RC_ERROR;
+    if (n == 0)
+        return MTMQ_RC_OK;
+
+    int rc = pool_pop_own(p, worker, codes, datas, n, popped);
+    if (rc == MTMQ_RC_OK)
+        return rc;
+    if (rc != MTMQ_RC_TIMEDOUT && rc != MTMQ_RC_FINALIZED)
+        return rc;
+
+    if (pool_steal(p, worker, codes, datas, n, popped) == MTMQ_RC_OK)
+        return MTMQ_RC_OK;
+
+    rc = mtmq_pop_any(p->qs, p->workers, &which, codes, datas, timeout);
+    if (rc == MTMQ_RC_OK)
+        *popped = 1;
+    return rc;
+}
+
+
+/* Pop message from pool on behalf of worker.
+ * In:
+ *   p - pool
+ *   worker - worker index
+ *   code, data, timeout - same as for mtmq_pop()
+ * Out:
+ *   same as for mtmq_pool_pop_n()
+ */
+int mtmq_pool_pop(mtmq_pool_t *p, int worker, int *code, void **data, int timeout)
+{
+    int popped;
+    return mtmq_pool_pop_n(p, worker, code, data, 1, timeout, &popped);
+}
+
+
+/* Finalize all queues of pool.
+ * In:
+ *   p - pool
+ * Note:
+ *   Workers keep popping (and stealing) messages left in queues until all of
+ *   them are drained, then get MTMQ_RC_FINALIZED.
+ */
+void mtmq_pool_finalize(mtmq_pool_t *p)
+{
+    if (!p)
+        return;
+
+    for (int i=0; i<p->workers; i++)
+        mtmq_finalize(p->qs[i]);
+}
@@ -0,0 +1,24 @@
+#ifndef MTMQ_POOL_H_INCLUDED
+#define MTMQ_POOL_H_INCLUDED
+
+#include "mtmq.h"
+
+// Opaque type for pool of worker queues.
+typedef struct mtmq_pool mtmq_pool_t;
+
+// Pool creation flags.
+enum {
+    MTMQ_POOL_F_LIFO = 0x0001 // owner pops its newest message first
+};
+
+
+mtmq_pool_t *mtmq_pool_create(int workers, int size, int flags, const mtmq_attr_t *attr);
+int mtmq_pool_destroy(mtmq_pool_t *p);
+mtmq_t *mtmq_pool_queue(mtmq_pool_t *p, int worker);
+int mtmq_pool_push(mtmq_pool_t *p, int worker, int code, void *data, int timeout);
+int mtmq_pool_pop(mtmq_pool_t *p, int worker, int *code, void **data, int timeout);
+int mtmq_pool_pop_n(mtmq_pool_t *p, int worker, int *codes, void **datas, int n, int timeout, int *popped);
+void mtmq_pool_finalize(mtmq_pool_t *p);
+
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef MTMQ_TRACE_H_INCLUDED
+#define MTMQ_TRACE_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Trace event types.
+enum {
+    MTMQ_TEV_LOCK = 1, // contended queue mutex acquired, arg - ns spent waiting for it
+    MTMQ_TEV_WAIT, // blocking wait ended, arg - ns blocked, n - 1 for producer, 0 for consumer
+    MTMQ_TEV_WAKE, // blocked side woken up, arg - 1 for producers, 0 for consumers, n - number of wake-ups
+    MTMQ_TEV_ENQ, // n messages enqueued, arg - queue position past the last of them
+    MTMQ_TEV_DEQ, // n messages dequeued, arg - queue position past the last of them
+    MTMQ_TEV_DROP // message dropped by overwriting push, arg - queue position past it
+};
+
+/* Trace record.
+ *
+ * Trace file is MTMQ_TRACE_MAGIC followed by records in host byte order,
+ * each thread's records in order they were made.
+ */
+typedef struct mtmq_trace_rec {
+    uint64_t ns; // monotonic time of event (of start of waiting for LOCK and WAIT)
+    uint64_t queue; // address of queue
+    uint64_t arg; // see event types
+    uint32_t n; // see event types
+    uint16_t type; // one of MTMQ_TEV_* values
+    uint16_t thread; // number of thread, in order of first traced event
+} mtmq_trace_rec_t;
+
+#define MTMQ_TRACE_MAGIC "MTMQTRC1"
+
+
+int mtmq_trace_write(FILE *f);
+
+
+#endif
@@ -0,0 +1,391 @@
+#ifndef MTMQ_TYPED_H_INCLUDED
+#define MTMQ_TYPED_H_INCLUDED
+
+/* Typed queues with compile-time capacity.
+ *
+ * Header-only counterparts of SPSC and MPMC engines for fixed element type,
+ * generated by macros:
+ *
+ *   MTMQ_SPSC_TYPED(name, type, capacity) - single producer / single consumer
+ *   MTMQ_MPMC_TYPED(name, type, capacity) - any number of producers and
+ *     consumers (also for MPSC and SPMC use)
+ *
+ * Each defines queue type name_t and static inline functions:
+ *
+ *   void name_init(name_t *q)
+ *   void name_destroy(name_t *q)
+ *   int name_try_push(name_t *q, const type *v)
+ *   int name_try_pop(name_t *q, type *v)
+ *   int name_push(name_t *q, const type *v, int timeout)
+ *   int name_pop(name_t *q, type *v, int timeout)
+ *   void name_finalize(name_t *q)
+ *   int name_count(name_t *q)
+ *
+ * Push and pop return MTMQ_RC_* codes with the same meaning and timeout
+ * convention as mtmq_push() and mtmq_pop(), try functions never wait and
+ * return MTMQ_RC_TIMEDOUT if queue is full (empty). Elements are copied by
+ * assignment, there are no codes, data pointers or NULL checks, and power of
+ * two capacity is a constant, so the compiler inlines whole fast path.
+ *
+ * Queue is large structure with cache line aligned members, so it should be
+ * defined statically or allocated by aligned_alloc(). Algorithms are those of
+ * mtmq.c: tail counter carries finalized bit, MPMC cells have sequence
+ * counters, and side which has to wait sleeps on condition variable while
+ * the other side wakes it up only if it is registered as waiting.
+ */
+
+#include "mtmq.h"
+
+#include <errno.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+
+#ifndef MTMQ_CACHE_LINE
+#   define MTMQ_CACHE_LINE 128
+#endif
+
+#if defined(_WIN32)
+#   define MTMQ_TQ_CLOCK CLOCK_REALTIME
+#else
+#   define MTMQ_TQ_CLOCK CLOCK_MONOTONIC
+#endif
+
+// Finalized bit of tail counter.
+#define MTMQ_TQ_FIN ((uint64_t)1 << 63)
+
+
+/* Waiting state of typed queue, readers [0] and writers [1].
+ *
+ * Waiter registers itself, reads wake-up epoch of its side and retries
+ * operation without mutex, then sleeps while epoch is unchanged. Waker bumps
+ * epoch under mutex, so wake-up issued after failed retry is never lost.
+ */
+typedef struct mtmq_tq_sync {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond[2];
+    atomic_int waiting[2];  // number of registered waiters
+    atomic_uint epoch[2];  // number of wake-ups
+} mtmq_tq_sync_t;
+
+
+static inline void mtmq_tq_sync_init(mtmq_tq_sync_t *s)
+{
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, MTMQ_TQ_CLOCK);
+    pthread_mutex_init(&s->mtx, NULL);
+    for (int i=0; i<2; i++) {
+        pthread_cond_init(&s->cond[i], &ca);
+        atomic_init(&s->waiting[i], 0);
+        atomic_init(&s->epoch[i], 0);
+    }
+    pthread_condattr_destroy(&ca);
+}
+
+
+static inline void mtmq_tq_sync_destroy(mtmq_tq_sync_t *s)
+{
+    pthread_cond_destroy(&s->cond[0]);
+    pthread_cond_destroy(&s->cond[1]);
+    pthread_mutex_destroy(&s->mtx);
+}
+
+
+/* Wake up side wr after the other side published its change by sequentially
+ * consistent operation, so either it sees waiter registered or waiter sees
+ * the change.
+ */
+static inline void mtmq_tq_wake(mtmq_tq_sync_t *s, int wr)
+{
+    if (atomic_load(&s->waiting[wr]) == 0)
+        return;
+    pthread_mutex_lock(&s->mtx);
+    atomic_fetch_add_explicit(&s->epoch[wr], 1, memory_order_release);
+    pthread_cond_signal(&s->cond[wr]);
+    pthread_mutex_unlock(&s->mtx);
+}
+
+
+// Wake up all waiters of both sides after finalization.
+static inline void mtmq_tq_wake_all(mtmq_tq_sync_t *s)
+{
+    pthread_mutex_lock(&s->mtx);
+    for (int i=0; i<2; i++) {
+        atomic_fetch_add_explicit(&s->epoch[i], 1, memory_order_release);
+        pthread_cond_broadcast(&s->cond[i]);
+    }
+    pthread_mutex_unlock(&s->mtx);
+}
+
+
+// Register waiter of side wr, deadline 'to' is set for timeout > 0.
+static inline void mtmq_tq_wait_begin(mtmq_tq_sync_t *s, int wr, int timeout, struct timespec *to)
+{
+    if (timeout > 0) {
+        clock_gettime(MTMQ_TQ_CLOCK, to);
+        to->tv_sec += timeout / 1000;
+        to->tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (to->tv_nsec >= 1000000000) {
+            to->tv_sec++;
+            to->tv_nsec -= 1000000000;
+        }
+    }
+    atomic_fetch_add(&s->waiting[wr], 1);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+
+/* Block waiter of side wr after its retry failed, until epoch read before
+ * retry changes. Returns 0 to retry again, or ETIMEDOUT for last retry.
+ */
+static inline int mtmq_tq_block(mtmq_tq_sync_t *s, int wr, unsigned int epoch, int timeout, const struct timespec *to)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&s->mtx);
+    while (rc == 0 && atomic_load_explicit(&s->epoch[wr], memory_order_relaxed) == epoch)
+        rc = (timeout < 0) ? pthread_cond_wait(&s->cond[wr], &s->mtx)
+            : pthread_cond_timedwait(&s->cond[wr], &s->mtx, to);
+    pthread_mutex_unlock(&s->mtx);
+
+    return (rc == ETIMEDOUT) ? ETIMEDOUT : 0;
+}
+
+
+static inline void mtmq_tq_wait_end(mtmq_tq_sync_t *s, int wr)
+{
+    atomic_fetch_sub(&s->waiting[wr], 1);
+}
+
+
+// Internal helper macro: blocking push and pop of typed queue built on its try functions.
+#define MTMQ_TQ_BLOCKING(name, type)                                                    \
+static inline int name##_push(name##_t *q, const type *v, int timeout)                  \
+{                                                                                       \
+    struct timespec to;                                                                 \
+    int rc = name##_try_push(q, v);                                                     \
+    if (rc != MTMQ_RC_TIMEDOUT || timeout == 0)                                         \
+        return rc;                                                                      \
+    mtmq_tq_wait_begin(&q->sync, 1, timeout, &to);                                      \
+    for (;;) {                                                                          \
+        unsigned int epoch = atomic_load(&q->sync.epoch[1]);                            \
+        rc = name##_try_push(q, v);                                                     \
+        if (rc != MTMQ_RC_TIMEDOUT)                                                     \
+            break;                                                                      \
+        if (mtmq_tq_block(&q->sync, 1, epoch, timeout, &to) == ETIMEDOUT) {             \
+            rc = name##_try_push(q, v);                                                 \
+            break;                                                                      \
+        }                                                                               \
+    }                                                                                   \
+    mtmq_tq_wait_end(&q->sync, 1);                                                      \
+    return rc;                                                                          \
+}                                                                                       \
+                                                                                        \
+static inline int name##_pop(name##_t *q, type *v, int timeout)                         \
+{                                                                                       \
+    struct timespec to;                                                                 \
+    int rc = name##_try_pop(q, v);                                                      \
+    if (rc != MTMQ_RC_TIMEDOUT || timeout == 0)                                         \
+        return rc;                                                                      \
+    mtmq_tq_wait_begin(&q->sync, 0, timeout, &to);                                      \
+    for (;;) {                                                                          \
+        unsigned int epoch = atomic_load(&q->sync.epoch[0]);                            \
+        rc = name##_try_pop(q, v);                                                      \
+        if (rc != MTMQ_RC_TIMEDOUT)                                                     \
+            break;                                                                      \
+        if (mtmq_tq_block(&q->sync, 0, epoch, timeout, &to) == ETIMEDOUT) {             \
+            rc = name##_try_pop(q, v);                                                  \
+            break;                                                                      \
+        }                                                                               \
+    }                                                                                   \
+    mtmq_tq_wait_end(&q->sync, 0);                                                      \
+    return rc;                                                                          \
+}                                                                                       \
+                                                                                        \
+static inline void name##_finalize(name##_t *q)                                         \
+{                                                                                       \
+    atomic_fetch_or(&q->tail, MTMQ_TQ_FIN);                                             \
+    mtmq_tq_wake_all(&q->sync);                                                         \
+}                                                                                       \
+                                                                                        \
+static inline int name##_count(name##_t *q)                                             \
+{                                                                                       \
+    uint64_t head = atomic_load(&q->head);                                              \
+    uint64_t num = (atomic_load(&q->tail) & ~MTMQ_TQ_FIN) - head;                       \
+    return (num > (name##_cap)) ? (int)(name##_cap) : (int)num;                         \
+}
+
+
+/* Single producer / single consumer typed queue.
+ *
+ * Each side keeps cached copy of the other side's counter and reads shared
+ * line only when cache says queue is full (empty).
+ */
+#define MTMQ_SPSC_TYPED(name, type, capacity)                                           \
+_Static_assert((capacity) > 0 && ((capacity) & ((capacity)-1)) == 0,                    \
+    #name ": capacity must be power of two");                                           \
+                                                                                        \
+enum { name##_cap = (capacity) };                                                       \
+                                                                                        \
+typedef struct name {                                                                   \
+    alignas(MTMQ_CACHE_LINE)                                                            \
+    _Atomic uint64_t tail;                                                              \
+    uint64_t head_cache;                                                                \
+    alignas(MTMQ_CACHE_LINE)                                                            \
+    _Atomic uint64_t head;                                                              \
+    uint64_t tail_cache;                                                                \
+    alignas(MTMQ_CACHE_LINE)                                                            \
+    mtmq_tq_sync_t sync;                                                                \
+    alignas(MTMQ_CACHE_LINE)                                                            \
+    type buf[capacity];                                                                 \
+} name##_t;                                                                             \
+                                                                                        \
+static inline void name##_init(name##_t *q)                                             \
+{                                                                                       \
+    atomic_init(&q->tail, 0);                                                           \
+    atomic_init(&q->head, 0);                                                           \
+    q->head_cache = 0;                                                                  \
+    q->tail_cache = 0;                                                                  \
+    mtmq_tq_sync_init(&q->sync);                                                        \
+}                                                                                       \
+                                                                                        \
+static inline void name##_destroy(name##_t *q)                                          \
+{                                                                                       \
+    mtmq_tq_sync_destroy(&q->sync);                                                     \
+}                                                                                       \
+                                                                                        \
+static inline int name##_try_push(name##_t *q, const type *v)                           \
+{                                                                                       \
+    uint64_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);               \
+    if (tail & MTMQ_TQ_FIN)                                                             \
+        return MTMQ_RC_FINALIZED;                                                       \
+    if (tail - q->head_cache >= (capacity)) {                                           \
+        q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);           \
+        if (tail - q->head_cache >= (capacity))                                         \
+            return MTMQ_RC_TIMEDOUT;                                                    \
+    }                                                                                   \
+    q->buf[tail & ((capacity)-1)] = *v;                                                 \
+    /* only finalization can change tail under our feet */                              \
+    if (!atomic_compare_exchange_strong(&q->tail, &tail, tail+1))                       \
+        return MTMQ_RC_FINALIZED;                                                       \
+    mtmq_tq_wake(&q->sync, 0);                                                          \
+    return MTMQ_RC_OK;                                                                  \
+}                                                                                       \
+                                                                                        \
+static inline int name##_try_pop(name##_t *q, type *v)                                  \
+{                                                                                       \
+    uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);               \
+    if (head == q->tail_cache) {                                                        \
+        uint64_t tail = atomic_load(&q->tail);                                          \
+        q->tail_cache = tail & ~MTMQ_TQ_FIN;                                            \
+        if (head == q->tail_cache)                                                      \
+            return (tail & MTMQ_TQ_FIN) ? MTMQ_RC_FINALIZED : MTMQ_RC_TIMEDOUT;         \
+    }                                                                                   \
+    *v = q->buf[head & ((capacity)-1)];                                                 \
+    atomic_store(&q->head, head+1);                                                     \
+    mtmq_tq_wake(&q->sync, 1);                                                          \
+    return MTMQ_RC_OK;                                                                  \
+}                                                                                       \
+                                                                                        \
+MTMQ_TQ_BLOCKING(name, type)
+
+
+/* Multiple producers / multiple consumers typed queue.
+ *
+ * Sequence counter of cell tells which lap of the ring it belongs to:
+ *   seq == pos - cell is free for producer claiming position pos
+ *   seq == pos + 1 - cell holds element pushed at position pos
+ * Consumer releases cell by setting seq = pos + capacity.
+ */
+#define MTMQ_MPMC_TYPED(name, type, capacity)                                           \
+_Static_assert((capacity) > 1 && ((capacity) & ((capacity)-1)) == 0,                    \
+    #name ": capacity must be power of two, at least 2");                               \
+                                                                                        \
+enum { name##_cap = (capacity) };                                                       \
+                                                                                        \
+typedef struct name {                                                                   \
+    alignas(MTMQ_CACHE_LINE)                                                            \
+    _Atomic uint64_t tail;                                                              \
+    alignas(MTMQ_CACHE_LINE)                                                            \
+    _Atomic uint64_t head;                                                              \
+    alignas(MTMQ_CACHE_LINE)                                                            \
+    mtmq_tq_sync_t sync;                                                                \
+    alignas(MTMQ_CACHE_LINE)                                                            \
+    struct {                                                                            \
+        _Atomic uint64_t seq;                                                           \
+        type val;                                                                       \
+    } cells[capacity];                                                                  \
+} name##_t;                                                                             \
+                                                                                        \
+static inline void name##_init(name##_t *q)                                             \
+{                                                                                       \
+    atomic_init(&q->tail, 0);                                                           \
+    atomic_init(&q->head, 0);                                                           \
+    for (uint64_t i=0; i<(capacity); i++)                                               \
+        atomic_init(&q->cells[i].seq, i);                                               \
+    mtmq_tq_sync_init(&q->sync);                                                        \
+}                                                                                       \
+                                                                                        \
+static inline void name##_destroy(name##_t *q)                                          \
+{                                                                                       \
+    mtmq_tq_sync_destroy(&q->sync);                                                     \
+}                                                                                       \
+                                                                                        \
+static inline int name##_try_push(name##_t *q, const type *v)                           \
+{                                                                                       \
+    uint64_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);                \
+    for (;;) {                                                                          \
+        if (pos & MTMQ_TQ_FIN)                                                          \
+            return MTMQ_RC_FINALIZED;                                                   \
+        uint64_t seq = atomic_load_explicit(&q->cells[pos & ((capacity)-1)].seq,        \
+            memory_order_acquire);                                                      \
+        int64_t dif = (int64_t)(seq - pos);                                             \
+        if (dif == 0) {                                                                 \
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos+1,            \
+                    memory_order_relaxed, memory_order_relaxed))                        \
+                break;                                                                  \
+        } else if (dif < 0)                                                             \
+            return MTMQ_RC_TIMEDOUT;                                                    \
+        else                                                                            \
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);                 \
+    }                                                                                   \
+    q->cells[pos & ((capacity)-1)].val = *v;                                            \
+    atomic_store(&q->cells[pos & ((capacity)-1)].seq, pos+1);                           \
+    mtmq_tq_wake(&q->sync, 0);                                                          \
+    return MTMQ_RC_OK;                                                                  \
+}                                                                                       \
+                                                                                        \
+static inline int name##_try_pop(name##_t *q, type *v)                                  \
+{                                                                                       \
+    uint64_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);                \
+    for (;;) {                                                                          \
+        uint64_t seq = atomic_load_explicit(&q->cells[pos & ((capacity)-1)].seq,        \
+            memory_order_acquire);                                                      \
+        int64_t dif = (int64_t)(seq - (pos+1));                                         \
+        if (dif == 0) {                                                                 \
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos+1,            \
+                    memory_order_relaxed, memory_order_relaxed))                        \
+                break;                                                                  \
+        } else if (dif < 0) {                                                           \
+            /* empty, or producer claimed cell but not yet stored element */            \
+            uint64_t tail = atomic_load(&q->tail);                                      \
+            if ((tail & MTMQ_TQ_FIN) && (tail & ~MTMQ_TQ_FIN) == pos)                   \
+                return MTMQ_RC_FINALIZED;                                               \
+            return MTMQ_RC_TIMEDOUT;                                                    \
+        } else                                                                          \
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);                 \
+    }                                                                                   \
+    *v = q->cells[pos & ((capacity)-1)].val;                                            \
+    atomic_store(&q->cells[pos & ((capacity)-1)].seq, pos + (capacity));                \
+    mtmq_tq_wake(&q->sync, 1);                                                          \
+    return MTMQ_RC_OK;                                                                  \
+}                                                                                       \
+                                                                                        \
+MTMQ_TQ_BLOCKING(name, type)
+
+
+#endif
@@ -1,8 +1,20 @@
 #include "mtmq.h"
+#include "mtmq_bcast.h"
+#include "mtmq_mag.h"
+#include "mtmq_pool.h"
+#include "mtmq_trace.h"
+#include "mtmq_typed.h"
 
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
 #include <signal.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 
@@ -18,10 +30,15 @@ void sig_handler(int n) {
 
 static void *thread_wr(void *data);
 static void *thread_rd(void *data);
+static int run_tests(int argc, char **argv);
 
 
-int main()
+// With "test" argument runs behavior tests (all or named ones) instead of demo.
+int main(int argc, char **argv)
 {
+    if (argc > 1 && !strcmp(argv[1], "test"))
+        return run_tests(argc - 2, argv + 2);
+
 #ifdef _WIN32
     signal(SIGINT, sig_handler);
 #else
@@ -119,3 +136,2529 @@ static void *thread_rd(void *data)
 
     return NULL;
 }
+
+
+/* Behavior tests.
+ *
+ * Each test returns 0 on success, or prints failed check and returns 1.
+ * Queues of failed test are leaked, as the process exits anyway.
+ */
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return 1; \
+        } \
+    } while (0)
+
+
+// Internal helper to create queue with given flags.
+static mtmq_t *test_create(int size, int flags)
+{
+    mtmq_attr_t attr;
+    mtmq_attr_init(&attr);
+    attr.flags = flags;
+    return mtmq_create_ex(size, &attr);
+}
+
+
+/* Internal helper: fill empty queue of given capacity, check that full
+ * queue times out, then pop everything back in order and check that empty
+ * queue times out.
+ */
+static int test_fifo(mtmq_t *q, int size)
+{
+    int code;
+    void *data;
+
+    for (int i=0; i<size; i++)
+        CHECK(mtmq_push(q, i, (void*)(long)(i + 1), 0) == MTMQ_RC_OK);
+    CHECK(mtmq_count(q) == size);
+    CHECK(mtmq_push(q, size, NULL, 0) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_push(q, size, NULL, 10) == MTMQ_RC_TIMEDOUT);
+
+    for (int i=0; i<size; i++) {
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK);
+        CHECK(code == i && data == (void*)(long)(i + 1));
+    }
+    CHECK(mtmq_count(q) == 0);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_pop(q, &code, &data, 10) == MTMQ_RC_TIMEDOUT);
+
+    return 0;
+}
+
+
+// Operation blocked in helper thread.
+typedef struct test_blocked {
+    mtmq_t *q;
+    int wr;  // 1 - push, 0 - pop
+    int rc;  // result of operation
+    pthread_t tid;
+} test_blocked_t;
+
+
+static void *test_blocked_run(void *arg)
+{
+    test_blocked_t *b = arg;
+    int code;
+    void *data;
+
+    if (b->wr)
+        b->rc = mtmq_push(b->q, 0, NULL, -1);
+    else
+        b->rc = mtmq_pop(b->q, &code, &data, -1);
+    return NULL;
+}
+
+
+/* Internal helper: check that finalize wakes up consumer blocked on empty
+ * queue (wr == 0), or producer blocked on full one (wr == 1), waiting
+ * indefinately. Queue is finalized by it.
+ */
+static int test_fin_wakes(mtmq_t *q, int wr)
+{
+    test_blocked_t b = { .q = q, .wr = wr, .rc = -1 };
+
+    CHECK(pthread_create(&b.tid, NULL, test_blocked_run, &b) == 0);
+    usleep(50000);
+    mtmq_finalize(q);
+    CHECK(pthread_join(b.tid, NULL) == 0);
+    CHECK(b.rc == MTMQ_RC_FINALIZED);
+
+    return 0;
+}
+
+
+// Stream of messages from producer to consumer thread.
+typedef struct test_stream {
+    mtmq_t *q;
+    int n;  // number of messages
+    int bad;  // messages out of order
+} test_stream_t;
+
+
+static void *test_stream_wr(void *arg)
+{
+    test_stream_t *s = arg;
+
+    for (int i=0; i<s->n; i++) {
+        if (mtmq_push(s->q, i, NULL, -1) != MTMQ_RC_OK)
+            s->bad++;
+    }
+    return NULL;
+}
+
+
+// Internal helper: stream n messages through queue and check their order.
+static int test_stream(mtmq_t *q, int n)
+{
+    test_stream_t s = { .q = q, .n = n };
+    pthread_t tid;
+    int code;
+    void *data;
+
+    CHECK(pthread_create(&tid, NULL, test_stream_wr, &s) == 0);
+    for (int i=0; i<n; i++) {
+        CHECK(mtmq_pop(q, &code, &data, -1) == MTMQ_RC_OK);
+        if (code != i)
+            s.bad++;
+    }
+    CHECK(pthread_join(tid, NULL) == 0);
+    CHECK(s.bad == 0);
+
+    return 0;
+}
+
+
+static int test_spsc(void)
+{
+    mtmq_t *q = test_create(8, MTMQ_F_SPSC);
+    CHECK(q);
+    CHECK(test_fifo(q, 8) == 0);
+    // counters wrap around ring
+    CHECK(test_fifo(q, 8) == 0);
+    CHECK(test_stream(q, 100000) == 0);
+    CHECK(test_fin_wakes(q, 0) == 0);
+    CHECK(mtmq_push(q, 0, NULL, 0) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    q = test_create(2, MTMQ_F_SPSC);
+    CHECK(q);
+    CHECK(mtmq_push(q, 1, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_push(q, 2, NULL, 0) == MTMQ_RC_OK);
+    CHECK(test_fin_wakes(q, 1) == 0);
+    // messages left are still delivered
+    int code;
+    void *data;
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 1);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 2);
+    CHECK(mtmq_pop(q, &code, &data, -1) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    CHECK(!test_create(8, MTMQ_F_SPSC | MTMQ_F_MPMC));
+    CHECK(!test_create(0, MTMQ_F_SPSC));
+
+    return 0;
+}
+
+
+// Producers and consumers sharing queue.
+typedef struct test_crowd {
+    mtmq_t *q;
+    int n;  // messages per producer
+    pthread_mutex_t mtx;
+    long sum;  // sum of codes popped by consumers
+    long num;  // number of messages popped by consumers
+    int bad;  // failed operations
+} test_crowd_t;
+
+
+static void *test_crowd_wr(void *arg)
+{
+    test_crowd_t *c = arg;
+    int bad = 0;
+
+    for (int i=1; i<=c->n; i++) {
+        if (mtmq_push(c->q, i, NULL, -1) != MTMQ_RC_OK)
+            bad++;
+    }
+    pthread_mutex_lock(&c->mtx);
+    c->bad += bad;
+    pthread_mutex_unlock(&c->mtx);
+    return NULL;
+}
+
+
+static void *test_crowd_rd(void *arg)
+{
+    test_crowd_t *c = arg;
+    long sum = 0, num = 0;
+    int code, rc;
+    void *data;
+
+    while ((rc = mtmq_pop(c->q, &code, &data, -1)) == MTMQ_RC_OK) {
+        sum += code;
+        num++;
+    }
+    pthread_mutex_lock(&c->mtx);
+    c->sum += sum;
+    c->num += num;
+    c->bad += (rc != MTMQ_RC_FINALIZED);
+    pthread_mutex_unlock(&c->mtx);
+    return NULL;
+}
+
+
+/* Internal helper: np producers push n messages each, nc consumers pop them
+ * until queue, finalized once producers are done, is drained. Checks that
+ * every message is popped exactly once.
+ */
+static int test_crowd(mtmq_t *q, int np, int nc, int n)
+{
+    test_crowd_t c = { .q = q, .n = n };
+    pthread_t wr[8], rd[8];
+
+    pthread_mutex_init(&c.mtx, NULL);
+    for (int i=0; i<nc; i++)
+        CHECK(pthread_create(&rd[i], NULL, test_crowd_rd, &c) == 0);
+    for (int i=0; i<np; i++)
+        CHECK(pthread_create(&wr[i], NULL, test_crowd_wr, &c) == 0);
+    for (int i=0; i<np; i++)
+        CHECK(pthread_join(wr[i], NULL) == 0);
+    mtmq_finalize(q);
+    for (int i=0; i<nc; i++)
+        CHECK(pthread_join(rd[i], NULL) == 0);
+    pthread_mutex_destroy(&c.mtx);
+
+    CHECK(c.bad == 0);
+    CHECK(c.num == (long)np * n);
+    CHECK(c.sum == (long)np * n * (n + 1) / 2);
+
+    return 0;
+}
+
+
+static int test_mpmc(void)
+{
+    mtmq_t *q = test_create(8, MTMQ_F_MPMC);
+    CHECK(q);
+    CHECK(test_fifo(q, 8) == 0);
+    CHECK(test_fifo(q, 8) == 0);
+    CHECK(test_stream(q, 100000) == 0);
+    CHECK(test_fin_wakes(q, 0) == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    q = test_create(2, MTMQ_F_MPMC);
+    CHECK(q);
+    CHECK(mtmq_push(q, 1, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_push(q, 2, NULL, 0) == MTMQ_RC_OK);
+    CHECK(test_fin_wakes(q, 1) == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    q = test_create(16, MTMQ_F_MPMC);
+    CHECK(q);
+    CHECK(test_crowd(q, 4, 4, 50000) == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    // payload slot of popped message can't be committed again
+    mtmq_attr_t attr;
+    mtmq_attr_init(&attr);
+    attr.flags = MTMQ_F_MPMC;
+    attr.payload_size = 16;
+    q = mtmq_create_ex(4, &attr);
+    CHECK(q);
+    void *buf, *data;
+    int code;
+    CHECK(mtmq_reserve(q, &buf, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_commit(q, buf, 1) == MTMQ_RC_OK);
+    CHECK(mtmq_commit(q, buf, 1) == MTMQ_RC_ERROR);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 1 && data == buf);
+    CHECK(mtmq_commit(q, buf, 2) == MTMQ_RC_ERROR);
+    CHECK(mtmq_count(q) == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    return 0;
+}
+
+
+static void *test_batch_wr(void *arg)
+{
+    test_stream_t *s = arg;
+    int codes[7];
+    void *datas[7] = {0};
+
+    for (int i=0; i<s->n; ) {
+        int n = (s->n - i < 7) ? s->n - i : 7, k;
+        for (int j=0; j<n; j++)
+            codes[j] = i + j;
+        if (mtmq_push_n(s->q, codes, datas, n, -1, &k) != MTMQ_RC_OK || k <= 0) {
+            s->bad++;
+            break;
+        }
+        i += k;
+    }
+    return NULL;
+}
+
+
+static int test_batch_one(int flags)
+{
+    int codes[16], k;
+    void *datas[16] = {0};
+    mtmq_t *q = test_create(8, flags);
+    CHECK(q);
+
+    for (int i=0; i<16; i++)
+        codes[i] = i;
+    CHECK(mtmq_push_n(q, codes, datas, 5, 0, &k) == MTMQ_RC_OK && k == 5);
+    // only as many as fit
+    CHECK(mtmq_push_n(q, codes + 5, datas, 5, 0, &k) == MTMQ_RC_OK && k == 3);
+    CHECK(mtmq_push_n(q, codes, datas, 1, 10, &k) == MTMQ_RC_TIMEDOUT && k == 0);
+    CHECK(mtmq_push_n(q, codes, datas, 0, 0, &k) == MTMQ_RC_OK && k == 0);
+    CHECK(mtmq_push_n(q, codes, datas, -1, 0, &k) == MTMQ_RC_ERROR);
+
+    CHECK(mtmq_pop_n(q, codes, datas, 3, 0, &k) == MTMQ_RC_OK && k == 3);
+    CHECK(codes[0] == 0 && codes[1] == 1 && codes[2] == 2);
+    CHECK(mtmq_pop_n(q, codes, datas, 16, 0, &k) == MTMQ_RC_OK && k == 5);
+    for (int i=0; i<5; i++)
+        CHECK(codes[i] == i + 3);
+    CHECK(mtmq_pop_n(q, codes, datas, 16, 10, &k) == MTMQ_RC_TIMEDOUT && k == 0);
+    CHECK(mtmq_pop_n(q, codes, datas, -1, 0, &k) == MTMQ_RC_ERROR);
+
+    // blocked sides wake up for partial batches
+    test_stream_t s = { .q = q, .n = 100000 };
+    pthread_t tid;
+    CHECK(pthread_create(&tid, NULL, test_batch_wr, &s) == 0);
+    for (int i=0; i<s.n; ) {
+        CHECK(mtmq_pop_n(q, codes, datas, 5, -1, &k) == MTMQ_RC_OK && k > 0 && k <= 5);
+        for (int j=0; j<k; j++)
+            s.bad += (codes[j] != i + j);
+        i += k;
+    }
+    CHECK(pthread_join(tid, NULL) == 0);
+    CHECK(s.bad == 0);
+
+    CHECK(mtmq_push_n(q, codes, datas, 2, 0, &k) == MTMQ_RC_OK && k == 2);
+    mtmq_finalize(q);
+    CHECK(mtmq_push_n(q, codes, datas, 2, 0, &k) == MTMQ_RC_FINALIZED && k == 0);
+    CHECK(mtmq_pop_n(q, codes, datas, 16, -1, &k) == MTMQ_RC_OK && k == 2);
+    CHECK(mtmq_pop_n(q, codes, datas, 16, -1, &k) == MTMQ_RC_FINALIZED && k == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    return 0;
+}
+
+
+static int test_batch(void)
+{
+    CHECK(test_batch_one(0) == 0);
+    CHECK(test_batch_one(MTMQ_F_SPSC) == 0);
+    CHECK(test_batch_one(MTMQ_F_MPMC) == 0);
+    return 0;
+}
+
+
+// Internal helper: monotonic time in milliseconds.
+static long test_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+
+static int test_spin(void)
+{
+    int flags[] = {0, MTMQ_F_SPSC, MTMQ_F_MPMC};
+
+    for (int i=0; i<3; i++) {
+        mtmq_attr_t attr;
+        mtmq_attr_init(&attr);
+        attr.flags = flags[i];
+        attr.spin_ns = 50000;
+        mtmq_t *q = mtmq_create_ex(4, &attr);
+        CHECK(q);
+        CHECK(test_fifo(q, 4) == 0);
+        CHECK(test_stream(q, 100000) == 0);
+
+        // spinning does not stretch or cut timeout
+        int code;
+        void *data;
+        long start = test_now_ms();
+        CHECK(mtmq_pop(q, &code, &data, 30) == MTMQ_RC_TIMEDOUT);
+        long took = test_now_ms() - start;
+        CHECK(took >= 29 && took < 1000);
+
+        CHECK(test_fin_wakes(q, 0) == 0);
+        CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+    }
+
+    return 0;
+}
+
+
+/* Test of queue memory layout: with odd sizes and payload sizes, state of
+ * both sides and payload slots must not overlap, and slots are aligned for
+ * any type.
+ */
+static int test_layout(void)
+{
+    int flags[] = {0, MTMQ_F_SPSC, MTMQ_F_MPMC};
+    int sizes[] = {1, 3, 7};
+
+    for (int i=0; i<3; i++)
+    for (int j=0; j<3; j++) {
+        mtmq_t *q = test_create(sizes[j], flags[i]);
+        CHECK(q);
+        CHECK(test_fifo(q, sizes[j]) == 0);
+        CHECK(test_stream(q, 20000) == 0);
+        CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+        mtmq_attr_t attr;
+        mtmq_attr_init(&attr);
+        attr.flags = flags[i];
+        attr.payload_size = 13;
+        q = mtmq_create_ex(sizes[j], &attr);
+        CHECK(q);
+        for (int k=0; k<sizes[j]; k++) {
+            void *buf;
+            CHECK(mtmq_reserve(q, &buf, 0) == MTMQ_RC_OK);
+            CHECK((uintptr_t)buf % alignof(max_align_t) == 0);
+            memset(buf, 'a' + k, 13);
+            CHECK(mtmq_commit(q, buf, k) == MTMQ_RC_OK);
+        }
+        for (int k=0; k<sizes[j]; k++) {
+            int code;
+            void *data;
+            CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == k);
+            for (int b=0; b<13; b++)
+                CHECK(((char*)data)[b] == 'a' + k);
+        }
+        CHECK(mtmq_count(q) == 0);
+        CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+    }
+
+    return 0;
+}
+
+
+static int test_reserve_one(int flags)
+{
+    mtmq_attr_t attr;
+    void *buf, *buf2, *data;
+    int code;
+
+    mtmq_t *q = test_create(4, flags);
+    CHECK(q);
+    CHECK(mtmq_reserve(q, &buf, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_peek(q, &code, &buf, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    mtmq_attr_init(&attr);
+    attr.flags = flags;
+    attr.payload_size = sizeof(int);
+    q = mtmq_create_ex(2, &attr);
+    CHECK(q);
+
+    CHECK(mtmq_reserve(q, &buf, 0) == MTMQ_RC_OK);
+    *(int*)buf = 42;
+    CHECK(mtmq_commit(q, (char*)buf + 1, 1) == MTMQ_RC_ERROR);
+    CHECK(mtmq_commit(q, buf, 1) == MTMQ_RC_OK);
+    CHECK(mtmq_commit(q, buf, 1) == MTMQ_RC_ERROR);
+    CHECK(mtmq_push(q, 2, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_reserve(q, &buf2, 10) == MTMQ_RC_TIMEDOUT);
+
+    // peeked message stays in queue until released
+    CHECK(mtmq_peek(q, &code, &data, 0) == MTMQ_RC_OK);
+    CHECK(code == 1 && data == buf && *(int*)data == 42);
+    // MPMC consumer claims peeked message
+    CHECK(mtmq_count(q) == ((flags & MTMQ_F_MPMC) ? 1 : 2));
+    CHECK(mtmq_release(q, (char*)data + 1) == MTMQ_RC_ERROR);
+    CHECK(mtmq_release(q, data) == MTMQ_RC_OK);
+    CHECK(mtmq_release(q, data) == MTMQ_RC_ERROR);
+    CHECK(mtmq_count(q) == 1);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 2);
+
+    if (flags & MTMQ_F_MPMC) {
+        // reservations are committed in any order, consumed in order of reserving
+        CHECK(mtmq_reserve(q, &buf, 0) == MTMQ_RC_OK);
+        CHECK(mtmq_reserve(q, &buf2, 0) == MTMQ_RC_OK);
+        CHECK(mtmq_commit(q, buf2, 4) == MTMQ_RC_OK);
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_TIMEDOUT);
+        CHECK(mtmq_commit(q, buf, 3) == MTMQ_RC_OK);
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 3 && data == buf);
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 4 && data == buf2);
+    } else {
+        // single outstanding reservation, which the only SPSC producer can't wait for
+        CHECK(mtmq_reserve(q, &buf, 0) == MTMQ_RC_OK);
+        CHECK(mtmq_reserve(q, &buf2, 10) == ((flags & MTMQ_F_SPSC) ? MTMQ_RC_ERROR : MTMQ_RC_TIMEDOUT));
+        CHECK(mtmq_commit(q, buf, 3) == MTMQ_RC_OK);
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 3);
+    }
+
+    // reservation made before finalization is delivered
+    CHECK(mtmq_reserve(q, &buf, 0) == MTMQ_RC_OK);
+    mtmq_finalize(q);
+    CHECK(mtmq_commit(q, buf, 5) == MTMQ_RC_OK);
+    CHECK(mtmq_reserve(q, &buf2, 0) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 5 && data == buf);
+    CHECK(mtmq_peek(q, &code, &data, -1) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    return 0;
+}
+
+
+static int test_reserve(void)
+{
+    CHECK(test_reserve_one(0) == 0);
+    CHECK(test_reserve_one(MTMQ_F_SPSC) == 0);
+    CHECK(test_reserve_one(MTMQ_F_MPMC) == 0);
+    return 0;
+}
+
+
+/* Test of power-of-two capacity: size is rounded up, ring indices wrap by
+ * mask with all engines, and too large size is rejected.
+ */
+static int test_pow2(void)
+{
+    int flags[] = {0, MTMQ_F_SPSC, MTMQ_F_MPMC};
+
+    for (int i=0; i<3; i++) {
+        mtmq_t *q = test_create(5, flags[i] | MTMQ_F_POW2);
+        CHECK(q);
+        // counters run past size many times
+        for (int k=0; k<5; k++)
+            CHECK(test_fifo(q, 8) == 0);
+        CHECK(test_stream(q, 50000) == 0);
+#ifndef MTMQ_NO_STATS
+        mtmq_stats_t st;
+        CHECK(mtmq_get_stats(q, &st) == MTMQ_RC_OK && st.size == 8);
+#endif
+        CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+        q = test_create(4, flags[i] | MTMQ_F_POW2);
+        CHECK(q);
+        CHECK(test_fifo(q, 4) == 0);
+        CHECK(test_fin_wakes(q, 0) == 0);
+        CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+        CHECK(!test_create((1 << 30) + 1, flags[i] | MTMQ_F_POW2));
+    }
+
+    return 0;
+}
+
+
+// Internal helper: sum of histogram buckets.
+#ifndef MTMQ_NO_STATS
+static uint64_t test_hist_sum(const uint64_t *hist)
+{
+    uint64_t sum = 0;
+    for (int j=0; j<MTMQ_STATS_HIST; j++)
+        sum += hist[j];
+    return sum;
+}
+#endif
+
+
+/* Test of queue statistics: message counters, high-water mark, blocking
+ * waits and timeouts of both sides for all engines.
+ */
+static int test_stats_one(int flags)
+{
+    mtmq_stats_t st;
+
+    mtmq_t *q = test_create(4, flags);
+    CHECK(q);
+#ifdef MTMQ_NO_STATS
+    CHECK(mtmq_get_stats(q, &st) == MTMQ_RC_ERROR);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+    return 0;
+#else
+    int code;
+    void *data;
+
+    CHECK(mtmq_get_stats(q, NULL) == MTMQ_RC_ERROR);
+    CHECK(mtmq_get_stats(NULL, &st) == MTMQ_RC_ERROR);
+    CHECK(mtmq_get_stats(q, &st) == MTMQ_RC_OK);
+    CHECK(st.size == 4 && st.num == 0 && st.max_num == 0);
+    CHECK(st.pushes == 0 && st.pops == 0 && st.rd_waits == 0 && st.wr_waits == 0);
+
+    for (int i=0; i<3; i++)
+        CHECK(mtmq_push(q, i, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_get_stats(q, &st) == MTMQ_RC_OK);
+    CHECK(st.num == 2 && st.max_num == 3 && st.pushes == 3 && st.pops == 1);
+
+    CHECK(mtmq_push(q, 3, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_push(q, 4, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_push(q, 5, NULL, 20) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_get_stats(q, &st) == MTMQ_RC_OK);
+    CHECK(st.num == 4 && st.max_num == 4 && st.pushes == 5);
+    // attempt with zero timeout is not a wait
+    CHECK(st.wr_waits == 1 && st.wr_timeouts == 1 && st.wr_wait_ns >= 10000000);
+    CHECK(test_hist_sum(st.wr_hist) == 1 && st.rd_waits == 0);
+
+    for (int i=0; i<4; i++)
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_pop(q, &code, &data, 20) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_get_stats(q, &st) == MTMQ_RC_OK);
+    CHECK(st.num == 0 && st.max_num == 4 && st.pops == 5);
+    CHECK(st.rd_waits == 1 && st.rd_timeouts == 1 && st.rd_wait_ns >= 10000000);
+    CHECK(test_hist_sum(st.rd_hist) == 1);
+
+    // wait ended by finalization is not timeout
+    CHECK(test_fin_wakes(q, 0) == 0);
+    CHECK(mtmq_get_stats(q, &st) == MTMQ_RC_OK);
+    CHECK(st.rd_waits == 2 && st.rd_timeouts == 1 && test_hist_sum(st.rd_hist) == 2);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    return 0;
+#endif
+}
+
+
+static int test_stats(void)
+{
+    CHECK(test_stats_one(0) == 0);
+    CHECK(test_stats_one(MTMQ_F_SPSC) == 0);
+    CHECK(test_stats_one(MTMQ_F_MPMC) == 0);
+    return 0;
+}
+
+
+// Internal helper: check whether descriptor is readable within timeout.
+static int test_readable(int fd, int timeout)
+{
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    return poll(&p, 1, timeout) == 1 && (p.revents & POLLIN);
+}
+
+
+/* Test of pollable descriptor: readable while queue has messages or is
+ * finalized, reset by popping queue empty, for all engines.
+ */
+static int test_fd_one(int flags)
+{
+    int code;
+    void *data;
+
+    mtmq_t *q = test_create(4, flags);
+    CHECK(q);
+    CHECK(mtmq_get_fd(NULL) == -1);
+    int fd = mtmq_get_fd(q);
+    CHECK(fd >= 0);
+    CHECK(mtmq_get_fd(q) == fd);
+    CHECK(!test_readable(fd, 0));
+
+    CHECK(mtmq_push(q, 1, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_push(q, 2, NULL, 0) == MTMQ_RC_OK);
+    CHECK(test_readable(fd, 0));
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 1);
+    CHECK(test_readable(fd, 0));
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 2);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_TIMEDOUT);
+    CHECK(!test_readable(fd, 0));
+
+    // push from another thread wakes poll
+    test_blocked_t b = { .q = q, .wr = 1, .rc = -1 };
+    CHECK(pthread_create(&b.tid, NULL, test_blocked_run, &b) == 0);
+    CHECK(test_readable(fd, 5000));
+    CHECK(pthread_join(b.tid, NULL) == 0 && b.rc == MTMQ_RC_OK);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_TIMEDOUT);
+    CHECK(!test_readable(fd, 0));
+
+    mtmq_finalize(q);
+    CHECK(test_readable(fd, 0));
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_FINALIZED);
+    CHECK(test_readable(fd, 0));
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    return 0;
+}
+
+
+static int test_fd(void)
+{
+    CHECK(test_fd_one(0) == 0);
+    CHECK(test_fd_one(MTMQ_F_SPSC) == 0);
+    CHECK(test_fd_one(MTMQ_F_MPMC) == 0);
+    return 0;
+}
+
+
+/* Internal helper: push three messages to each of levels 0, 2, 1 in turn,
+ * and check order in which they are popped.
+ */
+static int test_lanes_order(mtmq_t *q, const int *order)
+{
+    int code;
+    void *data;
+
+    for (int i=0; i<3; i++) {
+        CHECK(mtmq_push_prio(q, 0, i, NULL, 0) == MTMQ_RC_OK);
+        CHECK(mtmq_push_prio(q, 2, 20 + i, NULL, 0) == MTMQ_RC_OK);
+        CHECK(mtmq_push_prio(q, 1, 10 + i, NULL, 0) == MTMQ_RC_OK);
+    }
+    for (int i=0; i<9; i++) {
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK);
+        CHECK(code == order[i]);
+    }
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_TIMEDOUT);
+
+    return 0;
+}
+
+
+/* Test of priority levels: strict priority and FIFO within level, bounded
+ * starvation of lower levels, separate capacity of levels.
+ */
+static int test_lanes(void)
+{
+    static const int strict[] = {20, 21, 22, 10, 11, 12, 0, 1, 2};
+    static const int starve[] = {20, 21, 10, 22, 11, 0, 12, 1, 2};
+    mtmq_attr_t attr;
+    int code;
+    void *data;
+
+    mtmq_attr_init(&attr);
+    attr.levels = 3;
+    mtmq_t *q = mtmq_create_ex(3, &attr);
+    CHECK(q);
+    CHECK(test_lanes_order(q, strict) == 0);
+    CHECK(test_lanes_order(q, strict) == 0);
+    CHECK(mtmq_push_prio(q, 3, 0, NULL, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_push_prio(q, -1, 0, NULL, 0) == MTMQ_RC_ERROR);
+
+    // full level doesn't block others
+    CHECK(test_fifo(q, 3) == 0);
+    for (int i=0; i<3; i++)
+        CHECK(mtmq_push(q, i, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_push_prio(q, 0, 3, NULL, 10) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_push_prio(q, 2, 23, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_count(q) == 4);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 23);
+    for (int i=0; i<3; i++)
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == i);
+    CHECK(test_fin_wakes(q, 0) == 0);
+    CHECK(mtmq_push_prio(q, 1, 0, NULL, 0) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    attr.starve_limit = 2;
+    q = mtmq_create_ex(3, &attr);
+    CHECK(q);
+    CHECK(test_lanes_order(q, starve) == 0);
+    CHECK(test_stream(q, 20000) == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    // single level queue takes only level 0
+    q = test_create(3, 0);
+    CHECK(q);
+    CHECK(mtmq_push_prio(q, 1, 0, NULL, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_push_prio(q, 0, 0, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    attr.levels = MTMQ_MAX_LEVELS + 1;
+    CHECK(!mtmq_create_ex(3, &attr));
+    attr.levels = 2;
+    attr.flags = MTMQ_F_SPSC;
+    CHECK(!mtmq_create_ex(3, &attr));
+    attr.flags = MTMQ_F_MPMC;
+    CHECK(!mtmq_create_ex(3, &attr));
+    attr.flags = 0;
+    attr.payload_size = 8;
+    CHECK(!mtmq_create_ex(3, &attr));
+
+    return 0;
+}
+
+
+// Consumer blocked on several queues in helper thread.
+typedef struct test_any {
+    mtmq_t **qs;
+    int n;
+    int which;  // index of queue message was popped from
+    int code;
+    int rc;  // result of mtmq_pop_any()
+    pthread_t tid;
+} test_any_t;
+
+
+static void *test_any_run(void *arg)
+{
+    test_any_t *a = arg;
+    void *data;
+
+    a->rc = mtmq_pop_any(a->qs, a->n, &a->which, &a->code, &data, -1);
+    return NULL;
+}
+
+
+/* Test of popping from any of several queues: index of queue, fairness,
+ * waking up blocked consumer by push to any queue or finalization of all.
+ */
+static int test_pop_any(void)
+{
+    int flags[] = {0, MTMQ_F_SPSC, MTMQ_F_MPMC};
+    mtmq_t *qs[20];
+    int which, code, seen;
+    void *data;
+
+    for (int i=0; i<20; i++) {
+        qs[i] = test_create(4, flags[i % 3]);
+        CHECK(qs[i]);
+    }
+    CHECK(mtmq_pop_any(NULL, 3, &which, &code, &data, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_pop_any(qs, 0, &which, &code, &data, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_pop_any(qs, 3, NULL, &code, &data, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_pop_any(qs, 3, &which, &code, &data, 0) == MTMQ_RC_TIMEDOUT && which == -1);
+    CHECK(mtmq_pop_any(qs, 3, &which, &code, &data, 10) == MTMQ_RC_TIMEDOUT && which == -1);
+
+    CHECK(mtmq_push(qs[2], 2, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_pop_any(qs, 3, &which, &code, &data, 0) == MTMQ_RC_OK);
+    CHECK(which == 2 && code == 2);
+
+    // busy queues don't starve others
+    for (int i=0; i<3; i++) {
+        for (int k=0; k<4; k++)
+            CHECK(mtmq_push(qs[i], i * 10 + k, NULL, 0) == MTMQ_RC_OK);
+    }
+    seen = 0;
+    for (int k=0; k<3; k++) {
+        CHECK(mtmq_pop_any(qs, 3, &which, &code, &data, 0) == MTMQ_RC_OK);
+        CHECK(code == which * 10);
+        seen |= 1 << which;
+    }
+    CHECK(seen == 7);
+    for (int k=0; k<9; k++) {
+        CHECK(mtmq_pop_any(qs, 3, &which, &code, &data, 0) == MTMQ_RC_OK);
+        CHECK(code / 10 == which);
+    }
+    CHECK(mtmq_pop_any(qs, 3, &which, &code, &data, 0) == MTMQ_RC_TIMEDOUT);
+
+    // more queues than fit on stack
+    for (int i=0; i<3; i++) {
+        test_any_t a = { .qs = qs, .n = 20, .rc = -1 };
+        CHECK(pthread_create(&a.tid, NULL, test_any_run, &a) == 0);
+        usleep(20000);
+        CHECK(mtmq_push(qs[17 + i], 17 + i, NULL, 0) == MTMQ_RC_OK);
+        CHECK(pthread_join(a.tid, NULL) == 0);
+        CHECK(a.rc == MTMQ_RC_OK && a.which == 17 + i && a.code == 17 + i);
+    }
+
+    // finalized queues are skipped until all are finalized
+    CHECK(mtmq_push(qs[1], 1, NULL, 0) == MTMQ_RC_OK);
+    mtmq_finalize(qs[0]);
+    mtmq_finalize(qs[1]);
+    CHECK(mtmq_pop_any(qs, 3, &which, &code, &data, 0) == MTMQ_RC_OK && which == 1);
+    CHECK(mtmq_pop_any(qs, 3, &which, &code, &data, 10) == MTMQ_RC_TIMEDOUT);
+    test_any_t a = { .qs = qs, .n = 3, .rc = -1 };
+    CHECK(pthread_create(&a.tid, NULL, test_any_run, &a) == 0);
+    usleep(50000);
+    mtmq_finalize(qs[2]);
+    CHECK(pthread_join(a.tid, NULL) == 0);
+    CHECK(a.rc == MTMQ_RC_FINALIZED && a.which == -1);
+
+    for (int i=0; i<20; i++)
+        CHECK(mtmq_destroy(qs[i]) == MTMQ_RC_OK);
+
+    return 0;
+}
+
+
+/* Test of elastic capacity: queue grows up to max_size, keeps order across
+ * segments, and works in fixed capacity again once drained.
+ */
+static int test_elastic(void)
+{
+    mtmq_attr_t attr;
+    int code;
+    void *data;
+
+    mtmq_attr_init(&attr);
+    attr.max_size = 11;
+    mtmq_t *q = mtmq_create_ex(2, &attr);
+    CHECK(q);
+    CHECK(test_fifo(q, 11) == 0);
+    CHECK(test_fifo(q, 11) == 0);
+
+    int wr = 0, rd = 0;
+    for (int k=0; k<20; k++) {
+        while (wr - rd < 2 + k % 9)
+            CHECK(mtmq_push(q, wr++, NULL, 0) == MTMQ_RC_OK);
+        while (wr - rd > k % 3) {
+            CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK);
+            CHECK(code == rd++);
+        }
+    }
+    while (rd < wr)
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == rd++);
+    CHECK(test_stream(q, 100000) == 0);
+    CHECK(mtmq_count(q) == 0);
+    for (int i=0; i<11; i++)
+        CHECK(mtmq_push(q, i, NULL, 0) == MTMQ_RC_OK);
+    CHECK(test_fin_wakes(q, 1) == 0);
+    for (int i=0; i<11; i++)
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == i);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    // max_size not above size means fixed capacity
+    attr.max_size = 3;
+    q = mtmq_create_ex(4, &attr);
+    CHECK(q);
+    CHECK(test_fifo(q, 4) == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    attr.max_size = 8;
+    attr.flags = MTMQ_F_SPSC;
+    CHECK(!mtmq_create_ex(2, &attr));
+    attr.flags = MTMQ_F_MPMC;
+    CHECK(!mtmq_create_ex(2, &attr));
+    attr.flags = 0;
+    attr.levels = 2;
+    CHECK(!mtmq_create_ex(2, &attr));
+    attr.levels = 0;
+    attr.payload_size = 8;
+    CHECK(!mtmq_create_ex(2, &attr));
+
+    return 0;
+}
+
+
+/* Test of unbounded queue: push never waits, order is kept across blocks
+ * which are reused after queue is drained.
+ */
+static int test_unbounded(void)
+{
+    int code;
+    void *data;
+
+    mtmq_t *q = test_create(4, MTMQ_F_UNBOUNDED);
+    CHECK(q);
+    for (int k=0; k<3; k++) {
+        for (int i=0; i<1000; i++)
+            CHECK(mtmq_push(q, i, (void*)(long)(i + 1), -1) == MTMQ_RC_OK);
+        CHECK(mtmq_count(q) == 1000);
+        for (int i=0; i<1000; i++) {
+            CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK);
+            CHECK(code == i && data == (void*)(long)(i + 1));
+        }
+        CHECK(mtmq_pop(q, &code, &data, 10) == MTMQ_RC_TIMEDOUT);
+    }
+    CHECK(test_stream(q, 100000) == 0);
+    CHECK(test_fin_wakes(q, 0) == 0);
+    CHECK(mtmq_push(q, 0, NULL, 0) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    q = test_create(1, MTMQ_F_UNBOUNDED);
+    CHECK(q);
+    for (int i=0; i<5; i++)
+        CHECK(mtmq_push(q, i, NULL, 0) == MTMQ_RC_OK);
+    mtmq_finalize(q);
+    for (int i=0; i<5; i++)
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == i);
+    CHECK(mtmq_pop(q, &code, &data, -1) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    mtmq_attr_t attr;
+    mtmq_attr_init(&attr);
+    attr.flags = MTMQ_F_UNBOUNDED;
+    attr.max_size = 8;
+    CHECK(!mtmq_create_ex(4, &attr));
+    CHECK(!test_create(4, MTMQ_F_UNBOUNDED | MTMQ_F_SPSC));
+    CHECK(!test_create(4, MTMQ_F_UNBOUNDED | MTMQ_F_MPMC));
+
+    return 0;
+}
+
+
+/* Internal helper: start n threads blocked in push (wr == 1) or pop
+ * (wr == 0) on queue.
+ */
+static int test_park(test_blocked_t *b, int n, mtmq_t *q, int wr)
+{
+    for (int i=0; i<n; i++) {
+        b[i] = (test_blocked_t){ .q = q, .wr = wr, .rc = -1 };
+        CHECK(pthread_create(&b[i].tid, NULL, test_blocked_run, &b[i]) == 0);
+    }
+    usleep(50000);
+    for (int i=0; i<n; i++)
+        CHECK(b[i].rc == -1);
+
+    return 0;
+}
+
+
+// Internal helper: join threads started by test_park() and check their result.
+static int test_unpark(test_blocked_t *b, int n, int rc)
+{
+    for (int i=0; i<n; i++) {
+        CHECK(pthread_join(b[i].tid, NULL) == 0);
+        CHECK(b[i].rc == rc);
+    }
+
+    return 0;
+}
+
+
+/* Test of waking parked threads: batch of messages or room wakes up all
+ * waiters it can satisfy, finalization wakes up all waiters of both sides,
+ * for all engines.
+ */
+static int test_wake_one(int flags)
+{
+    int n = (flags & MTMQ_F_SPSC) ? 1 : 4;
+    int codes[4] = {1, 2, 3, 4}, done;
+    void *datas[4] = {NULL};
+    test_blocked_t b[4];
+
+    mtmq_t *q = test_create(4, flags);
+    CHECK(q);
+    CHECK(test_park(b, n, q, 0) == 0);
+    CHECK(mtmq_push_n(q, codes, datas, n, 0, &done) == MTMQ_RC_OK && done == n);
+    CHECK(test_unpark(b, n, MTMQ_RC_OK) == 0);
+    CHECK(mtmq_pop(q, codes, datas, 0) == MTMQ_RC_TIMEDOUT);
+
+    CHECK(mtmq_push_n(q, codes, datas, 4, 0, &done) == MTMQ_RC_OK && done == 4);
+    CHECK(test_park(b, n, q, 1) == 0);
+    CHECK(mtmq_pop_n(q, codes, datas, n, 0, &done) == MTMQ_RC_OK && done == n);
+    CHECK(test_unpark(b, n, MTMQ_RC_OK) == 0);
+    CHECK(mtmq_push(q, 0, NULL, 0) == MTMQ_RC_TIMEDOUT);
+
+    // pushed part of batch is delivered while producer waits for more room
+    CHECK(mtmq_pop_n(q, codes, datas, 2, 0, &done) == MTMQ_RC_OK && done == 2);
+    CHECK(mtmq_push_n(q, codes, datas, 4, 0, &done) == MTMQ_RC_OK && done == 2);
+    CHECK(mtmq_push_n(q, codes, datas, 4, 10, &done) == MTMQ_RC_TIMEDOUT && done == 0);
+    CHECK(test_park(b, n, q, 1) == 0);
+    mtmq_finalize(q);
+    CHECK(test_unpark(b, n, MTMQ_RC_FINALIZED) == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    q = test_create(4, flags);
+    CHECK(q);
+    CHECK(test_park(b, n, q, 0) == 0);
+    mtmq_finalize(q);
+    CHECK(test_unpark(b, n, MTMQ_RC_FINALIZED) == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    return 0;
+}
+
+
+static int test_wake(void)
+{
+    CHECK(test_wake_one(0) == 0);
+    CHECK(test_wake_one(MTMQ_F_SPSC) == 0);
+    CHECK(test_wake_one(MTMQ_F_MPMC) == 0);
+    return 0;
+}
+
+
+/* Internal helper run in child process: echo messages of shared queue q
+ * doubling their codes and payloads to queue r until q is finalized.
+ * Returns exit status of child.
+ */
+static int test_shared_echo(mtmq_t *q, mtmq_t *r)
+{
+    int code;
+    void *data, *buf;
+
+    while (mtmq_peek(q, &code, &data, -1) == MTMQ_RC_OK) {
+        if (mtmq_reserve(r, &buf, -1) != MTMQ_RC_OK)
+            return 1;
+        *(int*)buf = *(int*)data * 2;
+        if (mtmq_release(q, data) != MTMQ_RC_OK || mtmq_commit(r, buf, code * 2) != MTMQ_RC_OK)
+            return 1;
+    }
+    return 0;
+}
+
+
+/* Test of queues shared between processes: anonymous ones used by forked
+ * child, named ones opened by name, for all engines.
+ */
+static int test_shared_one(int flags)
+{
+    mtmq_attr_t attr;
+    int code, status;
+    void *data, *buf;
+
+    mtmq_attr_init(&attr);
+    attr.flags = flags;
+    attr.payload_size = sizeof(int);
+    mtmq_t *q = mtmq_create_shared(NULL, 4, &attr);
+    mtmq_t *r = mtmq_create_shared(NULL, 4, &attr);
+    CHECK(q && r);
+
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0)
+        _exit(test_shared_echo(q, r));
+    for (int i=0; i<1000; i++) {
+        CHECK(mtmq_reserve(q, &buf, -1) == MTMQ_RC_OK);
+        *(int*)buf = i;
+        CHECK(mtmq_commit(q, buf, i) == MTMQ_RC_OK);
+        CHECK(mtmq_peek(r, &code, &data, -1) == MTMQ_RC_OK);
+        CHECK(code == 2 * i && *(int*)data == 2 * i);
+        CHECK(mtmq_release(r, data) == MTMQ_RC_OK);
+    }
+    // child blocked on empty queue is woken up by finalization
+    usleep(20000);
+    mtmq_finalize(q);
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+    CHECK(mtmq_destroy(r) == MTMQ_RC_OK);
+
+    char name[64];
+    snprintf(name, sizeof(name), "/mtmq_test_%d_%d", (int)getpid(), flags);
+    mtmq_unlink_shared(name);
+    q = mtmq_create_shared(name, 4, &attr);
+    CHECK(q);
+    CHECK(!mtmq_create_shared(name, 4, &attr));
+    r = mtmq_open_shared(name);
+    CHECK(r && r != q);
+    CHECK(mtmq_reserve(q, &buf, 0) == MTMQ_RC_OK);
+    *(int*)buf = 7;
+    CHECK(mtmq_commit(q, buf, 1) == MTMQ_RC_OK);
+    CHECK(mtmq_count(r) == 1);
+    // data points to slot in mapping of consumer
+    CHECK(mtmq_peek(r, &code, &data, 0) == MTMQ_RC_OK && code == 1 && *(int*)data == 7);
+    CHECK(data != buf);
+    CHECK(mtmq_release(r, data) == MTMQ_RC_OK);
+    CHECK(mtmq_unlink_shared(name) == MTMQ_RC_OK);
+    CHECK(mtmq_unlink_shared(name) == MTMQ_RC_ERROR);
+    CHECK(!mtmq_open_shared(name));
+    // opened queue stays usable after unlinking
+    CHECK(test_fifo(r, 4) == 0);
+    CHECK(test_fin_wakes(q, 0) == 0);
+    CHECK(mtmq_pop(r, &code, &data, 0) == MTMQ_RC_FINALIZED);
+
+    int which;
+    CHECK(mtmq_pop_any(&q, 1, &which, &code, &data, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_get_fd(q) == -1);
+    CHECK(mtmq_destroy(r) == MTMQ_RC_OK);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    return 0;
+}
+
+
+static int test_shared(void)
+{
+    mtmq_attr_t attr;
+
+    CHECK(test_shared_one(0) == 0);
+    CHECK(test_shared_one(MTMQ_F_SPSC) == 0);
+    CHECK(test_shared_one(MTMQ_F_MPMC) == 0);
+
+    CHECK(!mtmq_open_shared("/mtmq_test_none"));
+    mtmq_attr_init(&attr);
+    attr.levels = 2;
+    CHECK(!mtmq_create_shared(NULL, 4, &attr));
+    attr.levels = 0;
+    attr.max_size = 8;
+    CHECK(!mtmq_create_shared(NULL, 4, &attr));
+    attr.max_size = 0;
+    attr.flags = MTMQ_F_UNBOUNDED;
+    CHECK(!mtmq_create_shared(NULL, 4, &attr));
+
+    return 0;
+}
+
+
+static void *test_until_rd(void *arg)
+{
+    test_blocked_t *b = arg;
+    int code;
+    void *data;
+
+    b->rc = mtmq_pop_until(b->q, &code, &data, NULL);
+    return NULL;
+}
+
+
+/* Test of absolute deadlines: operations sharing deadline wait only until
+ * it, passed deadline works as zero timeout, NULL one waits indefinitely.
+ */
+static int test_deadline_one(int flags)
+{
+    struct timespec dl;
+    int codes[4] = {0}, code, done;
+    void *datas[4] = {NULL}, *data;
+
+    mtmq_t *q = test_create(2, flags);
+    CHECK(q);
+    mtmq_deadline(&dl, 100);
+    long start = test_now_ms();
+    CHECK(mtmq_pop_until(q, &code, &data, &dl) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_pop_until(q, &code, &data, &dl) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_pop_n_until(q, codes, datas, 4, &dl, &done) == MTMQ_RC_TIMEDOUT && done == 0);
+    long spent = test_now_ms() - start;
+    CHECK(spent >= 90 && spent < 1000);
+
+    // messages are taken after deadline without waiting
+    CHECK(mtmq_push_until(q, 1, NULL, &dl) == MTMQ_RC_OK);
+    CHECK(mtmq_push_n_until(q, codes, datas, 4, &dl, &done) == MTMQ_RC_OK && done == 1);
+    CHECK(mtmq_push_until(q, 2, NULL, &dl) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_pop_until(q, &code, &data, &dl) == MTMQ_RC_OK && code == 1);
+    CHECK(mtmq_pop_n_until(q, codes, datas, 4, &dl, &done) == MTMQ_RC_OK && done == 1);
+
+    CHECK(mtmq_push(q, 1, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_push(q, 2, NULL, 0) == MTMQ_RC_OK);
+    mtmq_deadline(&dl, 50);
+    start = test_now_ms();
+    CHECK(mtmq_push_until(q, 3, NULL, &dl) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_push_n_until(q, codes, datas, 4, &dl, &done) == MTMQ_RC_TIMEDOUT && done == 0);
+    spent = test_now_ms() - start;
+    CHECK(spent >= 40 && spent < 1000);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 1);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 2);
+
+    test_blocked_t b = { .q = q, .rc = -1 };
+    CHECK(pthread_create(&b.tid, NULL, test_until_rd, &b) == 0);
+    usleep(50000);
+    CHECK(b.rc == -1);
+    CHECK(mtmq_push_until(q, 4, NULL, NULL) == MTMQ_RC_OK);
+    CHECK(pthread_join(b.tid, NULL) == 0 && b.rc == MTMQ_RC_OK);
+    CHECK(pthread_create(&b.tid, NULL, test_until_rd, &b) == 0);
+    usleep(50000);
+    mtmq_finalize(q);
+    CHECK(pthread_join(b.tid, NULL) == 0 && b.rc == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_push_until(q, 5, NULL, NULL) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    return 0;
+}
+
+
+static int test_deadline(void)
+{
+    CHECK(test_deadline_one(0) == 0);
+    CHECK(test_deadline_one(MTMQ_F_SPSC) == 0);
+    CHECK(test_deadline_one(MTMQ_F_MPMC) == 0);
+    return 0;
+}
+
+
+/* Test of draining: messages are taken in order up to n at once, stealing
+ * finalizes queue and wakes up its consumers, for all engines.
+ */
+static int test_drain_one(int flags)
+{
+    int codes[8], done, code;
+    void *datas[8], *data;
+
+    mtmq_t *q = test_create(8, flags);
+    CHECK(q);
+    CHECK(mtmq_drain(NULL, codes, datas, 8, &done) == MTMQ_RC_ERROR);
+    CHECK(mtmq_drain(q, codes, datas, 8, &done) == MTMQ_RC_OK && done == 0);
+    for (int i=0; i<6; i++)
+        CHECK(mtmq_push(q, i, (void*)(long)(i + 1), 0) == MTMQ_RC_OK);
+    CHECK(mtmq_drain(q, codes, datas, 4, &done) == MTMQ_RC_OK && done == 4);
+    for (int i=0; i<4; i++)
+        CHECK(codes[i] == i && datas[i] == (void*)(long)(i + 1));
+    CHECK(mtmq_drain(q, codes, datas, 8, &done) == MTMQ_RC_OK && done == 2);
+    CHECK(codes[0] == 4 && codes[1] == 5);
+    CHECK(mtmq_count(q) == 0);
+    CHECK(test_fifo(q, 8) == 0);
+
+    // finalized queue is drained until empty
+    for (int i=0; i<3; i++)
+        CHECK(mtmq_push(q, i, NULL, 0) == MTMQ_RC_OK);
+    mtmq_finalize(q);
+    CHECK(mtmq_drain(q, codes, datas, 2, &done) == MTMQ_RC_OK && done == 2);
+    CHECK(mtmq_drain(q, codes, datas, 2, &done) == MTMQ_RC_OK && done == 1 && codes[0] == 2);
+    CHECK(mtmq_drain(q, codes, datas, 2, &done) == MTMQ_RC_FINALIZED && done == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    q = test_create(8, flags);
+    CHECK(q);
+    for (int i=0; i<5; i++)
+        CHECK(mtmq_push(q, i, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_finalize_and_steal(q, codes, datas, 3, &done) == MTMQ_RC_OK && done == 3);
+    CHECK(codes[0] == 0 && codes[2] == 2);
+    CHECK(mtmq_push(q, 5, NULL, 0) == MTMQ_RC_FINALIZED);
+    // messages beyond n are left to consumers
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 3);
+    CHECK(mtmq_finalize_and_steal(q, codes, datas, 3, &done) == MTMQ_RC_OK && done == 1);
+    CHECK(codes[0] == 4);
+    CHECK(mtmq_finalize_and_steal(q, codes, datas, 3, &done) == MTMQ_RC_FINALIZED && done == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    q = test_create(8, flags);
+    CHECK(q);
+    test_blocked_t b = { .q = q, .rc = -1 };
+    CHECK(pthread_create(&b.tid, NULL, test_blocked_run, &b) == 0);
+    usleep(50000);
+    CHECK(mtmq_finalize_and_steal(q, codes, datas, 8, &done) == MTMQ_RC_FINALIZED && done == 0);
+    CHECK(pthread_join(b.tid, NULL) == 0 && b.rc == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    return 0;
+}
+
+
+static int test_drain(void)
+{
+    CHECK(test_drain_one(0) == 0);
+    CHECK(test_drain_one(MTMQ_F_SPSC) == 0);
+    CHECK(test_drain_one(MTMQ_F_MPMC) == 0);
+    return 0;
+}
+
+
+// Pool worker blocked in helper thread.
+typedef struct test_worker {
+    mtmq_pool_t *p;
+    int worker;
+    int code;
+    int rc;  // result of mtmq_pool_pop()
+    pthread_t tid;
+} test_worker_t;
+
+
+static void *test_worker_run(void *arg)
+{
+    test_worker_t *w = arg;
+    void *data;
+
+    w->rc = mtmq_pool_pop(w->p, w->worker, &w->code, &data, -1);
+    return NULL;
+}
+
+
+/* Test of worker pool: own queue is popped first, idle worker steals half
+ * of peer's messages or waits for any queue, finalization wakes workers.
+ */
+static int test_pool(void)
+{
+    mtmq_attr_t attr;
+    int codes[8], code, done;
+    void *datas[8], *data;
+
+    mtmq_pool_t *p = mtmq_pool_create(3, 4, 0, NULL);
+    CHECK(p);
+    for (int i=0; i<4; i++)
+        CHECK(mtmq_pool_push(p, 0, i, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_pool_push(p, 0, 4, NULL, 10) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_pool_pop(p, 0, &code, &data, 0) == MTMQ_RC_OK && code == 0);
+    CHECK(mtmq_pool_pop_n(p, 1, codes, datas, 8, 0, &done) == MTMQ_RC_OK);
+    CHECK(done == 2 && codes[0] == 1 && codes[1] == 2);
+    CHECK(mtmq_pool_pop(p, 2, &code, &data, 0) == MTMQ_RC_OK && code == 3);
+    CHECK(mtmq_pool_pop(p, 1, &code, &data, 10) == MTMQ_RC_TIMEDOUT);
+
+    // messages from outside are spread over workers
+    for (int i=0; i<3; i++)
+        CHECK(mtmq_pool_push(p, -1, i, NULL, 0) == MTMQ_RC_OK);
+    for (int i=0; i<3; i++)
+        CHECK(mtmq_count(mtmq_pool_queue(p, i)) == 1);
+    for (int i=0; i<3; i++)
+        CHECK(mtmq_pool_pop(p, 0, &code, &data, 0) == MTMQ_RC_OK);
+
+    test_worker_t w = { .p = p, .worker = 2, .rc = -1 };
+    CHECK(pthread_create(&w.tid, NULL, test_worker_run, &w) == 0);
+    usleep(50000);
+    CHECK(mtmq_pool_push(p, 0, 7, NULL, 0) == MTMQ_RC_OK);
+    CHECK(pthread_join(w.tid, NULL) == 0 && w.rc == MTMQ_RC_OK && w.code == 7);
+
+    // messages left are popped by any worker after finalization
+    CHECK(mtmq_pool_push(p, 1, 8, NULL, 0) == MTMQ_RC_OK);
+    mtmq_pool_finalize(p);
+    CHECK(mtmq_pool_push(p, 1, 9, NULL, 0) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_pool_pop(p, 0, &code, &data, -1) == MTMQ_RC_OK && code == 8);
+    CHECK(mtmq_pool_pop(p, 0, &code, &data, -1) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_pool_destroy(p) == MTMQ_RC_OK);
+
+    p = mtmq_pool_create(2, 4, MTMQ_POOL_F_LIFO, NULL);
+    CHECK(p);
+    for (int i=0; i<3; i++)
+        CHECK(mtmq_pool_push(p, 0, i, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_pool_pop(p, 0, &code, &data, 0) == MTMQ_RC_OK && code == 2);
+    // peer steals oldest one
+    CHECK(mtmq_pool_pop(p, 1, &code, &data, 0) == MTMQ_RC_OK && code == 0);
+    CHECK(mtmq_pool_pop(p, 0, &code, &data, 0) == MTMQ_RC_OK && code == 1);
+    // own batch is taken newest first, across ring wrap
+    for (int i=0; i<4; i++)
+        CHECK(mtmq_pool_push(p, 0, i, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_pool_pop_n(p, 0, codes, datas, 3, 0, &done) == MTMQ_RC_OK && done == 3);
+    CHECK(codes[0] == 3 && codes[1] == 2 && codes[2] == 1);
+    CHECK(mtmq_pop_back_n(mtmq_pool_queue(p, 0), codes, datas, 8, 0, &done) == MTMQ_RC_OK && done == 1 && codes[0] == 0);
+    CHECK(mtmq_pop_back_n(mtmq_pool_queue(p, 0), codes, datas, 8, 10, &done) == MTMQ_RC_TIMEDOUT && done == 0);
+    w = (test_worker_t){ .p = p, .worker = 1, .rc = -1 };
+    CHECK(pthread_create(&w.tid, NULL, test_worker_run, &w) == 0);
+    usleep(50000);
+    mtmq_pool_finalize(p);
+    CHECK(pthread_join(w.tid, NULL) == 0 && w.rc == MTMQ_RC_FINALIZED);
+
+    CHECK(mtmq_pool_push(p, 2, 0, NULL, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_pool_push(p, -2, 0, NULL, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_pool_pop(p, 2, &code, &data, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_pool_pop_n(p, -1, codes, datas, 8, 0, &done) == MTMQ_RC_ERROR);
+    CHECK(!mtmq_pool_queue(p, 2));
+    CHECK(mtmq_pool_destroy(p) == MTMQ_RC_OK);
+
+    CHECK(!mtmq_pool_create(0, 4, 0, NULL));
+    mtmq_attr_init(&attr);
+    attr.flags = MTMQ_F_SPSC;
+    CHECK(!mtmq_pool_create(2, 4, 0, &attr));
+    attr.flags = 0;
+    attr.shards = 2;
+    CHECK(!mtmq_pool_create(2, 4, 0, &attr));
+    attr.shards = 0;
+    attr.flags = MTMQ_F_MPMC;
+    CHECK(!mtmq_pool_create(2, 4, MTMQ_POOL_F_LIFO, &attr));
+    // MPMC queue can't be popped from back, but is stolen from in FIFO pool
+    p = mtmq_pool_create(2, 4, 0, &attr);
+    CHECK(p);
+    CHECK(mtmq_pop_back(mtmq_pool_queue(p, 0), &code, &data, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_pop_back_n(mtmq_pool_queue(p, 0), codes, datas, 8, 0, &done) == MTMQ_RC_ERROR);
+    CHECK(mtmq_pool_push(p, 0, 1, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_pool_pop(p, 1, &code, &data, 0) == MTMQ_RC_OK && code == 1);
+    CHECK(mtmq_pool_destroy(p) == MTMQ_RC_OK);
+
+    return 0;
+}
+
+
+// Internal helper to create sharded queue.
+static mtmq_t *test_create_sharded(int size, int flags, int shards)
+{
+    mtmq_attr_t attr;
+    mtmq_attr_init(&attr);
+    attr.flags = flags;
+    attr.shards = shards;
+    return mtmq_create_ex(size, &attr);
+}
+
+
+// Producer of sharded queue, pushes codes id * n + i.
+typedef struct test_shard_wr {
+    mtmq_t *q;
+    int id;
+    int n;
+    int bad;  // failed pushes
+    pthread_t tid;
+} test_shard_wr_t;
+
+
+static void *test_shard_run(void *arg)
+{
+    test_shard_wr_t *w = arg;
+
+    for (int i=0; i<w->n; i++) {
+        if (mtmq_push(w->q, w->id * w->n + i, NULL, -1) != MTMQ_RC_OK)
+            w->bad++;
+    }
+    return NULL;
+}
+
+
+/* Test of sharded queue: producer fills its own shard, messages of one
+ * producer or one key keep their order, consumer waits on all shards.
+ */
+static int test_shards_one(int flags)
+{
+    enum { NP = 4, N = 20000 };
+    test_shard_wr_t w[NP];
+    int code, last[NP];
+    void *data;
+
+    mtmq_t *q = test_create_sharded(4, flags, NP);
+    CHECK(q);
+    for (int i=0; i<4; i++)
+        CHECK(mtmq_push(q, i, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_push(q, 4, NULL, 10) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_count(q) == 4);
+    for (int i=0; i<4; i++)
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == i);
+    CHECK(mtmq_pop(q, &code, &data, 10) == MTMQ_RC_TIMEDOUT);
+
+    for (int i=0; i<NP; i++) {
+        w[i] = (test_shard_wr_t){ .q = q, .id = i, .n = N };
+        last[i] = -1;
+        CHECK(pthread_create(&w[i].tid, NULL, test_shard_run, &w[i]) == 0);
+    }
+    for (int k=0; k<NP * N; k++) {
+        CHECK(mtmq_pop(q, &code, &data, -1) == MTMQ_RC_OK);
+        int id = code / N;
+        CHECK(id >= 0 && id < NP && code % N == last[id] + 1);
+        last[id] = code % N;
+    }
+    for (int i=0; i<NP; i++) {
+        CHECK(pthread_join(w[i].tid, NULL) == 0);
+        CHECK(w[i].bad == 0);
+    }
+
+    // messages of several keys fit in several shards, each key in order
+    int pushed = 0;
+    for (int i=0; i<16; i++)
+        pushed += mtmq_push_key(q, i % 8, i, NULL, 0) == MTMQ_RC_OK;
+    CHECK(pushed > 4 && mtmq_count(q) == pushed);
+    int prev[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+    for (int k=0; k<pushed; k++) {
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK);
+        CHECK(code > prev[code % 8]);
+        prev[code % 8] = code;
+    }
+    CHECK(test_fin_wakes(q, 0) == 0);
+    CHECK(mtmq_push_key(q, 0, 0, NULL, 0) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    return 0;
+}
+
+
+static int test_shards(void)
+{
+    CHECK(test_shards_one(0) == 0);
+    CHECK(test_shards_one(MTMQ_F_MPMC) == 0);
+
+    // key is ignored by queue without shards
+    mtmq_t *q = test_create(2, 0);
+    CHECK(q);
+    CHECK(mtmq_push_key(q, 5, 1, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_push_key(q, 6, 2, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_push_key(q, 7, 3, NULL, 0) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    CHECK(!test_create_sharded(4, MTMQ_F_SPSC, 4));
+    mtmq_attr_t attr;
+    mtmq_attr_init(&attr);
+    attr.shards = 4;
+    attr.levels = 2;
+    CHECK(!mtmq_create_ex(4, &attr));
+    attr.levels = 0;
+    attr.payload_size = 8;
+    CHECK(!mtmq_create_ex(4, &attr));
+
+    return 0;
+}
+
+
+// Subscriber of broadcast ring blocked in helper thread.
+typedef struct test_sub {
+    mtmq_bcast_t *b;
+    int sub;
+    int code;
+    int rc;  // result of mtmq_bcast_pop()
+    pthread_t tid;
+} test_sub_t;
+
+
+static void *test_sub_run(void *arg)
+{
+    test_sub_t *s = arg;
+    void *data;
+
+    s->rc = mtmq_bcast_pop(s->b, s->sub, &s->code, &data, -1);
+    return NULL;
+}
+
+
+/* Test of broadcast ring: every subscriber gets every message pushed after
+ * it subscribed, slowest one blocks producer or is dropped.
+ */
+static int test_bcast(void)
+{
+    int codes[8], code, done;
+    void *datas[8], *data;
+
+    mtmq_bcast_t *b = mtmq_bcast_create(4, 2, 0);
+    CHECK(b);
+    // nobody to deliver to
+    CHECK(mtmq_bcast_push(b, 0, NULL, 0) == MTMQ_RC_OK);
+    int s1 = mtmq_bcast_subscribe(b);
+    CHECK(s1 >= 0);
+    CHECK(mtmq_bcast_pop(b, s1, &code, &data, 0) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_bcast_push(b, 1, (void*)1L, 0) == MTMQ_RC_OK);
+    int s2 = mtmq_bcast_subscribe(b);
+    CHECK(s2 >= 0 && s2 != s1);
+    CHECK(mtmq_bcast_subscribe(b) == -1);
+    for (int i=2; i<5; i++)
+        CHECK(mtmq_bcast_push(b, i, (void*)(long)i, 0) == MTMQ_RC_OK);
+    // s1 is size messages behind
+    CHECK(mtmq_bcast_push(b, 5, NULL, 10) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_bcast_pop(b, s1, &code, &data, 0) == MTMQ_RC_OK);
+    CHECK(code == 1 && data == (void*)1L);
+    CHECK(mtmq_bcast_push(b, 5, (void*)5L, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_bcast_pop_n(b, s1, codes, datas, 8, 0, &done) == MTMQ_RC_OK);
+    CHECK(done == 4 && codes[0] == 2 && codes[3] == 5 && datas[3] == (void*)5L);
+    CHECK(mtmq_bcast_pop_n(b, s2, codes, datas, 8, 0, &done) == MTMQ_RC_OK);
+    CHECK(done == 4 && codes[0] == 2 && codes[3] == 5);
+    CHECK(mtmq_bcast_pop(b, s2, &code, &data, 10) == MTMQ_RC_TIMEDOUT);
+
+    test_sub_t s = { .b = b, .sub = s2, .rc = -1 };
+    CHECK(pthread_create(&s.tid, NULL, test_sub_run, &s) == 0);
+    usleep(50000);
+    CHECK(mtmq_bcast_push(b, 6, NULL, 0) == MTMQ_RC_OK);
+    CHECK(pthread_join(s.tid, NULL) == 0 && s.rc == MTMQ_RC_OK && s.code == 6);
+
+    // unsubscribed one no longer holds producer back
+    CHECK(mtmq_bcast_unsubscribe(b, s1) == MTMQ_RC_OK);
+    CHECK(mtmq_bcast_unsubscribe(b, s1) == MTMQ_RC_ERROR);
+    CHECK(mtmq_bcast_pop(b, s1, &code, &data, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_bcast_pop(b, 2, &code, &data, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_bcast_pop(b, -1, &code, &data, 0) == MTMQ_RC_ERROR);
+    for (int i=7; i<11; i++)
+        CHECK(mtmq_bcast_push(b, i, NULL, 0) == MTMQ_RC_OK);
+
+    mtmq_bcast_finalize(b);
+    CHECK(mtmq_bcast_push(b, 11, NULL, 0) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_bcast_subscribe(b) == -1);
+    for (int i=7; i<11; i++)
+        CHECK(mtmq_bcast_pop(b, s2, &code, &data, 0) == MTMQ_RC_OK && code == i);
+    CHECK(mtmq_bcast_pop(b, s2, &code, &data, -1) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_bcast_destroy(b) == MTMQ_RC_OK);
+
+    b = mtmq_bcast_create(2, 2, MTMQ_BCAST_F_DROP);
+    CHECK(b);
+    s1 = mtmq_bcast_subscribe(b);
+    s2 = mtmq_bcast_subscribe(b);
+    CHECK(s1 >= 0 && s2 >= 0);
+    for (int i=0; i<5; i++) {
+        CHECK(mtmq_bcast_push(b, i, NULL, 0) == MTMQ_RC_OK);
+        CHECK(mtmq_bcast_pop(b, s2, &code, &data, 0) == MTMQ_RC_OK && code == i);
+    }
+    CHECK(mtmq_bcast_pop(b, s1, &code, &data, 0) == MTMQ_RC_DROPPED);
+    CHECK(mtmq_bcast_pop(b, s1, &code, &data, 0) == MTMQ_RC_DROPPED);
+    CHECK(mtmq_bcast_unsubscribe(b, s1) == MTMQ_RC_OK);
+    // freed slot is reused
+    CHECK(mtmq_bcast_subscribe(b) == s1);
+    s = (test_sub_t){ .b = b, .sub = s1, .rc = -1 };
+    CHECK(pthread_create(&s.tid, NULL, test_sub_run, &s) == 0);
+    usleep(50000);
+    mtmq_bcast_finalize(b);
+    CHECK(pthread_join(s.tid, NULL) == 0 && s.rc == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_bcast_destroy(b) == MTMQ_RC_OK);
+
+    CHECK(!mtmq_bcast_create(0, 2, 0));
+    CHECK(!mtmq_bcast_create(4, 0, 0));
+
+    return 0;
+}
+
+
+/* Test of conflating queue: push of queued code replaces its data in place
+ * without waiting for room, popped code is queued anew.
+ */
+static int test_conflate(void)
+{
+    mtmq_attr_t attr;
+    int code;
+    void *data;
+
+    mtmq_t *q = test_create(3, MTMQ_F_CONFLATE);
+    CHECK(q);
+    CHECK(test_fifo(q, 3) == 0);
+    CHECK(mtmq_push(q, 10, (void*)1L, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_push(q, 20, (void*)2L, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_push(q, 10, (void*)3L, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_count(q) == 2);
+    CHECK(mtmq_push(q, 30, (void*)4L, 0) == MTMQ_RC_OK);
+    // full queue still takes updates
+    CHECK(mtmq_push(q, 40, NULL, 10) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_push(q, 20, (void*)5L, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_count(q) == 3);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 10 && data == (void*)3L);
+    CHECK(mtmq_push(q, 10, (void*)6L, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 20 && data == (void*)5L);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 30 && data == (void*)4L);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 10 && data == (void*)6L);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_TIMEDOUT);
+
+    // many codes through key index
+    for (int k=0; k<1000; k++) {
+        CHECK(mtmq_push(q, k, NULL, 0) == MTMQ_RC_OK);
+        CHECK(mtmq_push(q, k, (void*)(long)k, 0) == MTMQ_RC_OK);
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == k && data == (void*)(long)k);
+    }
+    CHECK(mtmq_push(q, 1, NULL, 0) == MTMQ_RC_OK);
+    mtmq_finalize(q);
+    CHECK(mtmq_push(q, 1, NULL, 0) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 1);
+    CHECK(mtmq_pop(q, &code, &data, -1) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    q = test_create(3, MTMQ_F_CONFLATE);
+    CHECK(q);
+    CHECK(test_fin_wakes(q, 0) == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    CHECK(!test_create(3, MTMQ_F_CONFLATE | MTMQ_F_SPSC));
+    CHECK(!test_create(3, MTMQ_F_CONFLATE | MTMQ_F_MPMC));
+    CHECK(!test_create((1 << 30) + 1, MTMQ_F_CONFLATE));
+    mtmq_attr_init(&attr);
+    attr.flags = MTMQ_F_CONFLATE;
+    attr.levels = 2;
+    CHECK(!mtmq_create_ex(3, &attr));
+    attr.levels = 0;
+    attr.max_size = 8;
+    CHECK(!mtmq_create_ex(3, &attr));
+    attr.max_size = 0;
+    attr.shards = 2;
+    CHECK(!mtmq_create_ex(3, &attr));
+    attr.shards = 0;
+    attr.payload_size = 8;
+    CHECK(!mtmq_create_ex(3, &attr));
+
+    return 0;
+}
+
+
+// Messages dropped by overwriting queue.
+typedef struct test_evicted {
+    mtmq_t *q;
+    int n;
+    int codes[8];
+} test_evicted_t;
+
+
+static void test_evict(void *arg, int code, void *data)
+{
+    test_evicted_t *e = arg;
+
+    // called without queue mutex, so it may use queue
+    if (!mtmq_is_finalized(e->q) && e->n < 8 && data == (void*)(long)(code + 1))
+        e->codes[e->n++] = code;
+}
+
+
+/* Test of overwriting queue: push to full queue drops its oldest message,
+ * which is passed to evict callback and counted in statistics.
+ */
+static int test_overwrite(void)
+{
+    mtmq_attr_t attr;
+    test_evicted_t e = {0};
+    int codes[4] = {4, 5, 6, 7}, code, done;
+    void *datas[4] = {(void*)5L, (void*)6L, (void*)7L, (void*)8L}, *data;
+
+    mtmq_t *q = test_create(3, MTMQ_F_OVERWRITE);
+    CHECK(q);
+    for (int i=0; i<5; i++)
+        CHECK(mtmq_push(q, i, NULL, -1) == MTMQ_RC_OK);
+    CHECK(mtmq_count(q) == 3);
+    for (int i=2; i<5; i++)
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == i);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_TIMEDOUT);
+#ifndef MTMQ_NO_STATS
+    mtmq_stats_t st;
+    CHECK(mtmq_get_stats(q, &st) == MTMQ_RC_OK);
+    CHECK(st.dropped == 2 && st.pushes == 5 && st.pops == 3 && st.wr_waits == 0);
+#endif
+    CHECK(test_fin_wakes(q, 0) == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    mtmq_attr_init(&attr);
+    attr.flags = MTMQ_F_OVERWRITE;
+    attr.evict = test_evict;
+    attr.evict_arg = &e;
+    q = mtmq_create_ex(3, &attr);
+    CHECK(q);
+    e.q = q;
+    for (int i=0; i<4; i++)
+        CHECK(mtmq_push(q, i, (void*)(long)(i + 1), 0) == MTMQ_RC_OK);
+    CHECK(e.n == 1 && e.codes[0] == 0);
+    CHECK(mtmq_push_n(q, codes, datas, 4, 0, &done) == MTMQ_RC_OK && done == 4);
+    CHECK(e.n == 5 && e.codes[1] == 1 && e.codes[4] == 4);
+    for (int i=5; i<8; i++)
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == i);
+    // nothing is dropped from queue with room
+    for (int i=0; i<3; i++)
+        CHECK(mtmq_push(q, i, NULL, 0) == MTMQ_RC_OK);
+    for (int i=0; i<3; i++)
+        CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == i);
+    CHECK(e.n == 5);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    attr.flags = 0;
+    CHECK(!mtmq_create_ex(3, &attr));
+    attr.flags = MTMQ_F_OVERWRITE;
+    CHECK(!mtmq_create_shared(NULL, 3, &attr));
+    attr.evict = NULL;
+    attr.flags = MTMQ_F_OVERWRITE | MTMQ_F_SPSC;
+    CHECK(!mtmq_create_ex(3, &attr));
+    attr.flags = MTMQ_F_OVERWRITE | MTMQ_F_MPMC;
+    CHECK(!mtmq_create_ex(3, &attr));
+    attr.flags = MTMQ_F_OVERWRITE;
+    attr.levels = 2;
+    CHECK(!mtmq_create_ex(3, &attr));
+    attr.levels = 0;
+    attr.max_size = 8;
+    CHECK(!mtmq_create_ex(3, &attr));
+    attr.max_size = 0;
+    attr.payload_size = 8;
+    CHECK(!mtmq_create_ex(3, &attr));
+
+    return 0;
+}
+
+
+// Producer allocating buffers of magazine allocator in helper thread.
+typedef struct test_mag {
+    mtmq_mag_t *m;
+    mtmq_t *q;  // buffers to consumer
+    mtmq_t *done;  // consumer freed buffers
+    void *bufs[8];
+    int reused;  // buffers of second round allocated in first one
+    int bad;
+} test_mag_t;
+
+
+static void *test_mag_run(void *arg)
+{
+    test_mag_t *t = arg;
+    int code;
+    void *data;
+
+    for (int i=0; i<8; i++) {
+        t->bufs[i] = mtmq_mag_alloc(t->m);
+        if (!t->bufs[i] || mtmq_push(t->q, i, t->bufs[i], -1) != MTMQ_RC_OK)
+            t->bad++;
+    }
+    if (mtmq_pop(t->done, &code, &data, -1) != MTMQ_RC_OK)
+        t->bad++;
+    for (int i=0; i<8; i++) {
+        void *buf = mtmq_mag_alloc(t->m);
+        for (int k=0; k<8; k++)
+            t->reused += buf == t->bufs[k];
+    }
+    return NULL;
+}
+
+
+/* Test of magazine allocator: buffers are aligned and reused by thread
+ * which freed them, buffers freed by consumer return to producer.
+ */
+static int test_mag(void)
+{
+    void *bufs[10];
+    int code;
+    void *data;
+
+    mtmq_mag_t *m = mtmq_mag_create(24, 4);
+    CHECK(m);
+    for (int i=0; i<10; i++) {
+        bufs[i] = mtmq_mag_alloc(m);
+        CHECK(bufs[i] && (uintptr_t)bufs[i] % alignof(max_align_t) == 0);
+        memset(bufs[i], i, 24);
+        for (int k=0; k<i; k++)
+            CHECK(bufs[k] != bufs[i]);
+    }
+    for (int i=0; i<10; i++)
+        CHECK(((unsigned char*)bufs[i])[23] == i);
+    mtmq_mag_free(m, bufs[3]);
+    CHECK(mtmq_mag_alloc(m) == bufs[3]);
+    mtmq_mag_free(m, NULL);
+    for (int i=0; i<10; i++)
+        mtmq_mag_free(m, bufs[i]);
+    CHECK(mtmq_mag_flush(m) == MTMQ_RC_OK);
+
+    test_mag_t t = { .m = m, .q = test_create(8, MTMQ_F_SPSC), .done = test_create(1, 0) };
+    CHECK(t.q && t.done);
+    pthread_t tid;
+    CHECK(pthread_create(&tid, NULL, test_mag_run, &t) == 0);
+    for (int i=0; i<8; i++) {
+        CHECK(mtmq_pop(t.q, &code, &data, -1) == MTMQ_RC_OK && code == i);
+        mtmq_mag_free(m, data);
+    }
+    // last incomplete batch stays with consumer until flushed
+    CHECK(mtmq_mag_flush(m) == MTMQ_RC_OK);
+    CHECK(mtmq_push(t.done, 0, NULL, -1) == MTMQ_RC_OK);
+    CHECK(pthread_join(tid, NULL) == 0);
+    CHECK(t.bad == 0 && t.reused == 8);
+    CHECK(mtmq_destroy(t.q) == MTMQ_RC_OK);
+    CHECK(mtmq_destroy(t.done) == MTMQ_RC_OK);
+    CHECK(mtmq_mag_destroy(m) == MTMQ_RC_OK);
+
+    CHECK(!mtmq_mag_create(0, 4));
+    CHECK(!mtmq_mag_create(24, 0));
+    CHECK(mtmq_mag_destroy(NULL) == MTMQ_RC_ERROR);
+    CHECK(mtmq_mag_flush(NULL) == MTMQ_RC_ERROR);
+    CHECK(!mtmq_mag_alloc(NULL));
+
+    return 0;
+}
+
+
+/* Test of queue memory placement: queues bound to NUMA node or backed by
+ * huge pages work as usual with all engines, wherever kernel supports it.
+ */
+static int test_numa(void)
+{
+    int flags[] = {0, MTMQ_F_SPSC, MTMQ_F_MPMC};
+    mtmq_attr_t attr;
+
+    for (int i=0; i<3; i++) {
+        mtmq_t *q = test_create(1000, flags[i] | MTMQ_F_HUGE);
+        CHECK(q);
+        CHECK(test_fifo(q, 1000) == 0);
+        CHECK(test_stream(q, 20000) == 0);
+        // result depends on kernel, but queue stays usable
+        mtmq_migrate(q);
+        CHECK(test_fifo(q, 1000) == 0);
+        CHECK(test_fin_wakes(q, 0) == 0);
+        CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+        mtmq_attr_init(&attr);
+        attr.flags = flags[i] | MTMQ_F_NUMA;
+        attr.numa_node = 0;
+        q = mtmq_create_ex(100, &attr);
+        CHECK(q);
+        CHECK(test_fifo(q, 100) == 0);
+        mtmq_migrate(q);
+        CHECK(test_stream(q, 20000) == 0);
+        CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+        q = mtmq_create_shared(NULL, 100, &attr);
+        CHECK(q);
+        CHECK(test_fifo(q, 100) == 0);
+        CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+        attr.numa_node = -1;
+        CHECK(!mtmq_create_ex(100, &attr));
+        attr.numa_node = 1 << 20;
+        CHECK(!mtmq_create_ex(100, &attr));
+    }
+
+    mtmq_t *q = test_create(100, 0);
+    CHECK(q);
+    CHECK(mtmq_migrate(q) == MTMQ_RC_ERROR);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+    CHECK(mtmq_migrate(NULL) == MTMQ_RC_ERROR);
+
+    return 0;
+}
+
+
+// Batch pop blocked in helper thread.
+typedef struct test_batch_rd {
+    mtmq_t *q;
+    int timeout;
+    int done;  // messages popped
+    int rc;  // result of mtmq_pop_n(), -1 while blocked
+    pthread_t tid;
+} test_batch_rd_t;
+
+
+static void *test_batch_rd_run(void *arg)
+{
+    test_batch_rd_t *r = arg;
+    int codes[8];
+    void *datas[8];
+
+    r->rc = mtmq_pop_n(r->q, codes, datas, 8, r->timeout, &r->done);
+    return NULL;
+}
+
+
+// Internal helper to create queue with wake-up batching attributes.
+static mtmq_t *test_create_batched(int size, int rd_batch, int wr_batch, int batch_ms)
+{
+    mtmq_attr_t attr;
+    mtmq_attr_init(&attr);
+    attr.rd_batch = rd_batch;
+    attr.wr_batch = wr_batch;
+    attr.batch_ms = batch_ms;
+    return mtmq_create_ex(size, &attr);
+}
+
+
+/* Test of wake-up batching: blocked consumer is woken up by batch of
+ * messages, or after batch_ms by incomplete one, and blocked producer by
+ * room for batch. Operations which don't block are not delayed.
+ */
+static int test_wake_batch(void)
+{
+    int code;
+    void *data;
+
+    mtmq_t *q = test_create_batched(8, 4, 0, 0);
+    CHECK(q);
+    CHECK(test_fifo(q, 8) == 0);
+    test_batch_rd_t r = { .q = q, .timeout = -1, .rc = -1 };
+    CHECK(pthread_create(&r.tid, NULL, test_batch_rd_run, &r) == 0);
+    usleep(20000);
+    for (int i=0; i<3; i++)
+        CHECK(mtmq_push(q, i, NULL, 0) == MTMQ_RC_OK);
+    usleep(50000);
+    CHECK(r.rc == -1);
+    CHECK(mtmq_push(q, 3, NULL, 0) == MTMQ_RC_OK);
+    CHECK(pthread_join(r.tid, NULL) == 0 && r.rc == MTMQ_RC_OK && r.done == 4);
+
+    // incomplete batch is taken once wait times out
+    r = (test_batch_rd_t){ .q = q, .timeout = 100, .rc = -1 };
+    CHECK(pthread_create(&r.tid, NULL, test_batch_rd_run, &r) == 0);
+    usleep(20000);
+    CHECK(mtmq_push(q, 4, NULL, 0) == MTMQ_RC_OK);
+    CHECK(pthread_join(r.tid, NULL) == 0 && r.rc == MTMQ_RC_OK && r.done == 1);
+    CHECK(test_fin_wakes(q, 0) == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    q = test_create_batched(8, 4, 0, 50);
+    CHECK(q);
+    r = (test_batch_rd_t){ .q = q, .timeout = -1, .rc = -1 };
+    CHECK(pthread_create(&r.tid, NULL, test_batch_rd_run, &r) == 0);
+    usleep(20000);
+    long start = test_now_ms();
+    CHECK(mtmq_push(q, 0, NULL, 0) == MTMQ_RC_OK);
+    CHECK(pthread_join(r.tid, NULL) == 0 && r.rc == MTMQ_RC_OK && r.done == 1);
+    long spent = test_now_ms() - start;
+    CHECK(spent >= 40 && spent < 1000);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    q = test_create_batched(4, 0, 2, 0);
+    CHECK(q);
+    for (int i=0; i<4; i++)
+        CHECK(mtmq_push(q, i, NULL, 0) == MTMQ_RC_OK);
+    test_blocked_t b = { .q = q, .wr = 1, .rc = -1 };
+    CHECK(pthread_create(&b.tid, NULL, test_blocked_run, &b) == 0);
+    usleep(20000);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 0);
+    usleep(50000);
+    CHECK(b.rc == -1);
+    CHECK(mtmq_pop(q, &code, &data, 0) == MTMQ_RC_OK && code == 1);
+    CHECK(pthread_join(b.tid, NULL) == 0 && b.rc == MTMQ_RC_OK);
+    CHECK(mtmq_count(q) == 3);
+    CHECK(mtmq_push(q, 5, NULL, 0) == MTMQ_RC_OK);
+    CHECK(test_fin_wakes(q, 1) == 0);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    mtmq_attr_t attr;
+    mtmq_attr_init(&attr);
+    attr.rd_batch = 2;
+    attr.flags = MTMQ_F_SPSC;
+    CHECK(!mtmq_create_ex(4, &attr));
+    attr.flags = MTMQ_F_MPMC;
+    CHECK(!mtmq_create_ex(4, &attr));
+    attr.rd_batch = 0;
+    attr.wr_batch = 2;
+    CHECK(!mtmq_create_ex(4, &attr));
+
+    return 0;
+}
+
+
+#ifdef MTMQ_TRACE
+/* Internal helper run in its own thread, so that its trace records are not
+ * mixed with ones of other tests: push three messages with payload, last
+ * one reserved before finalization, and pop them.
+ */
+static void *test_trace_run(void *arg)
+{
+    mtmq_t *q = arg;
+    int code;
+    void *buf;
+
+    for (int i=0; i<3; i++) {
+        if (mtmq_reserve(q, &buf, 0) != MTMQ_RC_OK)
+            return NULL;
+        if (i == 2)
+            mtmq_finalize(q);
+        mtmq_commit(q, buf, i);
+        if (i == 0)
+            mtmq_pop(q, &code, &buf, 0);
+    }
+    while (mtmq_pop(q, &code, &buf, 0) == MTMQ_RC_OK)
+        ;
+    return NULL;
+}
+
+
+/* Internal helper: check that trace has queue positions of all messages of
+ * test_trace_run(), not marked as finalized.
+ */
+static int test_trace_check(FILE *f, mtmq_t *q)
+{
+    char magic[8];
+    mtmq_trace_rec_t r;
+    int thread = -1, enq = 0, deq = 0;
+
+    rewind(f);
+    CHECK(fread(magic, 8, 1, f) == 1 && !memcmp(magic, MTMQ_TRACE_MAGIC, 8));
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        if (r.thread > thread)
+            thread = r.thread;
+    }
+    // newest thread is the one which ran test_trace_run()
+    rewind(f);
+    CHECK(fread(magic, 8, 1, f) == 1);
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        if (r.queue != (uintptr_t)q || r.thread != thread)
+            continue;
+        if (r.type == MTMQ_TEV_ENQ) {
+            CHECK(r.arg > (uint64_t)enq && r.arg <= 3);
+            enq = (int)r.arg;
+        }
+        if (r.type == MTMQ_TEV_DEQ) {
+            CHECK(r.arg > (uint64_t)deq && r.arg <= 3);
+            deq = (int)r.arg;
+        }
+    }
+    CHECK(enq == 3 && deq == 3);
+
+    return 0;
+}
+#endif
+
+
+/* Test of tracing: queue positions of enqueued and dequeued messages are
+ * recorded for all engines. Without MTMQ_TRACE nothing can be written.
+ */
+static int test_trace(void)
+{
+#ifdef MTMQ_TRACE
+    int flags[] = {0, MTMQ_F_SPSC, MTMQ_F_MPMC};
+    mtmq_attr_t attr;
+
+    for (int i=0; i<3; i++) {
+        mtmq_attr_init(&attr);
+        attr.flags = flags[i];
+        attr.payload_size = sizeof(int);
+        mtmq_t *q = mtmq_create_ex(4, &attr);
+        CHECK(q);
+        pthread_t tid;
+        CHECK(pthread_create(&tid, NULL, test_trace_run, q) == 0);
+        CHECK(pthread_join(tid, NULL) == 0);
+        FILE *f = tmpfile();
+        CHECK(f);
+        CHECK(mtmq_trace_write(f) == MTMQ_RC_OK);
+        CHECK(test_trace_check(f, q) == 0);
+        fclose(f);
+        CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+    }
+    CHECK(mtmq_trace_write(NULL) == MTMQ_RC_ERROR);
+#else
+    FILE *f = tmpfile();
+    CHECK(f);
+    CHECK(mtmq_trace_write(f) == MTMQ_RC_ERROR);
+    fclose(f);
+#endif
+
+    return 0;
+}
+
+
+/* Test of message stamps: age of popped message is time since its push or
+ * commit, consumers account residency in statistics, for all engines.
+ */
+static int test_stamp_one(int flags)
+{
+    mtmq_attr_t attr;
+    int64_t age;
+    int code;
+    void *data, *buf;
+
+    mtmq_t *q = test_create(4, flags | MTMQ_F_STAMP);
+    CHECK(q);
+    CHECK(mtmq_push(q, 1, NULL, 0) == MTMQ_RC_OK);
+    usleep(30000);
+    CHECK(mtmq_push(q, 2, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_pop_aged(q, &code, &data, &age, 0) == MTMQ_RC_OK && code == 1);
+    CHECK(age >= 25000000 && age < 1000000000);
+    CHECK(mtmq_pop_aged(q, &code, &data, &age, 0) == MTMQ_RC_OK && code == 2);
+    CHECK(age >= 0 && age < 25000000);
+    CHECK(mtmq_pop_aged(q, &code, &data, &age, 10) == MTMQ_RC_TIMEDOUT);
+    // plain pop of stamped message is accounted too
+    CHECK(test_fifo(q, 4) == 0);
+#ifndef MTMQ_NO_STATS
+    mtmq_stats_t st;
+    CHECK(mtmq_get_stats(q, &st) == MTMQ_RC_OK);
+    CHECK(st.res_num == 6 && st.res_ns >= 25000000);
+    CHECK(test_hist_sum(st.res_hist) == 6);
+#endif
+    CHECK(test_fin_wakes(q, 0) == 0);
+    CHECK(mtmq_pop_aged(q, &code, &data, &age, -1) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    // reserved message is stamped by commit
+    mtmq_attr_init(&attr);
+    attr.flags = flags | MTMQ_F_STAMP;
+    attr.payload_size = 8;
+    q = mtmq_create_ex(4, &attr);
+    CHECK(q);
+    CHECK(mtmq_reserve(q, &buf, 0) == MTMQ_RC_OK);
+    usleep(50000);
+    CHECK(mtmq_commit(q, buf, 3) == MTMQ_RC_OK);
+    CHECK(mtmq_pop_aged(q, &code, &data, &age, 0) == MTMQ_RC_OK && code == 3);
+    CHECK(age >= 0 && age < 40000000);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    q = test_create(4, flags);
+    CHECK(q);
+    CHECK(mtmq_push(q, 1, NULL, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_pop_aged(q, &code, &data, &age, 0) == MTMQ_RC_ERROR);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    return 0;
+}
+
+
+static int test_stamp(void)
+{
+    CHECK(test_stamp_one(0) == 0);
+    CHECK(test_stamp_one(MTMQ_F_SPSC) == 0);
+    CHECK(test_stamp_one(MTMQ_F_MPMC) == 0);
+
+    // replaced data keeps stamp of conflated message
+    int64_t age;
+    int code;
+    void *data;
+    mtmq_t *q = test_create(4, MTMQ_F_STAMP | MTMQ_F_CONFLATE);
+    CHECK(q);
+    CHECK(mtmq_push(q, 1, NULL, 0) == MTMQ_RC_OK);
+    usleep(30000);
+    CHECK(mtmq_push(q, 1, (void*)1L, 0) == MTMQ_RC_OK);
+    CHECK(mtmq_pop_aged(q, &code, &data, &age, 0) == MTMQ_RC_OK && data == (void*)1L);
+    CHECK(age >= 25000000);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    mtmq_attr_t attr;
+    mtmq_attr_init(&attr);
+    attr.flags = MTMQ_F_STAMP;
+    attr.max_size = 8;
+    CHECK(!mtmq_create_ex(4, &attr));
+    CHECK(!test_create(4, MTMQ_F_STAMP | MTMQ_F_UNBOUNDED));
+
+    return 0;
+}
+
+
+// Element of typed queues.
+typedef struct test_pt {
+    int x;
+    double y;
+} test_pt_t;
+
+
+/* Internal macro: define test of typed queue type name, with the same checks
+ * as test_fifo(), test_stream() and test_fin_wakes() do for mtmq_t. Queue
+ * has capacity of 8 elements, and is static because of its size.
+ */
+#define TEST_TYPED(name)                                                                \
+static name##_t name##_q;                                                               \
+                                                                                        \
+static void *name##_wr(void *arg)                                                       \
+{                                                                                       \
+    (void)arg;                                                                          \
+    for (int i=0; i<100000; i++)                                                        \
+        name##_push(&name##_q, &(test_pt_t){ .x = i }, -1);                             \
+    return NULL;                                                                        \
+}                                                                                       \
+                                                                                        \
+static void *name##_rd(void *arg)                                                       \
+{                                                                                       \
+    test_pt_t v;                                                                        \
+    *(int*)arg = name##_pop(&name##_q, &v, -1);                                         \
+    return NULL;                                                                        \
+}                                                                                       \
+                                                                                        \
+static int name##_test(void)                                                            \
+{                                                                                       \
+    name##_t *q = &name##_q;                                                            \
+    test_pt_t v = {0};                                                                  \
+    pthread_t tid;                                                                      \
+    int rc = -1;                                                                        \
+                                                                                        \
+    name##_init(q);                                                                     \
+    for (int k=0; k<3; k++) {                                                           \
+        for (int i=0; i<8; i++)                                                         \
+            CHECK(name##_try_push(q, &(test_pt_t){ i, i / 2.0 }) == MTMQ_RC_OK);        \
+        CHECK(name##_count(q) == 8);                                                    \
+        CHECK(name##_try_push(q, &v) == MTMQ_RC_TIMEDOUT);                              \
+        CHECK(name##_push(q, &v, 10) == MTMQ_RC_TIMEDOUT);                              \
+        for (int i=0; i<8; i++)                                                         \
+            CHECK(name##_pop(q, &v, 0) == MTMQ_RC_OK && v.x == i && v.y == i / 2.0);    \
+        CHECK(name##_try_pop(q, &v) == MTMQ_RC_TIMEDOUT);                               \
+        CHECK(name##_pop(q, &v, 10) == MTMQ_RC_TIMEDOUT);                               \
+    }                                                                                   \
+                                                                                        \
+    CHECK(pthread_create(&tid, NULL, name##_wr, NULL) == 0);                            \
+    for (int i=0; i<100000; i++)                                                        \
+        CHECK(name##_pop(q, &v, -1) == MTMQ_RC_OK && v.x == i);                         \
+    CHECK(pthread_join(tid, NULL) == 0);                                                \
+                                                                                        \
+    CHECK(pthread_create(&tid, NULL, name##_rd, &rc) == 0);                             \
+    usleep(50000);                                                                      \
+    name##_finalize(q);                                                                 \
+    CHECK(pthread_join(tid, NULL) == 0 && rc == MTMQ_RC_FINALIZED);                     \
+    CHECK(name##_push(q, &v, 0) == MTMQ_RC_FINALIZED);                                  \
+    name##_destroy(q);                                                                  \
+                                                                                        \
+    return 0;                                                                           \
+}
+
+MTMQ_SPSC_TYPED(test_tspsc, test_pt_t, 8)
+MTMQ_MPMC_TYPED(test_tmpmc, test_pt_t, 8)
+TEST_TYPED(test_tspsc)
+TEST_TYPED(test_tmpmc)
+
+
+/* Test of typed queues: both engines keep order and report full, empty
+ * and finalized queue as mtmq_t does.
+ */
+static int test_typed(void)
+{
+    CHECK(test_tspsc_test() == 0);
+    CHECK(test_tmpmc_test() == 0);
+    return 0;
+}
+
+
+// Callback of notification counting its calls.
+static void test_notify_count(void *arg)
+{
+    (*(int*)arg)++;
+}
+
+
+static void test_notify_post(void *arg)
+{
+    sem_post(arg);
+}
+
+
+// Side of queue in event loop style: try operation, on failure wait for notification.
+typedef struct test_loop {
+    mtmq_t *q;
+    int n;  // messages to push, 0 for consumer
+    long sum;  // sum of codes popped by consumer
+    int bad;  // unexpected results
+    pthread_t tid;
+} test_loop_t;
+
+
+static void *test_loop_run(void *arg)
+{
+    test_loop_t *l = arg;
+    sem_t s;
+    mtmq_notify_t n = { .fn = test_notify_post, .arg = &s };
+    int i = 1, code, rc;
+    void *data;
+
+    sem_init(&s, 0, 0);
+    for (;;) {
+        rc = l->n ? mtmq_try_push(l->q, i, NULL) : mtmq_try_pop(l->q, &code, &data);
+        if (rc == MTMQ_RC_OK) {
+            l->sum += l->n ? 0 : code;
+            if (l->n && ++i > l->n)
+                break;
+            continue;
+        }
+        if (rc != MTMQ_RC_TIMEDOUT)
+            break;
+        if (mtmq_notify(l->q, l->n ? 1 : 0, &n) != MTMQ_RC_OK)
+            l->bad++;
+        sem_wait(&s);
+    }
+    if (!l->n && rc != MTMQ_RC_FINALIZED)
+        l->bad++;
+    sem_destroy(&s);
+    return NULL;
+}
+
+
+/* Test of non-blocking operations and readiness notifications: callback is
+ * called once queue becomes ready or finalized, at once if it is ready
+ * already, and not after cancellation. Event loop style producers and
+ * consumers exchange all messages.
+ */
+static int test_notify_one(int flags, int np, int nc)
+{
+    mtmq_notify_t n = { .fn = test_notify_count };
+    int fired = 0, code;
+    void *data;
+
+    n.arg = &fired;
+    mtmq_t *q = test_create(8, flags);
+    CHECK(q);
+    CHECK(mtmq_try_pop(q, &code, &data) == MTMQ_RC_TIMEDOUT);
+    for (int i=0; i<8; i++)
+        CHECK(mtmq_try_push(q, i, NULL) == MTMQ_RC_OK);
+    CHECK(mtmq_try_push(q, 8, NULL) == MTMQ_RC_TIMEDOUT);
+    CHECK(mtmq_notify(q, 0, &n) == MTMQ_RC_OK && fired == 1);
+    CHECK(mtmq_notify_cancel(q, &n) == MTMQ_RC_ERROR);
+    CHECK(mtmq_notify(q, 1, &n) == MTMQ_RC_OK && fired == 1);
+    CHECK(mtmq_notify(q, 1, &n) == MTMQ_RC_ERROR);
+    CHECK(mtmq_try_pop(q, &code, &data) == MTMQ_RC_OK && code == 0 && fired == 2);
+    for (int i=1; i<8; i++)
+        CHECK(mtmq_try_pop(q, &code, &data) == MTMQ_RC_OK && code == i);
+    CHECK(mtmq_notify(q, 0, &n) == MTMQ_RC_OK && fired == 2);
+    CHECK(mtmq_notify_cancel(q, &n) == MTMQ_RC_OK);
+    CHECK(mtmq_try_push(q, 1, NULL) == MTMQ_RC_OK && fired == 2);
+    CHECK(mtmq_try_pop(q, &code, &data) == MTMQ_RC_OK);
+    CHECK(mtmq_notify(q, 0, &n) == MTMQ_RC_OK && fired == 2);
+    mtmq_finalize(q);
+    CHECK(fired == 3);
+    CHECK(mtmq_try_push(q, 1, NULL) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_try_pop(q, &code, &data) == MTMQ_RC_FINALIZED);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    test_loop_t wr[4], rd[4];
+    long sum = 0;
+    q = test_create(4, flags);
+    CHECK(q);
+    for (int i=0; i<nc; i++) {
+        rd[i] = (test_loop_t){ .q = q };
+        CHECK(pthread_create(&rd[i].tid, NULL, test_loop_run, &rd[i]) == 0);
+    }
+    for (int i=0; i<np; i++) {
+        wr[i] = (test_loop_t){ .q = q, .n = 50000 };
+        CHECK(pthread_create(&wr[i].tid, NULL, test_loop_run, &wr[i]) == 0);
+    }
+    for (int i=0; i<np; i++) {
+        CHECK(pthread_join(wr[i].tid, NULL) == 0);
+        CHECK(wr[i].bad == 0);
+    }
+    mtmq_finalize(q);
+    for (int i=0; i<nc; i++) {
+        CHECK(pthread_join(rd[i].tid, NULL) == 0);
+        CHECK(rd[i].bad == 0);
+        sum += rd[i].sum;
+    }
+    CHECK(sum == np * 50000L * 50001 / 2);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    return 0;
+}
+
+
+static int test_notify(void)
+{
+    mtmq_notify_t n = { .fn = test_notify_post };
+
+    CHECK(test_notify_one(0, 3, 3) == 0);
+    CHECK(test_notify_one(MTMQ_F_SPSC, 1, 1) == 0);
+    CHECK(test_notify_one(MTMQ_F_MPMC, 3, 3) == 0);
+
+    mtmq_t *q = mtmq_create_shared(NULL, 4, NULL);
+    CHECK(q);
+    CHECK(mtmq_notify(q, 0, &n) == MTMQ_RC_ERROR);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+    q = test_create_sharded(4, 0, 2);
+    CHECK(q);
+    CHECK(mtmq_notify(q, 0, &n) == MTMQ_RC_ERROR);
+    CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+    return 0;
+}
+
+
+// Test table, in order of features.
+static const struct {
+    const char *name;
+    int (*fn)(void);
+} tests[] = {
+    {"spsc", test_spsc},
+    {"mpmc", test_mpmc},
+    {"batch", test_batch},
+    {"spin", test_spin},
+    {"layout", test_layout},
+    {"reserve", test_reserve},
+    {"pow2", test_pow2},
+    {"stats", test_stats},
+    {"fd", test_fd},
+    {"lanes", test_lanes},
+    {"pop_any", test_pop_any},
+    {"elastic", test_elastic},
+    {"unbounded", test_unbounded},
+    {"wake", test_wake},
+    {"shared", test_shared},
+    {"deadline", test_deadline},
+    {"drain", test_drain},
+    {"pool", test_pool},
+    {"shards", test_shards},
+    {"bcast", test_bcast},
+    {"conflate", test_conflate},
+    {"overwrite", test_overwrite},
+    {"mag", test_mag},
+    {"numa", test_numa},
+    {"wake_batch", test_wake_batch},
+    {"trace", test_trace},
+    {"stamp", test_stamp},
+    {"typed", test_typed},
+    {"notify", test_notify},
+};
+
+
+/* Run tests.
+ * In:
+ *   argc, argv - names of tests to run, none - all of them
+ * Out:
+ *   0 - all tests passed, 1 - some failed or unknown test name
+ */
+static int run_tests(int argc, char **argv)
+{
+    int ntests = (int)(sizeof(tests) / sizeof(tests[0]));
+    int failed = 0;
+
+    for (int i=0; i<argc; i++) {
+        int found = 0;
+        for (int j=0; j<ntests; j++)
+            found |= !strcmp(argv[i], tests[j].name);
+        if (!found) {
+            printf("unknown test %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    for (int j=0; j<ntests; j++) {
+        int run = (argc == 0);
+        for (int i=0; i<argc; i++)
+            run |= !strcmp(argv[i], tests[j].name);
+        if (!run)
+            continue;
+        int rc = tests[j].fn();
+        printf("%s: %s\n", tests[j].name, rc ? "FAILED" : "ok");
+        failed |= rc;
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,360 @@
+/* Behavior tests of mtmq.hpp: test_cpp test [NAME...]
+ *
+ * Same conventions as tests of test.c: each test returns 0 on success, or
+ * prints failed check and returns 1.
+ */
+
+#include "mtmq.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return 1; \
+        } \
+    } while (0)
+
+
+// Number of live test elements, to check that queue destroys what it holds.
+static std::atomic<int> s_live{0};
+
+// Move-only element owning heap value.
+struct test_elt {
+    std::unique_ptr<long> v;
+
+    test_elt() { s_live++; }
+    explicit test_elt(long x) : v(new long(x)) { s_live++; }
+    test_elt(test_elt &&o) noexcept : v(std::move(o.v)) { s_live++; }
+    test_elt &operator=(test_elt &&o) noexcept { v = std::move(o.v); return *this; }
+    ~test_elt() { s_live--; }
+};
+
+
+/* Internal helper: fill empty queue, check that full queue times out without
+ * taking element, pop everything back in order, check that empty queue times
+ * out, then stream n elements from another thread.
+ */
+template <typename Q>
+static int test_typed_fifo(Q &q, int n)
+{
+    constexpr int size = 8;
+
+    for (int i=0; i<size; i++)
+        CHECK(q.try_emplace(i) == MTMQ_RC_OK);
+    CHECK(q.count() == size);
+    test_elt e(size);
+    CHECK(q.try_push(std::move(e)) == MTMQ_RC_TIMEDOUT);
+    CHECK(q.push(std::move(e), 10) == MTMQ_RC_TIMEDOUT);
+    CHECK(e.v && *e.v == size);
+
+    for (int i=0; i<size; i++)
+        CHECK(q.pop(e, 0) == MTMQ_RC_OK && *e.v == i);
+    CHECK(q.try_pop(e) == MTMQ_RC_TIMEDOUT);
+    CHECK(q.pop(e, 10) == MTMQ_RC_TIMEDOUT);
+
+    std::thread wr([&] {
+        for (int i=0; i<n; i++)
+            q.push(test_elt(i));
+    });
+    int bad = 0;
+    for (int i=0; i<n; i++) {
+        CHECK(q.pop(e) == MTMQ_RC_OK);
+        bad += *e.v != i;
+    }
+    wr.join();
+    CHECK(bad == 0);
+
+    return 0;
+}
+
+
+// Internal helper: check that finalize wakes up consumer blocked on queue.
+template <typename Q>
+static int test_typed_fin(Q &q)
+{
+    int rc = -1;
+    std::thread rd([&] {
+        test_elt e;
+        rc = q.pop(e);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    q.finalize();
+    rd.join();
+    CHECK(rc == MTMQ_RC_FINALIZED);
+    CHECK(q.is_finalized());
+    CHECK(q.push(test_elt(0), 0) == MTMQ_RC_FINALIZED);
+
+    return 0;
+}
+
+
+/* Test of typed queues: order, full and empty queue of all cardinalities,
+ * elements copied or moved only when pushed, finalization, and elements left
+ * in queue destroyed with it.
+ */
+static int test_typed()
+{
+    {
+        auto q = std::make_unique<mtmq_cpp::spsc_queue<test_elt, 8>>();
+        CHECK(test_typed_fifo(*q, 100000) == 0);
+        CHECK(test_typed_fin(*q) == 0);
+    }
+    {
+        auto q = std::make_unique<mtmq_cpp::mpmc_queue<test_elt, 8>>();
+        CHECK(test_typed_fifo(*q, 100000) == 0);
+        CHECK(test_typed_fin(*q) == 0);
+    }
+    {
+        auto q = std::make_unique<mtmq_cpp::typed_queue<test_elt, 8, true, false>>();
+        CHECK(test_typed_fifo(*q, 20000) == 0);
+        CHECK(test_typed_fin(*q) == 0);
+    }
+
+    // push which loses to concurrent finalization does not take element
+    for (int k=0; k<200; k++) {
+        auto q = std::make_unique<mtmq_cpp::spsc_queue<test_elt, 1024>>();
+        int bad = 0;
+        std::thread wr([&] {
+            for (long i=0; ; i++) {
+                test_elt e(i);
+                int rc = q->try_push(std::move(e));
+                if (rc == MTMQ_RC_FINALIZED) {
+                    bad = !e.v || *e.v != i;
+                    break;
+                }
+            }
+        });
+        std::this_thread::yield();
+        q->finalize();
+        wr.join();
+        CHECK(!bad);
+    }
+
+    // elements pushed by several producers are popped exactly once
+    {
+        const long n = 50000;
+        auto q = std::make_unique<mtmq_cpp::mpmc_queue<test_elt, 16>>();
+        std::atomic<long> sum{0}, num{0};
+        std::vector<std::thread> rd, wr;
+        for (int k=0; k<3; k++) {
+            rd.emplace_back([&] {
+                test_elt e;
+                while (q->pop(e) == MTMQ_RC_OK) {
+                    sum += *e.v;
+                    num++;
+                }
+            });
+            wr.emplace_back([&] {
+                for (long i=1; i<=n; i++)
+                    q->push(test_elt(i));
+            });
+        }
+        for (auto &t : wr)
+            t.join();
+        q->finalize();
+        for (auto &t : rd)
+            t.join();
+        CHECK(num == 3 * n && sum == 3 * n * (n + 1) / 2);
+    }
+
+    {
+        mtmq_cpp::spsc_queue<std::string, 4> q;
+        std::string s = "long enough string not to fit in small buffer";
+        CHECK(q.try_push(s) == MTMQ_RC_OK && !s.empty());
+        CHECK(q.push(std::move(s)) == MTMQ_RC_OK && s.empty());
+        CHECK(q.try_emplace(3, 'x') == MTMQ_RC_OK);
+        CHECK(q.pop(s, 0) == MTMQ_RC_OK && s.size() > 16);
+        CHECK(q.pop(s, 0) == MTMQ_RC_OK && s.size() > 16);
+        CHECK(q.pop(s, 0) == MTMQ_RC_OK && s == "xxx");
+
+        mtmq_cpp::mpmc_queue<test_elt, 4> q2;
+        CHECK(q2.try_emplace(5L) == MTMQ_RC_OK);
+        CHECK(q2.try_emplace(6L) == MTMQ_RC_OK);
+    }
+    CHECK(s_live == 0);
+
+    return 0;
+}
+
+
+#ifdef MTMQ_HPP_COROUTINES
+// Coroutine started eagerly and never awaited, for tests only.
+struct test_task {
+    struct promise_type {
+        test_task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::abort(); }
+    };
+};
+
+
+// Results of test coroutines.
+struct test_co {
+    std::atomic<long> sum{0};  // sum of codes popped by consumers
+    std::atomic<int> done{0};  // finished coroutines
+    std::atomic<int> bad{0};  // unexpected results
+};
+
+
+static test_task test_co_pop(mtmq_t *q, test_co &t)
+{
+    long sum = 0;
+    for (;;) {
+        auto r = co_await mtmq_cpp::async_pop(q);
+        if (r.rc != MTMQ_RC_OK) {
+            t.bad += r.rc != MTMQ_RC_FINALIZED;
+            break;
+        }
+        sum += r.code;
+    }
+    t.sum += sum;
+    t.done++;
+}
+
+
+static test_task test_co_push(mtmq_t *q, int n, test_co &t)
+{
+    for (int i=1; i<=n; i++)
+        t.bad += co_await mtmq_cpp::async_push(q, i, nullptr) != MTMQ_RC_OK;
+    t.done++;
+}
+
+
+// Internal helper to wait until n test coroutines finished.
+static void test_co_wait(test_co &t, int n)
+{
+    while (t.done < n)
+        std::this_thread::yield();
+}
+
+
+/* Test of awaitable operations: consumers suspended on empty queue are
+ * resumed by producer threads, producer suspended on full queue by consumer
+ * thread, and consumers finish once queue is finalized and drained.
+ */
+static int test_await()
+{
+    const int n = 50000;
+
+    for (int flags : {0, (int)MTMQ_F_SPSC, (int)MTMQ_F_MPMC}) {
+        int np = (flags & MTMQ_F_SPSC) ? 1 : 3;
+        mtmq_attr_t attr;
+        mtmq_attr_init(&attr);
+        attr.flags = flags;
+        mtmq_t *q = mtmq_create_ex(4, &attr);
+        CHECK(q);
+
+        test_co t;
+        for (int i=0; i<np; i++)
+            test_co_pop(q, t);
+        CHECK(t.done == 0);
+        std::vector<std::thread> wr;
+        for (int i=0; i<np; i++)
+            wr.emplace_back([&] { test_co_push(q, n, t); });
+        for (auto &th : wr)
+            th.join();
+        test_co_wait(t, np);
+        mtmq_finalize(q);
+        test_co_wait(t, 2 * np);
+        CHECK(t.bad == 0 && t.sum == (long)np * n * (n + 1) / 2);
+        CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+
+        q = mtmq_create_ex(4, &attr);
+        CHECK(q);
+        test_co t2;
+        test_co_push(q, n, t2);
+        CHECK(t2.done == 0);
+        long sum = 0;
+        for (int i=0; i<n; i++) {
+            int code;
+            void *data;
+            CHECK(mtmq_pop(q, &code, &data, -1) == MTMQ_RC_OK);
+            sum += code;
+        }
+        test_co_wait(t2, 1);
+        CHECK(t2.bad == 0 && sum == (long)n * (n + 1) / 2);
+        mtmq_finalize(q);
+        test_co t3;
+        test_co_push(q, 1, t3);
+        test_co_pop(q, t3);
+        CHECK(t3.done == 2 && t3.bad == 1);
+        CHECK(mtmq_destroy(q) == MTMQ_RC_OK);
+    }
+
+    return 0;
+}
+#else
+// Awaitables are not built without C++20 coroutines.
+static int test_await()
+{
+    return 0;
+}
+#endif
+
+
+// Test table, in order of features.
+static const struct {
+    const char *name;
+    int (*fn)();
+} tests[] = {
+    {"typed", test_typed},
+    {"await", test_await},
+};
+
+
+/* Run tests.
+ * In:
+ *   argc, argv - names of tests to run, none - all of them
+ * Out:
+ *   0 - all tests passed, 1 - some failed or unknown test name
+ */
+static int run_tests(int argc, char **argv)
+{
+    int ntests = (int)(sizeof(tests) / sizeof(tests[0]));
+    int failed = 0;
+
+    for (int i=0; i<argc; i++) {
+        int found = 0;
+        for (int j=0; j<ntests; j++)
+            found |= !std::strcmp(argv[i], tests[j].name);
+        if (!found) {
+            std::printf("unknown test %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    for (int j=0; j<ntests; j++) {
+        int run = (argc == 0);
+        for (int i=0; i<argc; i++)
+            run |= !std::strcmp(argv[i], tests[j].name);
+        if (!run)
+            continue;
+        int rc = tests[j].fn();
+        std::printf("%s: %s\n", tests[j].name, rc ? "FAILED" : "ok");
+        failed |= rc;
+    }
+
+    return failed ? 1 : 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || std::strcmp(argv[1], "test")) {
+        std::printf("Usage: %s test [NAME...]\n", argv[0]);
+        return 1;
+    }
+
+    return run_tests(argc - 2, argv + 2);
+}
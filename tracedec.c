@@ -0,0 +1,185 @@
+/* Decoder of mtmq trace files.
+ *
+ * Reads file saved by mtmq_trace_write() from program built with MTMQ_TRACE
+ * and prints time spent on contended locks and blocking waits, number of
+ * wake-ups, and per queue residency time of messages: time from enqueue
+ * to dequeue, matched by queue position (so exact for FIFO queues, but not
+ * for queues with priority levels).
+ */
+
+
+#include "mtmq_trace.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Enqueue or dequeue of single message.
+typedef struct msg_ev {
+    uint64_t queue;
+    uint64_t pos;
+    uint64_t ns;
+    int deq;  // 0 - enqueue, 1 - dequeue (or drop)
+} msg_ev_t;
+
+
+// Summary of durations.
+typedef struct sum {
+    long num;
+    uint64_t total;
+    uint64_t max;
+} sum_t;
+
+
+static void sum_add(sum_t *s, uint64_t ns)
+{
+    s->num++;
+    s->total += ns;
+    if (ns > s->max)
+        s->max = ns;
+}
+
+
+static void sum_print(const char *name, const sum_t *s)
+{
+    printf("%-12s %10ld  total %12.1f us  avg %9.2f us  max %9.1f us\n", name, s->num,
+        s->total / 1e3, s->num ? s->total / 1e3 / s->num : 0.0, s->max / 1e3);
+}
+
+
+static int cmp_msg(const void *a, const void *b)
+{
+    const msg_ev_t *x = a, *y = b;
+    if (x->queue != y->queue)
+        return (x->queue < y->queue) ? -1 : 1;
+    if (x->pos != y->pos)
+        return (x->pos < y->pos) ? -1 : 1;
+    if (x->ns != y->ns)
+        return (x->ns < y->ns) ? -1 : 1;
+    return x->deq - y->deq;
+}
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+
+// Print residency times of one queue, v - sorted times of n messages.
+static void print_queue(uint64_t queue, const uint64_t *v, long n, long lost)
+{
+    double total = 0;
+    for (long i=0; i<n; i++)
+        total += v[i];
+
+    printf("queue %#llx: %ld messages, %ld unmatched\n", (unsigned long long)queue, n, lost);
+    if (n)
+        printf("  residency us: min %.2f  avg %.2f  p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+            v[0] / 1e3, total / n / 1e3, v[n/2] / 1e3, v[n*9/10] / 1e3, v[n*99/100] / 1e3, v[n-1] / 1e3);
+}
+
+
+int main(int argc, char **argv)
+{
+    char magic[8];
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s TRACE_FILE\n", argv[0]);
+        return 2;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, MTMQ_TRACE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s: not an mtmq trace file\n", argv[1]);
+        return 1;
+    }
+
+    sum_t lock = {0}, wait[2] = {{0}}, wake[2] = {{0}};
+    long drops = 0;
+    long nmsg = 0, cap = 0;
+    msg_ev_t *msgs = NULL;
+    mtmq_trace_rec_t r;
+
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        switch (r.type) {
+        case MTMQ_TEV_LOCK:
+            sum_add(&lock, r.arg);
+            continue;
+        case MTMQ_TEV_WAIT:
+            sum_add(&wait[r.n != 0], r.arg);
+            continue;
+        case MTMQ_TEV_WAKE:
+            sum_add(&wake[r.arg != 0], r.n);
+            continue;
+        case MTMQ_TEV_DROP:
+            drops++;
+            break;
+        case MTMQ_TEV_ENQ:
+        case MTMQ_TEV_DEQ:
+            break;
+        default:
+            continue;
+        }
+
+        // one event per message of batch
+        if (nmsg + r.n > cap) {
+            cap = (cap + r.n) * 2;
+            msgs = realloc(msgs, sizeof(*msgs) * cap);
+            if (!msgs) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+        for (uint32_t i=0; i<r.n; i++) {
+            msg_ev_t *m = &msgs[nmsg++];
+            m->queue = r.queue;
+            m->pos = r.arg - r.n + i;
+            m->ns = r.ns;
+            m->deq = (r.type != MTMQ_TEV_ENQ);
+        }
+    }
+    fclose(f);
+
+    sum_print("lock", &lock);
+    sum_print("wait rd", &wait[0]);
+    sum_print("wait wr", &wait[1]);
+    printf("%-12s %10ld\n%-12s %10ld\n%-12s %10ld\n", "wake rd", wake[0].num, "wake wr", wake[1].num, "drop", drops);
+
+    // enqueue and dequeue of position follow each other in time
+    qsort(msgs, nmsg, sizeof(*msgs), cmp_msg);
+    uint64_t *res = malloc(sizeof(*res) * (nmsg + 1));
+    if (!res) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    long n = 0, lost = 0;
+    for (long i=0; i<nmsg; i++) {
+        const msg_ev_t *m = &msgs[i];
+        if (m->deq) {
+            const msg_ev_t *p = i ? &msgs[i-1] : NULL;
+            if (p && !p->deq && p->queue == m->queue && p->pos == m->pos)
+                res[n++] = m->ns - p->ns;
+            else
+                lost++;
+        } else if (i+1 == nmsg || msgs[i+1].queue != m->queue || msgs[i+1].pos != m->pos || msgs[i+1].deq == 0)
+            lost++;
+
+        if (i+1 == nmsg || msgs[i+1].queue != m->queue) {
+            qsort(res, n, sizeof(*res), cmp_u64);
+            print_queue(m->queue, res, n, lost);
+            n = lost = 0;
+        }
+    }
+
+    free(res);
+    free(msgs);
+    return 0;
+}